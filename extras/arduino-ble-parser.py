@@ -1,17 +1,21 @@
 '''
-Convert ArduinoBLE debug files into Btsnoop files ready to be analyzed using wireshark or hcidump
+Convert ArduinoBLE debug files into Btsnoop files ready to be analyzed using wireshark or hcidump,
+or print Btsnoop files (e.g. written by HCICapture) in the debug format
 Btsnoop file format reference
  https://www.fte.com/WebHelpII/Sodera/Content/Technical_Information/BT_Snoop_File_Format.htm
 '''
 
 import  os
+import sys
+import struct
 import argparse
 
 DEBUG = False
 
 parser = argparse.ArgumentParser()
 parser.add_argument('-i', dest='inputPath', type=str, required=True, help='input file containing debug log')
-parser.add_argument('-o', dest='outputPath', type=str, required=True, help='result file that will contain the btsnoop encoded debug file')
+parser.add_argument('-o', dest='outputPath', type=str, help='result file that will contain the btsnoop encoded debug file')
+parser.add_argument('-r', dest='readBtsnoop', action='store_true', help='read a btsnoop input file and print it as debug log, to the output file if given')
 args = parser.parse_args()
 
 # Extract only hci debug messages
@@ -74,12 +78,53 @@ def convertToBtsnoop(inputPath, outputPath):
       print('\n')
   outputFile.close()
 
+# Microseconds between year 0 and 1970 used by btsnoop timestamps
+BTSNOOP_EPOCH_DELTA = 0x00dcddb30f2f8000
+
+def readBtsnoop(inputPath, outputFile):
+  inputFile = open(inputPath, 'rb')
+  header = inputFile.read(16)
+  if (len(header) < 16) or (header[0:8] != b"btsnoop\0"):
+    sys.exit("not a btsnoop file: " + inputPath)
+  version, datalink = struct.unpack('>II', header[8:16])
+  if datalink != 1002:
+    sys.exit("unsupported btsnoop datalink: " + str(datalink))
+
+  firstTimestamp = None
+  while True:
+    record = inputFile.read(24)
+    if len(record) < 24:
+      break
+    originalLength, includedLength, flags, drops, timestamp = struct.unpack('>IIIIQ', record)
+    hciMessage = inputFile.read(includedLength)
+    if len(hciMessage) < includedLength:
+      break
+    if firstTimestamp is None:
+      firstTimestamp = timestamp
+    hciType = {1: "COMMAND", 2: "ACLDATA", 4: "EVENT"}.get(hciMessage[0] if includedLength else 0, "UNKNOWN")
+    hciDirection = "RX <-" if (flags & 0x01) else "TX ->"
+    # lines stay readable by the debug log converter, extra details go last
+    truncated = " (" + str(originalLength) + " bytes)" if originalLength != includedLength else ""
+    outputFile.write("HCI %s %s %s %.6f%s\n" % (hciType, hciDirection, hciMessage.hex().upper(), (timestamp - firstTimestamp) / 1000000.0, truncated))
+    if DEBUG:
+      print(timestamp - BTSNOOP_EPOCH_DELTA)
+      print(drops)
+  inputFile.close()
+
 inputPath = args.inputPath
 outputPath = args.outputPath
-tempFile = "temp-debug-print.txt"
 # Run
-extractHCIDebugPrint(inputPath,tempFile)
-convertToBtsnoop(tempFile, outputPath)
-# Delete temp file
-os.remove(tempFile) 
+if args.readBtsnoop:
+  outputFile = open(outputPath, 'w') if outputPath else sys.stdout
+  readBtsnoop(inputPath, outputFile)
+  if outputPath:
+    outputFile.close()
+else:
+  if not outputPath:
+    parser.error("the following arguments are required: -o")
+  tempFile = "temp-debug-print.txt"
+  extractHCIDebugPrint(inputPath,tempFile)
+  convertToBtsnoop(tempFile, outputPath)
+  # Delete temp file
+  os.remove(tempFile) 
 
@@ -38,6 +38,8 @@
 typedef arduino::String String;
 typedef bool boolean;
 
+extern Stream Serial;
+
 /******************************************************************************
    FUNCTION PROTOTYPES
  ******************************************************************************/
@@ -9,11 +9,13 @@
 class Stream 
 {
 public:
-  Stream(const char *name = NULL);
-  ~Stream();
+  Stream(const char *name = NULL) { (void)name; }
+  virtual ~Stream() {}
 
   void flush() {}
 
+  virtual size_t write(const unsigned char*, size_t len) { return len; }
+
   size_t print(const char[]) { return 0; }
   size_t print(char) { return 0; }
   size_t print(unsigned char, int) { return 0; }
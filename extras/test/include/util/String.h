@@ -37,7 +37,8 @@ namespace arduino {
 //     -std=c++0x
 
 class __FlashStringHelper;
-#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(PSTR(string_literal)))
+// there is no flash address space on the host, F() strings are plain C strings
+#define F(string_literal) (string_literal)
 
 // An inherited class for holding the result of a concatenation.  These
 // result objects are assumed to be writable by subsequent concatenations.
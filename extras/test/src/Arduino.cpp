@@ -29,6 +29,8 @@
 
 static unsigned long current_millis = 0;
 
+Stream Serial;
+
 /******************************************************************************
    PUBLIC FUNCTIONS
  ******************************************************************************/
@@ -42,3 +44,8 @@ unsigned long millis()
 {
   return current_millis;
 }
+
+unsigned long micros()
+{
+  return current_millis * 1000;
+}
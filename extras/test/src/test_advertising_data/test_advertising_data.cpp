@@ -182,3 +182,65 @@ TEST_CASE("BLE test raw data", "[ArduinoBLE::BLEAdvertisingData]")
   advData.clear();
   BLE.setAdvertisingData(advData);
 }
+
+TEST_CASE("Extended advertising data", "[ArduinoBLE::BLEAdvertisingData]")
+{
+  BLEAdvertisingData advData;
+  uint8_t manufacturerData[100];
+  bool retVal;
+
+  for (unsigned int i = 0; i < sizeof(manufacturerData); i++) {
+    manufacturerData[i] = i;
+  }
+
+  WHEN("Set data larger than a legacy packet")
+  {
+    retVal = advData.setManufacturerData(manufacturerData, sizeof(manufacturerData));
+    REQUIRE(!retVal);
+
+    retVal = advData.setExtended(true);
+    REQUIRE(retVal);
+    REQUIRE(advData.extended());
+    REQUIRE(advData.availableForWrite() == MAX_EXT_AD_DATA_LENGTH - 2);
+
+    retVal = advData.setManufacturerData(manufacturerData, sizeof(manufacturerData));
+    REQUIRE(retVal);
+    retVal = advData.updateData();
+    REQUIRE(retVal);
+    REQUIRE(advData.dataLength() == sizeof(manufacturerData) + 2);
+    REQUIRE(0 == memcmp(manufacturerData, advData.data() + 2, sizeof(manufacturerData)));
+
+    // the data set doesn't fit a legacy packet anymore
+    retVal = advData.setExtended(false);
+    REQUIRE(!retVal);
+    REQUIRE(advData.extended());
+  }
+
+  WHEN("Clear extended data")
+  {
+    advData.setExtended(true);
+    advData.setManufacturerData(manufacturerData, sizeof(manufacturerData));
+    advData.clear();
+    REQUIRE(advData.extended());
+    REQUIRE(advData.remainingLength() == MAX_EXT_AD_DATA_LENGTH);
+
+    retVal = advData.setExtended(false);
+    REQUIRE(retVal);
+    REQUIRE(advData.remainingLength() == MAX_AD_DATA_LENGTH);
+  }
+
+  WHEN("Copy extended data")
+  {
+    advData.setExtended(true);
+    advData.setManufacturerData(manufacturerData, sizeof(manufacturerData));
+    BLE.setAdvertisingData(advData);
+    BLE.advertise();
+    REQUIRE(BLE.getAdvertisingData().extended());
+    REQUIRE(BLE.getAdvertisingData().dataLength() == 3 + sizeof(manufacturerData) + 2);
+  }
+
+  // Clear BLE advertising data
+  advData.setExtended(false);
+  advData.clear();
+  BLE.setAdvertisingData(advData);
+}
@@ -0,0 +1,82 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch.hpp>
+
+#include "utility/AES128.h"
+
+TEST_CASE("AES-128 block encryption", "[ArduinoBLE::BLEAES128]")
+{
+  WHEN("Encrypting the FIPS-197 example block")
+  {
+    const uint8_t key[16]        = {0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f};
+    const uint8_t plaintext[16]  = {0x00,0x11,0x22,0x33,0x44,0x55,0x66,0x77,0x88,0x99,0xaa,0xbb,0xcc,0xdd,0xee,0xff};
+    const uint8_t ciphertext[16] = {0x69,0xc4,0xe0,0xd8,0x6a,0x7b,0x04,0x30,0xd8,0xcd,0xb7,0x80,0x70,0xb4,0xc5,0x5a};
+    uint8_t result[16];
+
+    BLEAES128 aes(key);
+    aes.encrypt(plaintext, result);
+
+    REQUIRE(memcmp(result, ciphertext, sizeof(ciphertext)) == 0);
+  }
+
+  WHEN("Encrypting several blocks in place with one key")
+  {
+    // NIST SP 800-38A F.1.1 ECB-AES128
+    const uint8_t key[16] = {0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c};
+    uint8_t blocks[2][16] = {
+      {0x6b,0xc1,0xbe,0xe2,0x2e,0x40,0x9f,0x96,0xe9,0x3d,0x7e,0x11,0x73,0x93,0x17,0x2a},
+      {0xae,0x2d,0x8a,0x57,0x1e,0x03,0xac,0x9c,0x9e,0xb7,0x6f,0xac,0x45,0xaf,0x8e,0x51}
+    };
+    const uint8_t expected[2][16] = {
+      {0x3a,0xd7,0x7b,0xb4,0x0d,0x7a,0x36,0x60,0xa8,0x9e,0xca,0xf3,0x24,0x66,0xef,0x97},
+      {0xf5,0xd3,0xd5,0x85,0x03,0xb9,0x69,0x9d,0xe7,0x85,0x89,0x5a,0x96,0xfd,0xba,0xaf}
+    };
+
+    BLEAES128 aes;
+    aes.setKey(key);
+    aes.encrypt(blocks[0], blocks[0]);
+    aes.encrypt(blocks[1], blocks[1]);
+
+    REQUIRE(memcmp(blocks, expected, sizeof(expected)) == 0);
+  }
+
+  WHEN("Encrypting one block under several keys")
+  {
+    // five keys, so that AES-NI builds go through both the four key and the single key loop
+    const uint8_t fipsKey[16]    = {0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f};
+    const uint8_t otherKey[16]   = {0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c};
+    const uint8_t plaintext[16]  = {0x00,0x11,0x22,0x33,0x44,0x55,0x66,0x77,0x88,0x99,0xaa,0xbb,0xcc,0xdd,0xee,0xff};
+    const uint8_t ciphertext[16] = {0x69,0xc4,0xe0,0xd8,0x6a,0x7b,0x04,0x30,0xd8,0xcd,0xb7,0x80,0x70,0xb4,0xc5,0x5a};
+    BLEAES128 ciphers[5];
+    uint8_t results[5][16];
+    uint8_t otherCiphertext[16];
+
+    for (int i = 0; i < 5; i++) {
+      ciphers[i].setKey((i % 2) ? otherKey : fipsKey);
+    }
+    ciphers[1].encrypt(plaintext, otherCiphertext);
+
+    BLEAES128::encrypt(ciphers, 5, plaintext, results);
+
+    for (int i = 0; i < 5; i++) {
+      REQUIRE(memcmp(results[i], (i % 2) ? otherCiphertext : ciphertext, 16) == 0);
+    }
+  }
+}
@@ -0,0 +1,65 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch.hpp>
+
+#include "utility/AESCMAC.h"
+
+TEST_CASE("AES-CMAC computed incrementally", "[ArduinoBLE::BLEAESCMAC]")
+{
+  // RFC 4493 section 4 test vectors
+  const uint8_t key[16] = {0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c};
+  const uint8_t message[64] = {
+    0x6b,0xc1,0xbe,0xe2,0x2e,0x40,0x9f,0x96,0xe9,0x3d,0x7e,0x11,0x73,0x93,0x17,0x2a,
+    0xae,0x2d,0x8a,0x57,0x1e,0x03,0xac,0x9c,0x9e,0xb7,0x6f,0xac,0x45,0xaf,0x8e,0x51,
+    0x30,0xc8,0x1c,0x46,0xa3,0x5c,0xe4,0x11,0xe5,0xfb,0xc1,0x19,0x1a,0x0a,0x52,0xef,
+    0xf6,0x9f,0x24,0x45,0xdf,0x4f,0x9b,0x17,0xad,0x2b,0x41,0x7b,0xe6,0x6c,0x37,0x10
+  };
+  const int lengths[4] = {0, 16, 40, 64};
+  const uint8_t expected[4][16] = {
+    {0xbb,0x1d,0x69,0x29,0xe9,0x59,0x37,0x28,0x7f,0xa3,0x7d,0x12,0x9b,0x75,0x67,0x46},
+    {0x07,0x0a,0x16,0xb4,0x6b,0x4d,0x41,0x44,0xf7,0x9b,0xdd,0x9d,0xd0,0x4a,0x28,0x7c},
+    {0xdf,0xa6,0x67,0x47,0xde,0x9a,0xe6,0x30,0x30,0xca,0x32,0x61,0x14,0x97,0xc8,0x27},
+    {0x51,0xf0,0xbe,0xbf,0x7e,0x3b,0x9d,0x92,0xfc,0x49,0x74,0x17,0x79,0x36,0x3c,0xfe}
+  };
+  uint8_t mac[16];
+
+  BLEAESCMAC cmac(key);
+
+  WHEN("Each message is given at once")
+  {
+    for (int i = 0; i < 4; i++) {
+      cmac.compute(message, lengths[i], mac);
+      REQUIRE(memcmp(mac, expected[i], sizeof(mac)) == 0);
+    }
+  }
+
+  WHEN("Each message is given in pieces that don't follow the blocks")
+  {
+    for (int i = 0; i < 4; i++) {
+      cmac.begin();
+      for (int offset = 0; offset < lengths[i]; offset += 7) {
+        int length = lengths[i] - offset;
+        cmac.update(&message[offset], (length < 7) ? length : 7);
+      }
+      cmac.finish(mac);
+      REQUIRE(memcmp(mac, expected[i], sizeof(mac)) == 0);
+    }
+  }
+}
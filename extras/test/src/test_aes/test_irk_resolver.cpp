@@ -0,0 +1,68 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch.hpp>
+
+#include "utility/IRKResolver.h"
+
+TEST_CASE("Resolve private addresses with bonded IRKs", "[ArduinoBLE::IRKResolver]")
+{
+  // Core specification Vol 3, Part H, D.7 ah random address hash function
+  const uint8_t irk[16]      = {0xec,0x02,0x34,0xa3,0x57,0xc8,0xad,0x05,0x34,0x10,0x10,0xa6,0x0a,0x39,0x7d,0x9b};
+  const uint8_t otherIrk[16] = {0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f,0x10};
+  const uint8_t identity[6]      = {0x11,0x22,0x33,0x44,0x55,0x66};
+  const uint8_t otherIdentity[6] = {0xc1,0xc2,0xc3,0xc4,0xc5,0xc6};
+  const uint8_t addresses[3][6] = {
+    {0x70,0x81,0x94,0x0d,0xfb,0xaa}, // prand 708194, hash 0dfbaa
+    {0x70,0x81,0x94,0x0d,0xfb,0xab},
+    {0x30,0x81,0x94,0x0d,0xfb,0xaa}  // not a resolvable private address
+  };
+
+  IRKResolver resolver;
+
+  REQUIRE(resolver.add(otherIdentity, otherIrk) == 1);
+  REQUIRE(resolver.add(identity, irk) == 1);
+  REQUIRE(resolver.count() == 2);
+
+  WHEN("Resolving one address")
+  {
+    int index = resolver.resolve(addresses[0]);
+
+    REQUIRE(index == 1);
+    REQUIRE(memcmp(resolver.identity(index), identity, 6) == 0);
+  }
+
+  WHEN("Resolving a burst of addresses")
+  {
+    int results[3];
+
+    resolver.resolve(addresses, 3, results);
+
+    REQUIRE(results[0] == 1);
+    REQUIRE(results[1] == -1);
+    REQUIRE(results[2] == -1);
+  }
+
+  WHEN("The bond is removed")
+  {
+    REQUIRE(resolver.remove(identity) == 1);
+    REQUIRE(resolver.count() == 1);
+    REQUIRE(resolver.resolve(addresses[0]) == -1);
+  }
+}
@@ -22,6 +22,19 @@
 #define private public
 #define protected public
 #include "BLEDevice.h"
+#include "HCI.h"
+#include "GAP.h"
+
+static BLEDevice reportedDevices[4];
+static int reportedCount = 0;
+
+static void onDiscovered(BLEDevice device)
+{
+  if (reportedCount < 4) {
+    reportedDevices[reportedCount] = device;
+  }
+  reportedCount++;
+}
 
 TEST_CASE("BLE discovered device test", "[ArduinoBLE::BLEDevice]")
 {
@@ -50,3 +63,50 @@ TEST_CASE("BLE discovered device test", "[ArduinoBLE::BLEDevice]")
   }
 
 }
+
+TEST_CASE("BLE advertising report event with several reports", "[ArduinoBLE::HCI]")
+{
+  // LE Advertising Report with two non connectable reports, one record after the other
+  uint8_t event[] = {
+    0x3e, 0, 0x02, 2,
+    0x03, 0x00,                                                 // event type, address type
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06,                         // address
+    6, 0x05, 0x09, 'f', 'i', 'r', 's',                          // data length, data
+    (uint8_t)-40,                                               // RSSI
+    0x03, 0x01,
+    0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+    4, 0x03, 0x09, 's', 'e',
+    (uint8_t)-70
+  };
+  event[1] = sizeof(event) - 2;
+
+  reportedCount = 0;
+  GAP._scanning = true;
+  GAP.setEventHandler(BLEDiscovered, onDiscovered);
+
+  WHEN("All reports fit in the event")
+  {
+    HCI.handleEventPkt(sizeof(event), event);
+
+    REQUIRE(reportedCount == 2);
+    REQUIRE(reportedDevices[0].address() == "06:05:04:03:02:01");
+    REQUIRE(reportedDevices[0].localName() == "firs");
+    REQUIRE(reportedDevices[0].rssi() == -40);
+    REQUIRE(reportedDevices[1].address() == "16:15:14:13:12:11");
+    REQUIRE(reportedDevices[1].localName() == "se");
+    REQUIRE(reportedDevices[1].rssi() == -70);
+  }
+
+  WHEN("The data length of the last report runs past the end of the event")
+  {
+    event[28] = 5;
+    HCI.handleEventPkt(sizeof(event), event);
+
+    REQUIRE(reportedCount == 1);
+    REQUIRE(reportedDevices[0].address() == "06:05:04:03:02:01");
+    REQUIRE(reportedDevices[0].localName() == "firs");
+  }
+
+  GAP.setEventHandler(BLEDiscovered, NULL);
+  GAP._scanning = false;
+}
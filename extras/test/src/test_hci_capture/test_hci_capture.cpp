@@ -0,0 +1,106 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <catch.hpp>
+
+#include <vector>
+
+#include "utility/HCICapture.h"
+
+// keeps everything written to it
+class CaptureStream : public Stream {
+public:
+  virtual size_t write(const unsigned char* data, size_t len)
+  {
+    bytes.insert(bytes.end(), data, data + len);
+    return len;
+  }
+
+  std::vector<uint8_t> bytes;
+};
+
+static uint32_t bigEndian32(const uint8_t* data)
+{
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+TEST_CASE("HCI capture ring buffer", "[ArduinoBLE::HCICapture]")
+{
+  // 13 bytes of record header per packet, so two 20 byte packets don't fit in 64 bytes
+  uint8_t buffer[64];
+  uint8_t packet[20];
+  CaptureStream stream;
+
+  for (unsigned int i = 0; i < sizeof(packet); i++) {
+    packet[i] = i;
+  }
+  packet[0] = 0x02; // ACL data
+
+  HCICapture.begin(buffer, sizeof(buffer));
+
+  WHEN("Writing the captured packets twice")
+  {
+    HCICapture.capture(false, packet, sizeof(packet));
+    REQUIRE(HCICapture.write(stream) == 16 + 24 + sizeof(packet));
+    REQUIRE(0 == memcmp(stream.bytes.data(), "btsnoop", 8));
+    REQUIRE(HCICapture.available() == 0);
+
+    stream.bytes.clear();
+    HCICapture.capture(true, packet, sizeof(packet));
+    REQUIRE(HCICapture.write(stream) == 24 + sizeof(packet));
+    REQUIRE(bigEndian32(&stream.bytes[0]) == sizeof(packet));
+    REQUIRE(bigEndian32(&stream.bytes[8]) == 0x01); // received data
+  }
+
+  WHEN("The records wrap around the end of the buffer")
+  {
+    for (int i = 0; i < 5; i++) {
+      packet[1] = i;
+      HCICapture.capture(false, packet, sizeof(packet));
+
+      stream.bytes.clear();
+      HCICapture.write(stream);
+
+      uint8_t* record = &stream.bytes[stream.bytes.size() - 24 - sizeof(packet)];
+
+      REQUIRE(bigEndian32(&record[0]) == sizeof(packet));
+      REQUIRE(bigEndian32(&record[4]) == sizeof(packet));
+      REQUIRE(0 == memcmp(&record[24], packet, sizeof(packet)));
+    }
+    REQUIRE(HCICapture.dropped() == 0);
+  }
+
+  WHEN("A packet doesn't fit in the free space")
+  {
+    HCICapture.capture(false, packet, sizeof(packet));
+    HCICapture.capture(false, packet, sizeof(packet));
+    REQUIRE(HCICapture.dropped() == 1);
+
+    HCICapture.write(stream);
+    HCICapture.capture(false, packet, sizeof(packet));
+    HCICapture.write(stream);
+
+    // each record counts the packets dropped before it was captured
+    REQUIRE(stream.bytes.size() == 16 + 2 * (24 + sizeof(packet)));
+    REQUIRE(bigEndian32(&stream.bytes[16 + 12]) == 0);
+    REQUIRE(bigEndian32(&stream.bytes[16 + 24 + sizeof(packet) + 12]) == 1);
+  }
+
+  HCICapture.end();
+}
@@ -25,5 +25,6 @@
 #include "BLEStringCharacteristic.h"
 #include "BLETypedCharacteristics.h"
 #include "utility/btct.h"
+#include "utility/HCICapture.h"
 
 #endif
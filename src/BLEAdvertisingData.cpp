@@ -23,6 +23,7 @@
 
 BLEAdvertisingData::BLEAdvertisingData() :
   _dataLength(0),
+  _maxLength(MAX_AD_DATA_LENGTH),
   _remainingLength(MAX_AD_DATA_LENGTH),
   _rawData(NULL),
   _rawDataLength(0),
@@ -68,7 +69,7 @@ int BLEAdvertisingData::availableForWrite()
 
 void BLEAdvertisingData::clear()
 {
-  _remainingLength = MAX_AD_DATA_LENGTH;
+  _remainingLength = _maxLength;
   _rawData = NULL;
   _rawDataLength = 0;
   _hasFlags = false;
@@ -84,6 +85,7 @@ void BLEAdvertisingData::clear()
 
 void BLEAdvertisingData::copy(const BLEAdvertisingData& adv)
 {
+  _maxLength = adv._maxLength;
   _remainingLength = adv._remainingLength;
   _rawData = adv._rawData;
   _rawDataLength = adv._rawDataLength;
@@ -183,9 +185,25 @@ bool BLEAdvertisingData::setLocalName(const char *localName)
   return success;
 }
 
+bool BLEAdvertisingData::setExtended(bool extended)
+{
+  int maxLength = extended ? MAX_EXT_AD_DATA_LENGTH : MAX_AD_DATA_LENGTH;
+  // the fields already set must still fit
+  bool success = (_rawDataLength <= maxLength) && updateRemainingLength(maxLength, _maxLength);
+  if (success) {
+    _maxLength = maxLength;
+  }
+  return success;
+}
+
+bool BLEAdvertisingData::extended() const
+{
+  return _maxLength > MAX_AD_DATA_LENGTH;
+}
+
 bool BLEAdvertisingData::setRawData(const uint8_t* data, int length)
 {
-  if (length > MAX_AD_DATA_LENGTH) {
+  if (length > _maxLength) {
     return false;
   }
   _rawData = data;
@@ -195,7 +213,7 @@ bool BLEAdvertisingData::setRawData(const uint8_t* data, int length)
 
 bool BLEAdvertisingData::setRawData(const BLEAdvertisingRawData& rawData)
 {
-  if (rawData.length > MAX_AD_DATA_LENGTH) {
+  if (rawData.length > _maxLength) {
     return false;
   }
   _rawData = rawData.data;
@@ -269,8 +287,8 @@ bool BLEAdvertisingData::hasFlags() const
 bool BLEAdvertisingData::addLocalName(const char *localName)
 {
   bool success = false;
-  if (strlen(localName) > (MAX_AD_DATA_LENGTH - AD_FIELD_OVERHEAD)) {
-    success = addField(BLEFieldShortLocalName, (uint8_t*)localName, (MAX_AD_DATA_LENGTH - AD_FIELD_OVERHEAD));
+  if ((int)strlen(localName) > (_maxLength - AD_FIELD_OVERHEAD)) {
+    success = addField(BLEFieldShortLocalName, (uint8_t*)localName, (_maxLength - AD_FIELD_OVERHEAD));
   } else {
     success = addField(BLEFieldCompleteLocalName, localName);
   }
@@ -298,7 +316,7 @@ bool BLEAdvertisingData::addManufacturerData(const uint8_t manufacturerData[], i
 bool BLEAdvertisingData::addManufacturerData(const uint16_t companyId, const uint8_t manufacturerData[], int manufacturerDataLength)
 {
   int tempDataLength = manufacturerDataLength + sizeof(companyId);
-  uint8_t tempData[MAX_AD_DATA_LENGTH];
+  uint8_t tempData[MAX_EXT_AD_DATA_LENGTH];
   memcpy(tempData, &companyId, sizeof(companyId));
   memcpy(&tempData[sizeof(companyId)], manufacturerData, manufacturerDataLength);
   return addField(BLEFieldManufacturerData, tempData, tempDataLength);
@@ -307,7 +325,7 @@ bool BLEAdvertisingData::addManufacturerData(const uint16_t companyId, const uin
 bool BLEAdvertisingData::addAdvertisedServiceData(uint16_t uuid, const uint8_t data[], int length)
 {
   int tempDataLength = length + sizeof(uuid);
-  uint8_t tempData[MAX_AD_DATA_LENGTH];
+  uint8_t tempData[MAX_EXT_AD_DATA_LENGTH];
   memcpy(tempData, &uuid, sizeof(uuid));
   memcpy(&tempData[sizeof(uuid)], data, length);
   return addField(BLEFieldServiceData, tempData, tempDataLength);
@@ -316,7 +334,7 @@ bool BLEAdvertisingData::addAdvertisedServiceData(uint16_t uuid, const uint8_t d
 bool BLEAdvertisingData::addRawData(const uint8_t* data, int length)
 {
   // Bypass addField to add the integral raw data
-  if (length > (MAX_AD_DATA_LENGTH - _dataLength)) {
+  if (length > (_maxLength - _dataLength)) {
     // Not enough space 
     return false;
   }
@@ -339,7 +357,7 @@ bool BLEAdvertisingData::addField(BLEAdField field, const char* data)
 bool BLEAdvertisingData::addField(BLEAdField field, const uint8_t* data, int length)
 {
   int fieldLength = length + AD_FIELD_OVERHEAD; // Considering data TYPE and LENGTH fields
-  if (fieldLength > (MAX_AD_DATA_LENGTH - _dataLength)) {
+  if (fieldLength > (_maxLength - _dataLength)) {
     // Not enough space for storing this field
     return false;
   }
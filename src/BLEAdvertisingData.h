@@ -26,6 +26,18 @@
 
 #define MAX_AD_DATA_LENGTH (31)
 
+// define BLE_EXTENDED_ADVERTISING_DATA, here or on the compiler command line, to advertise
+// and discover more than a legacy packet holds with LE Advertising Extensions, it makes
+// every BLEAdvertisingData and BLEDevice object several times larger
+// #define BLE_EXTENDED_ADVERTISING_DATA
+
+// payload a single LE Set Extended Advertising Data command carries
+#if defined(BLE_EXTENDED_ADVERTISING_DATA) && !defined(__AVR__)
+#define MAX_EXT_AD_DATA_LENGTH (251)
+#else
+#define MAX_EXT_AD_DATA_LENGTH MAX_AD_DATA_LENGTH
+#endif
+
 enum BLEFlags {
   BLEFlagsLimitedDiscoverable = 0x01,
   BLEFlagsGeneralDiscoverable = 0x02,
@@ -70,6 +82,9 @@ public:
   bool setRawData(const uint8_t* data, int length);
   bool setRawData(const BLEAdvertisingRawData& data);
   bool setFlags(uint8_t flags);
+  // lift the 31 byte limit, extended data is only sent by controllers supporting LE Advertising Extensions
+  bool setExtended(bool extended);
+  bool extended() const;
 
 protected:
   friend class BLELocalDevice;
@@ -93,8 +108,9 @@ private:
   bool addField(BLEAdField field, const char* data);
   bool addField(BLEAdField field, const uint8_t* data, int length);
 
-  uint8_t _data[MAX_AD_DATA_LENGTH];
+  uint8_t _data[MAX_EXT_AD_DATA_LENGTH];
   int _dataLength;
+  int _maxLength;
 
   int _remainingLength;
 
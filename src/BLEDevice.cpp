@@ -99,7 +99,7 @@ int BLEDevice::advertisedServiceUuidCount() const
 {
   int advertisedServiceCount = 0;
 
-  for (unsigned char i = 0; i < _eirDataLength;) {
+  for (int i = 0; i < _eirDataLength;) {
     int eirLength = _eirData[i++];
     int eirType = _eirData[i++];
 
@@ -156,7 +156,7 @@ String BLEDevice::advertisedServiceUuid(int index) const
   String serviceUuid;
   int uuidIndex = 0;
 
-  for (unsigned char i = 0; i < _eirDataLength;) {
+  for (int i = 0; i < _eirDataLength;) {
     int eirLength = _eirData[i++];
     int eirType = _eirData[i++];
 
@@ -259,6 +259,69 @@ int BLEDevice::rssi()
   return _rssi;
 }
 
+int BLEDevice::maxTxOctets()
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+  uint16_t txOctets;
+  uint16_t rxOctets;
+
+  if (handle == 0xffff || !HCI.dataLength(handle, txOctets, rxOctets)) {
+    return 0;
+  }
+
+  return txOctets;
+}
+
+int BLEDevice::maxRxOctets()
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+  uint16_t txOctets;
+  uint16_t rxOctets;
+
+  if (handle == 0xffff || !HCI.dataLength(handle, txOctets, rxOctets)) {
+    return 0;
+  }
+
+  return rxOctets;
+}
+
+int BLEDevice::txPhy()
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+  uint8_t txPhy;
+  uint8_t rxPhy;
+
+  if (handle == 0xffff || !HCI.phy(handle, txPhy, rxPhy)) {
+    return 0;
+  }
+
+  return txPhy;
+}
+
+int BLEDevice::rxPhy()
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+  uint8_t txPhy;
+  uint8_t rxPhy;
+
+  if (handle == 0xffff || !HCI.phy(handle, txPhy, rxPhy)) {
+    return 0;
+  }
+
+  return rxPhy;
+}
+
+bool BLEDevice::setPreferredPhy(uint8_t phys)
+{
+  uint16_t handle = ATT.connectionHandle(_addressType, _address);
+
+  if (handle == 0xffff) {
+    return false;
+  }
+
+  return (HCI.leSetPhy(handle, phys, phys) == 0);
+}
+
 bool BLEDevice::connect()
 {
   return ATT.connect(_addressType, _address);
@@ -554,6 +617,12 @@ bool BLEDevice::hasAddress(uint8_t addressType, uint8_t address[6])
 
 void BLEDevice::setAdvertisementData(uint8_t type, uint8_t eirDataLength, uint8_t eirData[], int8_t rssi)
 {
+#if BLE_MAX_EIR_DATA_LENGTH < 255
+  if (eirDataLength > sizeof(_eirData)) {
+    eirDataLength = sizeof(_eirData);
+  }
+#endif
+
   _advertisementTypeMask = (1 << type);
   _eirDataLength = eirDataLength;
   memcpy(_eirData, eirData, eirDataLength);
@@ -562,6 +631,10 @@ void BLEDevice::setAdvertisementData(uint8_t type, uint8_t eirDataLength, uint8_
 
 void BLEDevice::setScanResponseData(uint8_t eirDataLength, uint8_t eirData[], int8_t rssi)
 {
+  if (eirDataLength > (sizeof(_eirData) - _eirDataLength)) {
+    eirDataLength = sizeof(_eirData) - _eirDataLength;
+  }
+
   _advertisementTypeMask |= (1 << 0x04);
   memcpy(&_eirData[_eirDataLength], eirData, eirDataLength);
   _eirDataLength += eirDataLength;
@@ -23,6 +23,14 @@
 #include <Arduino.h>
 
 #include "BLEService.h"
+#include "BLEAdvertisingData.h"
+
+// advertising and scan response data kept for each discovered device
+#if MAX_EXT_AD_DATA_LENGTH > MAX_AD_DATA_LENGTH
+#define BLE_MAX_EIR_DATA_LENGTH 255
+#else
+#define BLE_MAX_EIR_DATA_LENGTH (MAX_AD_DATA_LENGTH * 2)
+#endif
 
 enum BLEDeviceEvent {
   BLEConnected = 0,
@@ -32,6 +40,12 @@ enum BLEDeviceEvent {
   BLEDeviceLastEvent
 };
 
+enum BLEPhy {
+  BLEPhy1M    = 0x01,
+  BLEPhy2M    = 0x02,
+  BLEPhyCoded = 0x04
+};
+
 class BLEDevice;
 
 typedef void (*BLEDeviceEventHandler)(BLEDevice device);
@@ -68,6 +82,14 @@ public:
   int manufacturerData(uint8_t value[], int length) const;
 
   virtual int rssi();
+  // link layer payload limits negotiated for the connection, 0 if not connected
+  virtual int maxTxOctets();
+  virtual int maxRxOctets();
+  // BLEPhy the connection currently uses in each direction, 0 if not connected
+  virtual int txPhy();
+  virtual int rxPhy();
+  // ask to move the connection to one of the BLEPhy values in phys
+  virtual bool setPreferredPhy(uint8_t phys);
 
   bool connect();
   bool discoverAttributes();
@@ -114,7 +136,7 @@ private:
   uint8_t _address[6];
   uint8_t _advertisementTypeMask;
   uint8_t _eirDataLength;
-  uint8_t _eirData[31 * 2];
+  uint8_t _eirData[BLE_MAX_EIR_DATA_LENGTH];
   int8_t _rssi;
 };
 
@@ -42,8 +42,10 @@ BLELocalCharacteristic::BLELocalCharacteristic(const char* uuid, uint16_t permis
   _cccdValue(0x0000)
 {
   memset(_eventHandlers, 0x00, sizeof(_eventHandlers));
+  memset(_cccdValues, 0x00, sizeof(_cccdValues));
 
   if (permissions & (BLENotify | BLEIndicate)) {
+    // holds the combined value, ATT reads and writes the value of each connection
     BLELocalDescriptor* cccd = new BLELocalDescriptor("2902", (uint8_t*)&_cccdValue, sizeof(_cccdValue));
   
     cccd->retain();
@@ -118,10 +120,22 @@ int BLELocalCharacteristic::writeValue(const uint8_t value[], int length)
     _valueLength = _valueSize;
   }
 
-  if ((_properties & BLEIndicate) && (_cccdValue & 0x0002)) {
-    return ATT.handleInd(valueHandle(), _value, _valueLength);
-  } else if ((_properties & BLENotify) && (_cccdValue & 0x0001)) {
-    return ATT.handleNotify(valueHandle(), _value, _valueLength);
+  bool indicate = (_properties & BLEIndicate) && (_cccdValue & 0x0002);
+  bool notify = (_properties & BLENotify) && (_cccdValue & 0x0001);
+
+  if (indicate || notify) {
+    // each peer only gets what it subscribed to
+    bool sent = false;
+
+    if (indicate) {
+      sent = ATT.handleInd(valueHandle(), _value, _valueLength);
+    }
+
+    if (notify) {
+      sent = ATT.handleNotify(valueHandle(), _value, _valueLength) || sent;
+    }
+
+    return sent;
   }
 
   if (_broadcast) {
@@ -230,14 +244,32 @@ void BLELocalCharacteristic::writeValue(BLEDevice device, const uint8_t value[],
   }
 }
 
-void BLELocalCharacteristic::writeCccdValue(BLEDevice device, uint16_t value)
+uint16_t BLELocalCharacteristic::cccdValue(int peer) const
+{
+  if (peer < 0 || peer >= ATT_MAX_PEERS) {
+    return 0x0000;
+  }
+
+  return _cccdValues[peer];
+}
+
+void BLELocalCharacteristic::writeCccdValue(BLEDevice device, int peer, uint16_t value)
 {
   value &= 0x0003;
 
-  if (_cccdValue != value) {
-    _cccdValue = value;
+  if (peer < 0 || peer >= ATT_MAX_PEERS) {
+    return;
+  }
+
+  if (_cccdValues[peer] != value) {
+    _cccdValues[peer] = value;
+
+    _cccdValue = 0x0000;
+    for (int i = 0; i < ATT_MAX_PEERS; i++) {
+      _cccdValue |= _cccdValues[i];
+    }
 
-    BLECharacteristicEvent event = (_cccdValue) ? BLESubscribed : BLEUnsubscribed;
+    BLECharacteristicEvent event = (value) ? BLESubscribed : BLEUnsubscribed;
 
     if (_eventHandlers[event]) {
       _eventHandlers[event](device, BLECharacteristic(this));
@@ -27,6 +27,7 @@
 
 #include "BLELocalAttribute.h"
 
+#include "utility/ATTConfig.h"
 #include "utility/BLELinkedList.h"
 
 class BLELocalDescriptor;
@@ -72,7 +73,8 @@ protected:
 
   void readValue(BLEDevice device, uint16_t offset, uint8_t value[], int length);
   void writeValue(BLEDevice device, const uint8_t value[], int length);
-  void writeCccdValue(BLEDevice device, uint16_t value);
+  uint16_t cccdValue(int peer) const;
+  void writeCccdValue(BLEDevice device, int peer, uint16_t value);
 
 private:
   uint8_t  _properties;
@@ -87,7 +89,8 @@ private:
   bool _broadcast;
   bool _written;
 
-  uint16_t _cccdValue;
+  uint16_t _cccdValue; // all peers combined
+  uint16_t _cccdValues[ATT_MAX_PEERS];
   BLELinkedList<BLELocalDescriptor*> _descriptors;
 
   BLECharacteristicEventHandler _eventHandlers[BLECharacteristicEventLast];
@@ -135,11 +135,10 @@ int BLELocalDevice::begin()
     return 0;
   }
 
-  if (HCI.setEventMask(0x3FFFFFFFFFFFFFFF) != 0) {
-    end();
-    return 0;
-  }
-  if (HCI.setLeEventMask(0x00000000000003FF) != 0) {
+  HCI.beginCommandBatch();
+  HCI.setEventMask(0x3FFFFFFFFFFFFFFF);
+  HCI.setLeEventMask(0x0000000000001BFF);
+  if (HCI.endCommandBatch() != 0) {
     end();
     return 0;
   }
@@ -152,58 +151,30 @@ int BLELocalDevice::begin()
     return 0;
   }
 
-  /// The HCI should allow automatic address resolution.
-
-  // // If we have callbacks to remember bonded devices:
-  // if(HCI._getIRKs!=0){
-  //   uint8_t nIRKs = 0;
-  //   uint8_t** BADDR_Type = new uint8_t*;
-  //   uint8_t*** BADDRs = new uint8_t**;
-  //   uint8_t*** IRKs = new uint8_t**;
-  //   uint8_t* memcheck;
-
-
-  //   if(!HCI._getIRKs(&nIRKs, BADDR_Type, BADDRs, IRKs)){
-  //     Serial.println("error");
-  //   }
-  //   for(int i=0; i<nIRKs; i++){
-  //     Serial.print("Baddr type: ");
-  //     Serial.println((*BADDR_Type)[i]);
-  //     Serial.print("BADDR:");
-  //     for(int k=0; k<6; k++){
-  //       Serial.print(", 0x");
-  //       Serial.print((*BADDRs)[i][k],HEX);
-  //     }
-  //     Serial.println();
-  //     Serial.print("IRK:");
-  //     for(int k=0; k<16; k++){
-  //       Serial.print(", 0x");
-  //       Serial.print((*IRKs)[i][k],HEX);
-  //     }
-  //     Serial.println();
-
-  //     // save this 
-  //     uint8_t zeros[16];
-  //     for(int k=0; k<16; k++) zeros[15-k] = 0;
-      
-  //     // HCI.leAddResolvingAddress((*BADDR_Type)[i],(*BADDRs)[i],(*IRKs)[i], zeros);
-
-  //     delete[] (*BADDRs)[i];
-  //     delete[] (*IRKs)[i];
-  //   }
-  //   delete[] (*BADDR_Type);
-  //   delete BADDR_Type;
-  //   delete[] (*BADDRs);
-  //   delete BADDRs;
-  //   delete[] (*IRKs);
-  //   delete IRKs;
-    
-  //   memcheck = new uint8_t[1];
-  //   Serial.print("nIRK location: 0x");
-  //   Serial.println((int)memcheck,HEX);
-  //   delete[] memcheck;
-
-  // }
+  uint64_t leFeatures;
+
+  // optional features are only used when the controller reports them
+  HCI.leReadLocalSupportedFeatures(leFeatures);
+
+  if (HCI.leFeatureSupported(LE_FEATURE_DATA_LENGTH_EXTENSION)) {
+    uint16_t txOctets = HCI.preferredDataLength();
+
+    // used by the controller for links it negotiates by itself
+    HCI.leWriteSuggestedDefaultDataLength(txOctets, LE_DATA_TIME(txOctets));
+  }
+
+  if (HCI.leFeatureSupported(LE_FEATURE_2M_PHY | LE_FEATURE_CODED_PHY)) {
+    uint8_t phys = HCI.preferredPhy() | BLEPhy1M;
+
+    // also applies to PHY updates started by the remote device
+    HCI.leSetDefaultPhy(phys, phys);
+  }
+
+  // bonded devices using private addresses are recognised by the controller
+  HCI.loadResolvingList();
+
+  // keeps the P-256 key generation out of the first pairing
+  HCI.generateLocalP256Key();
 
   GATT.begin();
 
@@ -230,11 +201,13 @@ void BLELocalDevice::end()
 void BLELocalDevice::poll()
 {
   HCI.poll();
+  GAP.poll();
 }
 
 void BLELocalDevice::poll(unsigned long timeout)
 {
   HCI.poll(timeout);
+  GAP.poll();
 }
 
 bool BLELocalDevice::connected() const
@@ -353,6 +326,7 @@ int BLELocalDevice::advertise()
 {
   _advertisingData.updateData();
   _scanResponseData.updateData();
+  GATT.freezeAttributes();
   return GAP.advertise( _advertisingData.data(), _advertisingData.dataLength(), 
                         _scanResponseData.data(), _scanResponseData.dataLength());
 }
@@ -362,6 +336,33 @@ void BLELocalDevice::stopAdvertise()
   GAP.stopAdvertise();
 }
 
+bool BLELocalDevice::addAdvertisingSet(BLEAdvertisingData& advertisingData, BLEAdvertisingData& scanResponseData,
+                                       uint16_t advertisingInterval, uint8_t weight)
+{
+  if (!advertisingData.updateData() || !scanResponseData.updateData()) {
+    return false;
+  }
+
+  return GAP.addAdvertisingSet(advertisingData.data(), advertisingData.dataLength(),
+                               scanResponseData.data(), scanResponseData.dataLength(),
+                               advertisingInterval, weight);
+}
+
+bool BLELocalDevice::addAdvertisingSet(BLEAdvertisingData& advertisingData, uint16_t advertisingInterval, uint8_t weight)
+{
+  if (!advertisingData.updateData()) {
+    return false;
+  }
+
+  return GAP.addAdvertisingSet(advertisingData.data(), advertisingData.dataLength(),
+                               NULL, 0, advertisingInterval, weight);
+}
+
+void BLELocalDevice::clearAdvertisingSets()
+{
+  GAP.clearAdvertisingSets();
+}
+
 int BLELocalDevice::scan(bool withDuplicates)
 {
   return GAP.scan(withDuplicates);
@@ -382,11 +383,36 @@ int BLELocalDevice::scanForAddress(String address, bool withDuplicates)
   return GAP.scanForAddress(address, withDuplicates);
 }
 
+int BLELocalDevice::scanForAcceptList(bool withDuplicates)
+{
+  return GAP.scanForAcceptList(withDuplicates);
+}
+
 void BLELocalDevice::stopScan()
 {
   GAP.stopScan();
 }
 
+int BLELocalDevice::addToAcceptList(String address)
+{
+  return GAP.addToAcceptList(address);
+}
+
+int BLELocalDevice::removeFromAcceptList(String address)
+{
+  return GAP.removeFromAcceptList(address);
+}
+
+int BLELocalDevice::clearAcceptList()
+{
+  return GAP.clearAcceptList();
+}
+
+int BLELocalDevice::acceptListSize()
+{
+  return GAP.acceptListSize();
+}
+
 BLEDevice BLELocalDevice::central()
 {
   HCI.poll();
@@ -430,6 +456,16 @@ void BLELocalDevice::setConnectable(bool connectable)
   GAP.setConnectable(connectable);
 }
 
+void BLELocalDevice::setDataLength(uint16_t txOctets)
+{
+  HCI.setPreferredDataLength(txOctets);
+}
+
+void BLELocalDevice::setPreferredPhy(uint8_t phys)
+{
+  HCI.setPreferredPhy(phys);
+}
+
 void BLELocalDevice::setTimeout(unsigned long timeout)
 {
   ATT.setTimeout(timeout);
@@ -452,6 +488,16 @@ bool BLELocalDevice::pairable()
   return L2CAPSignaling.isPairingEnabled();
 }
 
+/*
+ * Replace the local P-256 key pair after maxPairings pairings, or once older
+ * than maxAge ms, 0 disables either limit. A new key pair is generated in
+ * the background so that pairing doesn't wait for it.
+ */
+void BLELocalDevice::setPairingKeyRotation(uint8_t maxPairings, unsigned long maxAge)
+{
+  HCI.setLocalP256KeyRotation(maxPairings, maxAge);
+}
+
 void BLELocalDevice::setGetIRKs(int (*getIRKs)(uint8_t* nIRKs, uint8_t** BADDR_type, uint8_t*** BADDRs, uint8_t*** IRKs)){
   HCI._getIRKs = getIRKs;
 }
@@ -464,6 +510,12 @@ void BLELocalDevice::setStoreLTK(int (*storeLTK)(uint8_t*, uint8_t*)){
 void BLELocalDevice::setStoreIRK(int (*storeIRK)(uint8_t*, uint8_t*)){
   HCI._storeIRK = storeIRK;
 }
+void BLELocalDevice::setStoreCCCD(int (*storeCCCD)(uint8_t* address, uint16_t handle, uint16_t value)){
+  ATT._storeCCCD = storeCCCD;
+}
+void BLELocalDevice::setGetCCCD(int (*getCCCD)(uint8_t* address, uint16_t handle, uint16_t* value)){
+  ATT._getCCCD = getCCCD;
+}
 void BLELocalDevice::setDisplayCode(void (*displayCode)(uint32_t confirmationCode)){
   HCI._displayCode = displayCode;
 }
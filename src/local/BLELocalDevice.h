@@ -65,13 +65,24 @@ public:
 
   virtual int advertise();
   virtual void stopAdvertise();
+  // advertised along with the data above by the next advertise(), the objects must stay valid while advertising
+  virtual bool addAdvertisingSet(BLEAdvertisingData& advertisingData, BLEAdvertisingData& scanResponseData,
+                                 uint16_t advertisingInterval = 160, uint8_t weight = 1);
+  virtual bool addAdvertisingSet(BLEAdvertisingData& advertisingData, uint16_t advertisingInterval = 160, uint8_t weight = 1);
+  virtual void clearAdvertisingSets();
 
   virtual int scan(bool withDuplicates = false);
   virtual int scanForName(String name, bool withDuplicates = false);
   virtual int scanForUuid(String uuid, bool withDuplicates = false);
   virtual int scanForAddress(String address, bool withDuplicates = false);
+  virtual int scanForAcceptList(bool withDuplicates = false);
   virtual void stopScan();
 
+  virtual int addToAcceptList(String address);
+  virtual int removeFromAcceptList(String address);
+  virtual int clearAcceptList();
+  virtual int acceptListSize();
+
   virtual BLEDevice central();
   virtual BLEDevice available();
 
@@ -79,6 +90,10 @@ public:
   virtual void setConnectionInterval(uint16_t minimumConnectionInterval, uint16_t maximumConnectionInterval);
   virtual void setSupervisionTimeout(uint16_t supervisionTimeout);
   virtual void setConnectable(bool connectable); 
+  // max link layer payload to request on new connections, from 27 up to 251 octets
+  virtual void setDataLength(uint16_t txOctets);
+  // BLEPhy values new connections are moved to when both sides support them
+  virtual void setPreferredPhy(uint8_t phys);
 
   virtual void setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler);
 
@@ -89,12 +104,14 @@ public:
   
   virtual void setPairable(uint8_t pairable);
   virtual bool pairable();
+  virtual void setPairingKeyRotation(uint8_t maxPairings, unsigned long maxAge = 0);
   virtual bool paired();
 
   // address - The mac to store
   // IRK - The IRK to store with this mac
   virtual void setStoreIRK(int (*storeIRK)(uint8_t* address, uint8_t* IRK));
-  // nIRKs      - the number of IRKs being provided.
+  // nIRKs      - the number of IRKs being provided, begin() loads them into the controller
+  //              resolving list, set the callback before calling it
   // BDAddrType - an array containing the type of each address (0 public, 1 static random)
   // BDAddrs    - an array containing the list of addresses
   virtual void setGetIRKs(int (*getIRKs)(uint8_t* nIRKs, uint8_t** BDAddrType, uint8_t*** BDAddrs, uint8_t*** IRKs));
@@ -104,6 +121,12 @@ public:
   // address - The mac address needing its LTK
   // LTK - 16 octet LTK for the mac address
   virtual void setGetLTK(int (*getLTK)(uint8_t* address, uint8_t* LTK));
+  // address - the address of a bonded peer, the same one its LTK is stored with [6 bytes]
+  // handle - the value handle of the characteristic the peer subscribed to
+  // value - the CCCD value of the peer for this characteristic
+  virtual void setStoreCCCD(int (*storeCCCD)(uint8_t* address, uint16_t handle, uint16_t value));
+  // return 1 and set value if one was stored for the address and handle, 0 otherwise
+  virtual void setGetCCCD(int (*getCCCD)(uint8_t* address, uint16_t handle, uint16_t* value));
 
   virtual void setDisplayCode(void (*displayCode)(uint32_t confirmationCode));
   virtual void setBinaryConfirmPairing(bool (*binaryConfirmPairing)());
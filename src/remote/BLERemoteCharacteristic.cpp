@@ -165,7 +165,7 @@ bool BLERemoteCharacteristic::read()
     return false;
   }
   
-  uint8_t resp[256];
+  uint8_t resp[ATT.mtu(_connectionHandle)];
 
   int respLength = ATT.readReq(_connectionHandle, _valueHandle, resp);
 
@@ -0,0 +1,55 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _AES128_H_
+#define _AES128_H_
+
+#include <Arduino.h>
+
+// AES-128 block encryption (FIPS-197) computed on the host, used by btct instead
+// of a controller round trip for every block.
+//
+// The round keys are expanded once by setKey() and kept with the object, so
+// encrypting many blocks under one key only pays for the rounds. Builds for
+// x86-64 Linux with AES-NI enabled (-maes) use the AES instructions, AVR uses
+// a byte oriented version without the 1 KB lookup table.
+#if defined(__x86_64__) && defined(__linux__) && defined(__AES__)
+#define BLE_AES128_NI
+#endif
+
+#define BLE_AES128_BLOCK_SIZE 16
+#define BLE_AES128_ROUNDS     10
+
+class BLEAES128 {
+public:
+  BLEAES128();
+  BLEAES128(const uint8_t key[BLE_AES128_BLOCK_SIZE]);
+
+  void setKey(const uint8_t key[BLE_AES128_BLOCK_SIZE]);
+  // in and out may point to the same block
+  void encrypt(const uint8_t in[BLE_AES128_BLOCK_SIZE], uint8_t out[BLE_AES128_BLOCK_SIZE]) const;
+  // encrypts one block under the keys of count objects, with AES-NI four keys at a time
+  static void encrypt(const BLEAES128 ciphers[], int count, const uint8_t in[BLE_AES128_BLOCK_SIZE],
+                      uint8_t out[][BLE_AES128_BLOCK_SIZE]);
+
+private:
+  uint8_t _roundKeys[(BLE_AES128_ROUNDS + 1) * BLE_AES128_BLOCK_SIZE] __attribute__ ((aligned (16)));
+};
+
+#endif
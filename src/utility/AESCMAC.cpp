@@ -0,0 +1,115 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "AESCMAC.h"
+
+// K1 = L << 1 and K2 = K1 << 1, each reduced with Rb when a bit is shifted out
+static void doubleSubkey(const uint8_t in[BLE_AES128_BLOCK_SIZE], uint8_t out[BLE_AES128_BLOCK_SIZE])
+{
+  uint8_t carry = (in[0] & 0x80) ? 0x87 : 0x00;
+
+  for (int i = 0; i < BLE_AES128_BLOCK_SIZE - 1; i++) {
+    out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+  }
+  out[BLE_AES128_BLOCK_SIZE - 1] = (in[BLE_AES128_BLOCK_SIZE - 1] << 1) ^ carry;
+}
+
+BLEAESCMAC::BLEAESCMAC()
+{
+  memset(_k1, 0x00, sizeof(_k1));
+  memset(_k2, 0x00, sizeof(_k2));
+  begin();
+}
+
+BLEAESCMAC::BLEAESCMAC(const uint8_t key[BLE_AES128_BLOCK_SIZE])
+{
+  setKey(key);
+}
+
+void BLEAESCMAC::setKey(const uint8_t key[BLE_AES128_BLOCK_SIZE])
+{
+  uint8_t L[BLE_AES128_BLOCK_SIZE];
+
+  _cipher.setKey(key);
+
+  memset(L, 0x00, sizeof(L));
+  _cipher.encrypt(L, L);
+
+  doubleSubkey(L, _k1);
+  doubleSubkey(_k1, _k2);
+
+  begin();
+}
+
+void BLEAESCMAC::begin()
+{
+  memset(_state, 0x00, sizeof(_state));
+  _blockLength = 0;
+}
+
+void BLEAESCMAC::update(const uint8_t* data, int length)
+{
+  while (length > 0) {
+    if (_blockLength == BLE_AES128_BLOCK_SIZE) {
+      // more data follows, so the buffered block is not the last one
+      for (int i = 0; i < BLE_AES128_BLOCK_SIZE; i++) {
+        _state[i] ^= _block[i];
+      }
+      _cipher.encrypt(_state, _state);
+      _blockLength = 0;
+    }
+
+    int chunk = BLE_AES128_BLOCK_SIZE - _blockLength;
+
+    if (chunk > length) {
+      chunk = length;
+    }
+
+    memcpy(&_block[_blockLength], data, chunk);
+    _blockLength += chunk;
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+void BLEAESCMAC::finish(uint8_t mac[BLE_AES128_BLOCK_SIZE])
+{
+  const uint8_t* subkey = _k1;
+
+  if (_blockLength < BLE_AES128_BLOCK_SIZE) {
+    // incomplete, or empty, last block: 10* padding and K2
+    _block[_blockLength] = 0x80;
+    memset(&_block[_blockLength + 1], 0x00, BLE_AES128_BLOCK_SIZE - _blockLength - 1);
+    subkey = _k2;
+  }
+
+  for (int i = 0; i < BLE_AES128_BLOCK_SIZE; i++) {
+    _state[i] ^= _block[i] ^ subkey[i];
+  }
+  _cipher.encrypt(_state, mac);
+
+  begin();
+}
+
+void BLEAESCMAC::compute(const uint8_t* data, int length, uint8_t mac[BLE_AES128_BLOCK_SIZE])
+{
+  begin();
+  update(data, length);
+  finish(mac);
+}
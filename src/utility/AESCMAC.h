@@ -0,0 +1,59 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _AES_CMAC_H_
+#define _AES_CMAC_H_
+
+#include <Arduino.h>
+
+#include "AES128.h"
+
+// AES-CMAC (RFC 4493) computed incrementally.
+//
+// setKey() expands the key and derives the K1/K2 subkeys once, every message
+// MACed with the object afterwards only costs its own blocks. A message is
+// given in any number of update() calls between begin() and finish(), so its
+// fields don't need to be copied into one buffer first.
+class BLEAESCMAC {
+public:
+  BLEAESCMAC();
+  BLEAESCMAC(const uint8_t key[BLE_AES128_BLOCK_SIZE]);
+
+  void setKey(const uint8_t key[BLE_AES128_BLOCK_SIZE]);
+
+  void begin();
+  void update(const uint8_t* data, int length);
+  // ends the message, the object is ready for begin() again with the same key
+  void finish(uint8_t mac[BLE_AES128_BLOCK_SIZE]);
+
+  // begin(), update() and finish() in one call
+  void compute(const uint8_t* data, int length, uint8_t mac[BLE_AES128_BLOCK_SIZE]);
+
+private:
+  BLEAES128 _cipher;
+  uint8_t _k1[BLE_AES128_BLOCK_SIZE];
+  uint8_t _k2[BLE_AES128_BLOCK_SIZE];
+
+  uint8_t _state[BLE_AES128_BLOCK_SIZE];
+  // the last block can't be processed before finish() tells it is the last
+  uint8_t _block[BLE_AES128_BLOCK_SIZE];
+  uint8_t _blockLength;
+};
+
+#endif
@@ -88,7 +88,9 @@ ATTClass::ATTClass() :
   _timeout(5000),
   _longWriteHandle(0x0000),
   _longWriteValue(NULL),
-  _longWriteValueLength(0)
+  _longWriteValueLength(0),
+  _discoveryCacheNext(0),
+  _discoveryCacheVersion(0)
 {
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
     _peers[i].connectionHandle = 0xffff;
@@ -101,6 +103,7 @@ ATTClass::ATTClass() :
   }
 
   memset(_eventHandlers, 0x00, sizeof(_eventHandlers));
+  memset(_discoveryCache, 0x00, sizeof(_discoveryCache));
 }
 
 ATTClass::~ATTClass()
@@ -112,8 +115,18 @@ ATTClass::~ATTClass()
 
 bool ATTClass::connect(uint8_t peerBdaddrType, uint8_t peerBdaddr[6])
 {
-  if (HCI.leCreateConn(0x0060, 0x0030, 0x00, peerBdaddrType, peerBdaddr, 0x00,
-                        0x0006, 0x000c, 0x0000, 0x00c8, 0x0004, 0x0006) != 0) {
+  int result;
+
+  // controllers using extended advertising may reject the legacy command
+  if (HCI.leFeatureSupported(LE_FEATURE_EXTENDED_ADVERTISING)) {
+    result = HCI.leExtendedCreateConn(0x0060, 0x0030, 0x00, peerBdaddrType, peerBdaddr, 0x00,
+                                      0x0006, 0x000c, 0x0000, 0x00c8, 0x0004, 0x0006);
+  } else {
+    result = HCI.leCreateConn(0x0060, 0x0030, 0x00, peerBdaddrType, peerBdaddr, 0x00,
+                              0x0006, 0x000c, 0x0000, 0x00c8, 0x0004, 0x0006);
+  }
+
+  if (result != 0) {
     return false;
   }
 
@@ -273,15 +286,19 @@ void ATTClass::addConnection(uint16_t handle, uint8_t role, uint8_t peerBdaddrTy
   }
 }
 
-void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::handleData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
+  uint16_t mtu = this->mtu(connectionHandle);
+
+  if (dlen == 0 || dlen > mtu) {
+    return; // drop, PDUs can't be larger than the MTU
+  }
+
   uint8_t opcode = data[0];
 
   dlen--;
   data++;
 
-  uint16_t mtu = this->mtu(connectionHandle);
-
 #ifdef _BLE_TRACE_
   Serial.print("data opcode: 0x");
   Serial.println(opcode, HEX);
@@ -300,7 +317,7 @@ void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[
 #ifdef _BLE_TRACE_
       Serial.println("MTU");
 #endif
-      mtuReq(connectionHandle, dlen, data);
+      mtuReq(connectionHandle, (uint8_t)min(dlen, (uint16_t)0xff), data);
       break;
 
     case ATT_OP_MTU_RESP:
@@ -311,7 +328,7 @@ void ATTClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[
 #ifdef _BLE_TRACE_
       Serial.println("Find info");
 #endif
-      findInfoReq(connectionHandle, mtu, dlen, data);
+      findInfoReq(connectionHandle, mtu, (uint8_t)min(dlen, (uint16_t)0xff), data);
       break;
 
     case ATT_OP_FIND_INFO_RESP:
@@ -412,18 +429,10 @@ void ATTClass::removeConnection(uint16_t handle, uint8_t /*reason*/)
 
   BLEDevice bleDevice(_peers[peerIndex].addressType, _peers[peerIndex].address);
 
-  if (peerCount == 1) {
-    // clear CCCD values on disconnect
-    for (uint16_t i = 0; i < GATT.attributeCount(); i++) {
-      BLELocalAttribute* attribute = GATT.attribute(i);
-
-      if (attribute->type() == BLETypeCharacteristic) {
-        BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
-
-        characteristic->writeCccdValue(bleDevice, 0x0000);
-      }
-    }
+  // clear the CCCD values of this peer on disconnect
+  clearCccdValues(peerIndex);
 
+  if (peerCount == 1) {
     _longWriteHandle = 0x0000;
     _longWriteValueLength = 0;
   }
@@ -551,6 +560,8 @@ bool ATTClass::disconnect()
 
     numDisconnects++;
 
+    clearCccdValues(i);
+
     _peers[i].connectionHandle = 0xffff;
     _peers[i].role = 0x00;
     _peers[i].addressType = 0x00;
@@ -582,28 +593,51 @@ BLEDevice ATTClass::central()
 
 bool ATTClass::handleNotify(uint16_t handle, const uint8_t* value, int length)
 {
+  BLELocalAttribute* attribute = GATT.attribute(handle - 1);
+
+  if (attribute == NULL || attribute->type() != BLETypeCharacteristic) {
+    return false;
+  }
+
+  BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
   int numNotifications = 0;
+  uint16_t maxMtu = 0;
+  // a peer subscribed to both is sent the indication only
+  uint16_t skipMask = (characteristic->properties() & BLEIndicate) ? 0x0002 : 0x0000;
 
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
-    if (_peers[i].connectionHandle == 0xffff) {
-      continue;
+    if (_peers[i].connectionHandle != 0xffff && (characteristic->cccdValue(i) & 0x0001) &&
+        (characteristic->cccdValue(i) & skipMask) == 0) {
+      maxMtu = max(maxMtu, _peers[i].mtu);
     }
+  }
 
-    uint8_t notification[_peers[i].mtu];
-    uint16_t notificationLength = 0;
+  if (maxMtu == 0) {
+    return false;
+  }
+
+  // encode the notification once, a peer with a smaller MTU is sent a prefix of it
+  uint8_t notification[maxMtu];
+  uint16_t notificationLength = 0;
 
-    notification[0] = ATT_OP_HANDLE_NOTIFY;
-    notificationLength++;
+  notification[0] = ATT_OP_HANDLE_NOTIFY;
+  notificationLength++;
 
-    memcpy(&notification[1], &handle, sizeof(handle));
-    notificationLength += sizeof(handle);
+  memcpy(&notification[1], &handle, sizeof(handle));
+  notificationLength += sizeof(handle);
 
-    length = min((uint16_t)(_peers[i].mtu - notificationLength), (uint16_t)length);
-    memcpy(&notification[notificationLength], value, length);
-    notificationLength += length;
+  length = min((uint16_t)(maxMtu - notificationLength), (uint16_t)length);
+  memcpy(&notification[notificationLength], value, length);
+  notificationLength += length;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == 0xffff || (characteristic->cccdValue(i) & 0x0001) == 0 ||
+        (characteristic->cccdValue(i) & skipMask)) {
+      continue;
+    }
 
     /// TODO: Set encryption requirement on notify.
-    HCI.sendAclPkt(_peers[i].connectionHandle, ATT_CID, notificationLength, notification);
+    HCI.sendAclPkt(_peers[i].connectionHandle, ATT_CID, min(notificationLength, _peers[i].mtu), notification);
 
     numNotifications++;
   }
@@ -613,29 +647,47 @@ bool ATTClass::handleNotify(uint16_t handle, const uint8_t* value, int length)
 
 bool ATTClass::handleInd(uint16_t handle, const uint8_t* value, int length)
 {
+  BLELocalAttribute* attribute = GATT.attribute(handle - 1);
+
+  if (attribute == NULL || attribute->type() != BLETypeCharacteristic) {
+    return false;
+  }
+
+  BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
   int numIndications = 0;
+  uint16_t maxMtu = 0;
 
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
-    if (_peers[i].connectionHandle == 0xffff) {
-      continue;
+    if (_peers[i].connectionHandle != 0xffff && (characteristic->cccdValue(i) & 0x0002)) {
+      maxMtu = max(maxMtu, _peers[i].mtu);
     }
+  }
 
-    uint8_t indication[_peers[i].mtu];
-    uint16_t indicationLength = 0;
+  if (maxMtu == 0) {
+    return false;
+  }
 
-    indication[0] = ATT_OP_HANDLE_IND;
-    indicationLength++;
+  uint8_t indication[maxMtu];
+  uint16_t indicationLength = 0;
 
-    memcpy(&indication[1], &handle, sizeof(handle));
-    indicationLength += sizeof(handle);
+  indication[0] = ATT_OP_HANDLE_IND;
+  indicationLength++;
 
-    length = min((uint16_t)(_peers[i].mtu - indicationLength), (uint16_t)length);
-    memcpy(&indication[indicationLength], value, length);
-    indicationLength += length;
+  memcpy(&indication[1], &handle, sizeof(handle));
+  indicationLength += sizeof(handle);
+
+  length = min((uint16_t)(maxMtu - indicationLength), (uint16_t)length);
+  memcpy(&indication[indicationLength], value, length);
+  indicationLength += length;
+
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == 0xffff || (characteristic->cccdValue(i) & 0x0002) == 0) {
+      continue;
+    }
 
     _cnf = false;
 
-    HCI.sendAclPkt(_peers[i].connectionHandle, ATT_CID, indicationLength, indication);
+    HCI.sendAclPkt(_peers[i].connectionHandle, ATT_CID, min(indicationLength, _peers[i].mtu), indication);
 
     while (!_cnf) {
       HCI.poll();
@@ -651,7 +703,7 @@ bool ATTClass::handleInd(uint16_t handle, const uint8_t* value, int length)
   return (numIndications > 0);
 }
 
-void ATTClass::error(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::error(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen != 4) {
     // drop
@@ -709,7 +761,7 @@ int ATTClass::mtuReq(uint16_t connectionHandle, uint16_t mtu, uint8_t responseBu
   return sendReq(connectionHandle, &mtuReq, sizeof(mtuReq), responseBuffer);
 }
 
-void ATTClass::mtuResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::mtuResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   uint16_t mtu = *(uint16_t*)data;
 
@@ -717,6 +769,10 @@ void ATTClass::mtuResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
     return;
   }
 
+  if (mtu > _maxMtu) {
+    mtu = _maxMtu;
+  }
+
   for (int i = 0; i < ATT_MAX_PEERS; i++) {
     if (_peers[i].connectionHandle == connectionHandle) {
       _peers[i].mtu = mtu;
@@ -743,6 +799,10 @@ void ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen
     return;
   }
 
+  if (sendCachedResponse(connectionHandle, ATT_OP_FIND_INFO_REQ, findInfoReq->startHandle, findInfoReq->endHandle, 0x0000, mtu)) {
+    return;
+  }
+
   uint8_t response[mtu];
   uint16_t responseLength;
 
@@ -788,6 +848,8 @@ void ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen
     }
   }
 
+  cacheResponse(ATT_OP_FIND_INFO_REQ, findInfoReq->startHandle, findInfoReq->endHandle, 0x0000, mtu, (responseLength == 2) ? 0 : responseLength, response);
+
   if (responseLength == 2) {
     sendError(connectionHandle, ATT_OP_FIND_INFO_REQ, findInfoReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
   } else {
@@ -806,7 +868,7 @@ int ATTClass::findInfoReq(uint16_t connectionHandle, uint16_t startHandle, uint1
   return sendReq(connectionHandle, &findInfoReq, sizeof(findInfoReq), responseBuffer);
 }
 
-void ATTClass::findInfoResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::findInfoResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen < 2) {
     return; // invalid, drop
@@ -819,7 +881,7 @@ void ATTClass::findInfoResp(uint16_t connectionHandle, uint8_t dlen, uint8_t dat
   }
 }
 
-void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) FindByTypeReq {
     uint16_t startHandle;
@@ -842,10 +904,10 @@ void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
   responseLength = 1;
 
   if (findByTypeReq->type == BLETypeService) {
-    for (uint16_t i = (findByTypeReq->startHandle - 1); i < GATT.attributeCount() && i <= (findByTypeReq->endHandle - 1); i++) {
-      BLELocalAttribute* attribute = GATT.attribute(i);
+    for (uint16_t handle = GATT.nextHandleOfType(BLETypeService, findByTypeReq->startHandle); handle != 0 && handle <= findByTypeReq->endHandle && findByTypeReq->startHandle != 0; handle = GATT.nextHandleOfType(BLETypeService, handle + 1)) {
+      BLELocalAttribute* attribute = GATT.attribute(handle - 1);
 
-      if ((attribute->type() == findByTypeReq->type) && (attribute->uuidLength() == valueLength) && memcmp(attribute->uuidData(), value, valueLength) == 0) {
+      if ((attribute->uuidLength() == valueLength) && memcmp(attribute->uuidData(), value, valueLength) == 0) {
         BLELocalService* service = (BLELocalService*)attribute;
 
         // add the start handle
@@ -872,7 +934,7 @@ void ATTClass::findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
   }
 }
 
-void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) ReadByGroupReq {
     uint16_t startHandle;
@@ -893,6 +955,10 @@ void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t d
     return;
   }
 
+  if (sendCachedResponse(connectionHandle, ATT_OP_READ_BY_GROUP_REQ, readByGroupReq->startHandle, readByGroupReq->endHandle, readByGroupReq->uuid, mtu)) {
+    return;
+  }
+
   uint8_t response[mtu];
   uint16_t responseLength;
 
@@ -944,6 +1010,8 @@ void ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t d
     }
   }
 
+  cacheResponse(ATT_OP_READ_BY_GROUP_REQ, readByGroupReq->startHandle, readByGroupReq->endHandle, readByGroupReq->uuid, mtu, (responseLength == 2) ? 0 : responseLength, response);
+
   if (responseLength == 2) {
     sendError(connectionHandle, ATT_OP_READ_BY_GROUP_REQ, readByGroupReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
   } else {
@@ -963,7 +1031,7 @@ int ATTClass::readByGroupReq(uint16_t connectionHandle, uint16_t startHandle, ui
   return sendReq(connectionHandle, &readByGroupReq, sizeof(readByGroupReq), responseBuffer);
 }
 
-void ATTClass::readByGroupResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::readByGroupResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen < 2) {
     return; // invalid, drop
@@ -976,7 +1044,7 @@ void ATTClass::readByGroupResp(uint16_t connectionHandle, uint8_t dlen, uint8_t
   }
 }
 
-void ATTClass::readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint8_t dlen, uint8_t data[])
+void ATTClass::readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint16_t dlen, uint8_t data[])
 {
   if (opcode == ATT_OP_READ_REQ) {
     if (dlen != sizeof(uint16_t)) {
@@ -1072,6 +1140,14 @@ void ATTClass::readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_
     }
   } else if (attributeType == BLETypeDescriptor) {
     BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
+    BLELocalCharacteristic* characteristic = cccdCharacteristic(handle);
+    const uint8_t* value = descriptor->value();
+    uint16_t cccdValue;
+
+    if (characteristic) {
+      cccdValue = characteristic->cccdValue(peerIndex(connectionHandle));
+      value = (const uint8_t*)&cccdValue;
+    }
     
     uint16_t valueLength = descriptor->valueSize();
 
@@ -1082,7 +1158,7 @@ void ATTClass::readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_
 
     valueLength = min(mtu - responseLength, valueLength - offset);
 
-    memcpy(&response[responseLength], descriptor->value() + offset, valueLength);
+    memcpy(&response[responseLength], value + offset, valueLength);
     responseLength += valueLength;
   }
   if(holdResponse){
@@ -1093,7 +1169,7 @@ void ATTClass::readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_
   }
 }
 
-void ATTClass::readResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::readResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (connectionHandle == _pendingResp.connectionHandle && _pendingResp.op == ATT_OP_READ_RESP) {
     _pendingResp.buffer[0] = ATT_OP_READ_RESP;
@@ -1102,7 +1178,7 @@ void ATTClass::readResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
   }
 }
 
-void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) ReadByTypeReq {
     uint16_t startHandle;
@@ -1115,6 +1191,13 @@ void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
     return;
   }
 
+  // characteristic declarations only change with the database, values can change at any time
+  bool cacheable = (readByTypeReq->uuid == BLETypeCharacteristic);
+
+  if (cacheable && sendCachedResponse(connectionHandle, ATT_OP_READ_BY_TYPE_REQ, readByTypeReq->startHandle, readByTypeReq->endHandle, readByTypeReq->uuid, mtu)) {
+    return;
+  }
+
   uint8_t response[mtu];
   uint16_t responseLength;
 
@@ -1122,70 +1205,67 @@ void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
   response[1] = 0x00;
   responseLength = 2;
 
-  for (uint16_t i = (readByTypeReq->startHandle - 1); i < GATT.attributeCount() && i <= (readByTypeReq->endHandle - 1); i++) {
-    BLELocalAttribute* attribute = GATT.attribute(i);
-    uint16_t handle = (i + 1);
+  for (uint16_t handle = GATT.nextHandleOfType(readByTypeReq->uuid, readByTypeReq->startHandle); handle != 0 && handle <= readByTypeReq->endHandle && readByTypeReq->startHandle != 0; handle = GATT.nextHandleOfType(readByTypeReq->uuid, handle + 1)) {
+    BLELocalAttribute* attribute = GATT.attribute(handle - 1);
 
-    if (attribute->type() == readByTypeReq->uuid) {
-      if (attribute->type() == BLETypeCharacteristic) {
-        BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
-
-        if (characteristic->valueHandle() == handle) {
-          // value handle, skip
-          continue;
-        }
-
-        int uuidLen = attribute->uuidLength();
-        int typeSize = (uuidLen == 2) ? 7 : 21;
+    if (readByTypeReq->uuid == BLETypeCharacteristic) {
+      BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
 
-        if (response[1] == 0) {
-          response[1] = typeSize;
-        }
+      int uuidLen = attribute->uuidLength();
+      int typeSize = (uuidLen == 2) ? 7 : 21;
 
-        if (response[1] != typeSize) {
-          // all done, wrong size
-          break;
-        }
+      if (response[1] == 0) {
+        response[1] = typeSize;
+      }
 
-        // add the handle
-        memcpy(&response[responseLength], &handle, sizeof(handle));
-        responseLength += sizeof(handle);
+      if (response[1] != typeSize) {
+        // all done, wrong size
+        break;
+      }
 
-        // add the properties
-        response[responseLength++] = characteristic->properties();
+      // add the handle
+      memcpy(&response[responseLength], &handle, sizeof(handle));
+      responseLength += sizeof(handle);
 
-        // add the value handle
-        uint16_t valueHandle = (handle + 1);
-        memcpy(&response[responseLength], &valueHandle, sizeof(valueHandle));
-        responseLength += sizeof(valueHandle);
+      // add the properties
+      response[responseLength++] = characteristic->properties();
 
-        // add the UUID
-        memcpy(&response[responseLength], characteristic->uuidData(), uuidLen);
-        responseLength += uuidLen;
+      // add the value handle
+      uint16_t valueHandle = (handle + 1);
+      memcpy(&response[responseLength], &valueHandle, sizeof(valueHandle));
+      responseLength += sizeof(valueHandle);
 
-        // skip the next handle, it's a value handle
-        i++;
+      // add the UUID
+      memcpy(&response[responseLength], characteristic->uuidData(), uuidLen);
+      responseLength += uuidLen;
 
-        if ((responseLength + typeSize) > mtu) {
-          break;
-        }
-      } else if (attribute->type() == 0x2902) {
-        BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
+      if ((responseLength + typeSize) > mtu) {
+        break;
+      }
+    } else if (attribute->type() == BLETypeDescriptor) {
+      BLELocalDescriptor* descriptor = (BLELocalDescriptor*)attribute;
+      BLELocalCharacteristic* characteristic = cccdCharacteristic(handle);
+      const uint8_t* value = descriptor->value();
+      uint16_t cccdValue;
+
+      if (characteristic) {
+        cccdValue = characteristic->cccdValue(peerIndex(connectionHandle));
+        value = (const uint8_t*)&cccdValue;
+      }
 
-        // add the handle
-        memcpy(&response[responseLength], &handle, sizeof(handle));
-        responseLength += sizeof(handle);
+      // add the handle
+      memcpy(&response[responseLength], &handle, sizeof(handle));
+      responseLength += sizeof(handle);
 
-        // add the value
-        int valueSize = min((uint16_t)(mtu - responseLength), (uint16_t)descriptor->valueSize());
-        memcpy(&response[responseLength], descriptor->value(), valueSize);
-        responseLength += valueSize;
+      // add the value
+      int valueSize = min((uint16_t)(mtu - responseLength), (uint16_t)descriptor->valueSize());
+      memcpy(&response[responseLength], value, valueSize);
+      responseLength += valueSize;
 
-        response[1] = 2 + valueSize;
+      response[1] = 2 + valueSize;
 
-        break; // all done
-      }
-    } else if (attribute->type() == BLETypeCharacteristic && attribute->uuidLength() == 2 && memcmp(&readByTypeReq->uuid, attribute->uuidData(), 2) == 0) {
+      break; // all done
+    } else if (attribute->type() == BLETypeCharacteristic) {
       BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
 
       // add the handle
@@ -1203,6 +1283,10 @@ void ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dl
     }
   }
 
+  if (cacheable) {
+    cacheResponse(ATT_OP_READ_BY_TYPE_REQ, readByTypeReq->startHandle, readByTypeReq->endHandle, readByTypeReq->uuid, mtu, (responseLength == 2) ? 0 : responseLength, response);
+  }
+
   if (responseLength == 2) {
     sendError(connectionHandle, ATT_OP_READ_BY_TYPE_REQ, readByTypeReq->startHandle, ATT_ECODE_ATTR_NOT_FOUND);
   } else {
@@ -1222,7 +1306,7 @@ int ATTClass::readByTypeReq(uint16_t connectionHandle, uint16_t startHandle, uin
   return sendReq(connectionHandle, &readByTypeReq, sizeof(readByTypeReq), responseBuffer);
 }
 
-void ATTClass::readByTypeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::readByTypeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen < 1) {
     return; // invalid, drop
@@ -1235,7 +1319,7 @@ void ATTClass::readByTypeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t d
   }
 }
 
-void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op, uint8_t dlen, uint8_t data[])
+void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op, uint16_t dlen, uint8_t data[])
 {
   bool withResponse = (op == ATT_OP_WRITE_REQ);
 
@@ -1255,7 +1339,7 @@ void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op
     return;
   }
 
-  uint8_t valueLength = dlen - sizeof(handle);
+  uint16_t valueLength = dlen - sizeof(handle);
   uint8_t* value = &data[sizeof(handle)];
 
   BLELocalAttribute* attribute = GATT.attribute(handle - 1);
@@ -1282,7 +1366,12 @@ void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op
     for (int i = 0; i < ATT_MAX_PEERS; i++) {
       if (_peers[i].connectionHandle == connectionHandle) {
         if(holdResponse){
-          
+          if (valueLength > sizeof(writeBuffer) - 10) {
+            // too large to hold until the link is encrypted
+            writeBufferSize = 0;
+            break;
+          }
+
           writeBufferSize = 0;
           memcpy(writeBuffer, &handle, 2);
           writeBufferSize+=2;
@@ -1292,8 +1381,7 @@ void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op
           memcpy(&writeBuffer[writeBufferSize], _peers[i].address, sizeof(_peers[i].address));
           writeBufferSize += sizeof(_peers[i].address);
           
-          writeBuffer[writeBufferSize] = valueLength;
-          writeBufferSize += sizeof(valueLength);
+          writeBuffer[writeBufferSize++] = valueLength;
 
           memcpy(&writeBuffer[writeBufferSize], value, valueLength);
           writeBufferSize += valueLength;
@@ -1326,10 +1414,18 @@ void ATTClass::writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op
 
     BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)attribute;
 
-    for (int i = 0; i < ATT_MAX_PEERS; i++) {
-      if (_peers[i].connectionHandle == connectionHandle) {
-        characteristic->writeCccdValue(BLEDevice(_peers[i].addressType, _peers[i].address), *((uint16_t*)value));
-        break;
+    int i = peerIndex(connectionHandle);
+
+    if (i != -1) {
+      characteristic->writeCccdValue(BLEDevice(_peers[i].addressType, _peers[i].address), i, *((uint16_t*)value));
+
+      // subscriptions of bonded peers are kept for their next connection
+      if ((_peers[i].encryption & PEER_ENCRYPTION::ENCRYPTED_AES) && _storeCCCD != 0) {
+        uint8_t address[6];
+
+        if (bondAddress(connectionHandle, address)) {
+          _storeCCCD(address, characteristic->valueHandle(), characteristic->cccdValue(i));
+        }
       }
     }
   } else {
@@ -1378,7 +1474,7 @@ int ATTClass::processWriteBuffer(){
   return 1;
 }
 
-void ATTClass::writeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void ATTClass::writeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   if (dlen != 0) {
     return; // drop
@@ -1391,7 +1487,7 @@ void ATTClass::writeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]
   }
 }
 
-void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) PrepWriteReq {
     uint16_t handle;
@@ -1443,7 +1539,7 @@ void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
     return;
   }
 
-  uint8_t valueLength = dlen - sizeof(PrepWriteReq);
+  uint16_t valueLength = dlen - sizeof(PrepWriteReq);
   uint8_t* value = &data[sizeof(PrepWriteReq)];
 
   if ((offset != _longWriteValueLength) || ((offset + valueLength) > (uint16_t)characteristic->valueSize())) {
@@ -1464,7 +1560,7 @@ void ATTClass::prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
   HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
 }
 
-void ATTClass::execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[])
+void ATTClass::execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[])
 {
   if (dlen != sizeof(uint8_t)) {
     sendError(connectionHandle, ATT_OP_EXEC_WRITE_REQ, 0x0000, ATT_ECODE_INVALID_PDU);
@@ -1496,7 +1592,7 @@ void ATTClass::execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dle
   HCI.sendAclPkt(connectionHandle, ATT_CID, responseLength, response);
 }
 
-void ATTClass::handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint8_t dlen, uint8_t data[])
+void ATTClass::handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[])
 {
   if (dlen < 2) {
     return; // drop
@@ -1549,7 +1645,7 @@ void ATTClass::handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint
   }
 }
 
-void ATTClass::handleCnf(uint16_t /*connectionHandle*/, uint8_t /*dlen*/, uint8_t /*data*/[])
+void ATTClass::handleCnf(uint16_t /*connectionHandle*/, uint16_t /*dlen*/, uint8_t /*data*/[])
 {
   _cnf = true;
 }
@@ -1566,6 +1662,60 @@ void ATTClass::sendError(uint16_t connectionHandle, uint8_t opcode, uint16_t han
   HCI.sendAclPkt(connectionHandle, ATT_CID, sizeof(attError), &attError);
 }
 
+bool ATTClass::sendCachedResponse(uint16_t connectionHandle, uint8_t opcode, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu)
+{
+  if (_discoveryCacheVersion != GATT.databaseVersion()) {
+    flushDiscoveryCache();
+    _discoveryCacheVersion = GATT.databaseVersion();
+
+    return false;
+  }
+
+  for (int i = 0; i < ATT_DISCOVERY_CACHE_SIZE; i++) {
+    if (_discoveryCache[i].opcode == opcode && _discoveryCache[i].startHandle == startHandle &&
+        _discoveryCache[i].endHandle == endHandle && _discoveryCache[i].type == type && _discoveryCache[i].mtu == mtu) {
+      if (_discoveryCache[i].length == 0) {
+        sendError(connectionHandle, opcode, startHandle, ATT_ECODE_ATTR_NOT_FOUND);
+      } else {
+        HCI.sendAclPkt(connectionHandle, ATT_CID, _discoveryCache[i].length, _discoveryCache[i].response);
+      }
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ATTClass::cacheResponse(uint8_t opcode, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu, uint16_t length, const uint8_t response[])
+{
+  if (_discoveryCacheVersion != GATT.databaseVersion()) {
+    return;
+  }
+
+  if (length > sizeof(_discoveryCache[0].response)) {
+    return;
+  }
+
+  // replace the oldest entry
+  int i = _discoveryCacheNext;
+
+  _discoveryCacheNext = (_discoveryCacheNext + 1) % ATT_DISCOVERY_CACHE_SIZE;
+
+  _discoveryCache[i].opcode = opcode;
+  _discoveryCache[i].startHandle = startHandle;
+  _discoveryCache[i].endHandle = endHandle;
+  _discoveryCache[i].type = type;
+  _discoveryCache[i].mtu = mtu;
+  _discoveryCache[i].length = length;
+  memcpy(_discoveryCache[i].response, response, length);
+}
+
+void ATTClass::flushDiscoveryCache()
+{
+  memset(_discoveryCache, 0x00, sizeof(_discoveryCache));
+  _discoveryCacheNext = 0;
+}
 
 bool ATTClass::exchangeMtu(uint16_t connectionHandle)
 {
@@ -1805,34 +1955,26 @@ int ATTClass::readReq(uint16_t connectionHandle, uint16_t handle, uint8_t respon
   return sendReq(connectionHandle, &readReq, sizeof(readReq), responseBuffer);
 }
 
-int ATTClass::writeReq(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint8_t dataLen, uint8_t responseBuffer[])
+int ATTClass::writeReq(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen, uint8_t responseBuffer[])
 {
-  struct __attribute__ ((packed)) {
-    uint8_t op;
-    uint16_t handle;
-    uint8_t data[255];
-  } writeReq;
+  uint8_t writeReq[3 + dataLen];
 
-  writeReq.op = ATT_OP_WRITE_REQ;
-  writeReq.handle = handle;
-  memcpy(writeReq.data, data, dataLen);
+  writeReq[0] = ATT_OP_WRITE_REQ;
+  memcpy(&writeReq[1], &handle, sizeof(handle));
+  memcpy(&writeReq[3], data, dataLen);
 
-  return sendReq(connectionHandle, &writeReq, 3 + dataLen, responseBuffer);
+  return sendReq(connectionHandle, writeReq, sizeof(writeReq), responseBuffer);
 }
 
-void ATTClass::writeCmd(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint8_t dataLen)
+void ATTClass::writeCmd(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen)
 {
-  struct __attribute__ ((packed)) {
-    uint8_t op;
-    uint16_t handle;
-    uint8_t data[255];
-  } writeReq;
+  uint8_t writeCmd[3 + dataLen];
 
-  writeReq.op = ATT_OP_WRITE_CMD;
-  writeReq.handle = handle;
-  memcpy(writeReq.data, data, dataLen);
+  writeCmd[0] = ATT_OP_WRITE_CMD;
+  memcpy(&writeCmd[1], &handle, sizeof(handle));
+  memcpy(&writeCmd[3], data, dataLen);
 
-  sendReq(connectionHandle, &writeReq, 3 + dataLen, NULL);
+  sendReq(connectionHandle, writeCmd, sizeof(writeCmd), NULL);
 }
 
 // Set encryption state for a peer
@@ -1938,6 +2080,116 @@ int ATTClass::getPeerResolvedAddress(uint16_t connectionHandle, uint8_t resolved
   return 0;
 }
 
+int ATTClass::setPeerResolvedAddress(uint16_t connectionHandle, const uint8_t* resolvedAddress)
+{
+  int peer = peerIndex(connectionHandle);
+
+  if (peer == -1) {
+    return 0;
+  }
+
+  memcpy(_peers[peer].resolvedAddress, resolvedAddress, 6);
+  return 1;
+}
+
+void ATTClass::storeCccdValues(uint16_t connectionHandle)
+{
+  int peer = peerIndex(connectionHandle);
+  uint8_t address[6];
+
+  if (peer == -1 || _storeCCCD == 0 || !bondAddress(connectionHandle, address)) {
+    return;
+  }
+
+  for (uint16_t handle = GATT.nextHandleOfType(BLETypeCharacteristic, 1); handle != 0; handle = GATT.nextHandleOfType(BLETypeCharacteristic, handle + 1)) {
+    BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)GATT.attribute(handle - 1);
+
+    if (characteristic->properties() & (BLENotify | BLEIndicate)) {
+      _storeCCCD(address, characteristic->valueHandle(), characteristic->cccdValue(peer));
+    }
+  }
+}
+
+void ATTClass::loadCccdValues(uint16_t connectionHandle)
+{
+  int peer = peerIndex(connectionHandle);
+  uint8_t address[6];
+
+  if (peer == -1 || _getCCCD == 0 || !bondAddress(connectionHandle, address)) {
+    return;
+  }
+
+  BLEDevice device(_peers[peer].addressType, _peers[peer].address);
+
+  for (uint16_t handle = GATT.nextHandleOfType(BLETypeCharacteristic, 1); handle != 0; handle = GATT.nextHandleOfType(BLETypeCharacteristic, handle + 1)) {
+    BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)GATT.attribute(handle - 1);
+    uint16_t value;
+
+    if ((characteristic->properties() & (BLENotify | BLEIndicate)) && _getCCCD(address, characteristic->valueHandle(), &value)) {
+      characteristic->writeCccdValue(device, peer, value);
+    }
+  }
+}
+
+int ATTClass::peerIndex(uint16_t connectionHandle) const
+{
+  for (int i = 0; i < ATT_MAX_PEERS; i++) {
+    if (_peers[i].connectionHandle == connectionHandle) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+BLELocalCharacteristic* ATTClass::cccdCharacteristic(uint16_t handle) const
+{
+  BLELocalAttribute* attribute = GATT.attribute(handle - 1);
+
+  if (attribute == NULL || attribute->type() != BLETypeDescriptor ||
+      attribute->uuidLength() != 2 || *((uint16_t*)(attribute->uuidData())) != 0x2902) {
+    return NULL;
+  }
+
+  // the CCCD follows the value handle of its characteristic
+  attribute = GATT.attribute(handle - 2);
+
+  if (attribute == NULL || attribute->type() != BLETypeCharacteristic) {
+    return NULL;
+  }
+
+  return (BLELocalCharacteristic*)attribute;
+}
+
+void ATTClass::clearCccdValues(int peer)
+{
+  BLEDevice device(_peers[peer].addressType, _peers[peer].address);
+
+  for (uint16_t handle = GATT.nextHandleOfType(BLETypeCharacteristic, 1); handle != 0; handle = GATT.nextHandleOfType(BLETypeCharacteristic, handle + 1)) {
+    BLELocalCharacteristic* characteristic = (BLELocalCharacteristic*)GATT.attribute(handle - 1);
+
+    characteristic->writeCccdValue(device, peer, 0x0000);
+  }
+}
+
+// Get the address a bond is stored under, the same one as its LTK
+int ATTClass::bondAddress(uint16_t connectionHandle, uint8_t address[6])
+{
+  uint8_t peerAddr[7];
+
+  if (getPeerResolvedAddress(connectionHandle, address)) {
+    return 1;
+  }
+
+  if (!getPeerAddrWithType(connectionHandle, peerAddr)) {
+    return 0;
+  }
+
+  memcpy(address, &peerAddr[1], 6);
+
+  return 1;
+}
+
 #if !defined(FAKE_ATT)
 ATTClass ATTObj;
 ATTClass& ATT = ATTObj;
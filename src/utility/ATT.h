@@ -23,17 +23,19 @@
 #include <Arduino.h>
 
 #include "BLEDevice.h"
+#include "ATTConfig.h"
 #include "keyDistribution.h"
 
 #define ATT_CID       0x0004
 #define BLE_CTL       0x0008
 
-#if DM_CONN_MAX
-#define ATT_MAX_PEERS DM_CONN_MAX // Mbed + Cordio
-#elif __AVR__
-#define ATT_MAX_PEERS 3
+// discovery responses longer than ATT_DISCOVERY_CACHE_RESPONSE_SIZE are built again for every request
+#ifdef __AVR__
+#define ATT_DISCOVERY_CACHE_SIZE 2
+#define ATT_DISCOVERY_CACHE_RESPONSE_SIZE 23
 #else
-#define ATT_MAX_PEERS 8
+#define ATT_DISCOVERY_CACHE_SIZE 8
+#define ATT_DISCOVERY_CACHE_RESPONSE_SIZE 128
 #endif
 
 enum PEER_ENCRYPTION {
@@ -47,6 +49,7 @@ enum PEER_ENCRYPTION {
   ENCRYPTED_AES         = 1 << 7
 };
 
+class BLELocalCharacteristic;
 class BLERemoteDevice;
 
 class ATTClass {
@@ -66,7 +69,7 @@ public:
                     uint16_t latency, uint16_t supervisionTimeout,
                     uint8_t masterClockAccuracy);
 
-  virtual void handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
+  virtual void handleData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
 
   virtual void removeConnection(uint16_t handle, uint8_t reason);
 
@@ -89,8 +92,8 @@ public:
   virtual void setEventHandler(BLEDeviceEvent event, BLEDeviceEventHandler eventHandler);
 
   virtual int readReq(uint16_t connectionHandle, uint16_t handle, uint8_t responseBuffer[]);
-  virtual int writeReq(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint8_t dataLen, uint8_t responseBuffer[]);
-  virtual void writeCmd(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint8_t dataLen);
+  virtual int writeReq(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen, uint8_t responseBuffer[]);
+  virtual void writeCmd(uint16_t connectionHandle, uint16_t handle, const uint8_t* data, uint16_t dataLen);
   virtual int setPeerEncryption(uint16_t connectionHandle, uint8_t encryption);
   uint8_t getPeerEncryption(uint16_t connectionHandle);
   uint16_t getPeerEncrptingConnectionHandle();
@@ -99,6 +102,11 @@ public:
   virtual int setPeerIOCap(uint16_t connectionHandle, uint8_t IOCap[]);
   virtual int getPeerIOCap(uint16_t connectionHandle, uint8_t IOCap[]);
   virtual int getPeerResolvedAddress(uint16_t connectionHandle, uint8_t* resolvedAddress);
+  virtual int setPeerResolvedAddress(uint16_t connectionHandle, const uint8_t* resolvedAddress);
+  virtual void storeCccdValues(uint16_t connectionHandle);
+  virtual void loadCccdValues(uint16_t connectionHandle);
+  int (*_storeCCCD)(uint8_t* address, uint16_t handle, uint16_t value) = 0;
+  int (*_getCCCD)(uint8_t* address, uint16_t handle, uint16_t* value) = 0;
   uint8_t holdBuffer[64];
   uint8_t writeBuffer[64];
   uint8_t holdBufferSize;
@@ -110,28 +118,28 @@ public:
   /// This is just a random number... Not sure it has use unless privacy mode is active.
   uint8_t localIRK[16] = {0x54,0x83,0x63,0x7c,0xc5,0x1e,0xf7,0xec,0x32,0xdd,0xad,0x51,0x89,0x4b,0x9e,0x07};
 private:
-  virtual void error(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
+  virtual void error(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
   virtual void mtuReq(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
   virtual int mtuReq(uint16_t connectionHandle, uint16_t mtu, uint8_t responseBuffer[]);
-  virtual void mtuResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
+  virtual void mtuResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
   virtual void findInfoReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
   virtual int findInfoReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint8_t responseBuffer[]);
-  virtual void findInfoResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
-  virtual void readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
+  virtual void findInfoResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void findByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual void readByTypeReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
   virtual int readByTypeReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint8_t responseBuffer[]);
-  virtual void readByTypeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint8_t dlen, uint8_t data[]);
-  virtual void readResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
+  virtual void readByTypeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void readOrReadBlobReq(uint16_t connectionHandle, uint16_t mtu, uint8_t opcode, uint16_t dlen, uint8_t data[]);
+  virtual void readResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void readByGroupReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
   virtual int readByGroupReq(uint16_t connectionHandle, uint16_t startHandle, uint16_t endHandle, uint16_t uuid, uint8_t responseBuffer[]);
-  virtual void readByGroupResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op, uint8_t dlen, uint8_t data[]);
-  virtual void writeResp(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
-  virtual void prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
-  virtual void execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint8_t dlen, uint8_t data[]);
-  virtual void handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint8_t dlen, uint8_t data[]);
-  virtual void handleCnf(uint16_t connectionHandle, uint8_t dlen, uint8_t data[]);
+  virtual void readByGroupResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void writeReqOrCmd(uint16_t connectionHandle, uint16_t mtu, uint8_t op, uint16_t dlen, uint8_t data[]);
+  virtual void writeResp(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
+  virtual void prepWriteReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual void execWriteReq(uint16_t connectionHandle, uint16_t mtu, uint16_t dlen, uint8_t data[]);
+  virtual void handleNotifyOrInd(uint16_t connectionHandle, uint8_t opcode, uint16_t dlen, uint8_t data[]);
+  virtual void handleCnf(uint16_t connectionHandle, uint16_t dlen, uint8_t data[]);
   virtual void sendError(uint16_t connectionHandle, uint8_t opcode, uint16_t handle, uint8_t code);
 
   virtual bool exchangeMtu(uint16_t connectionHandle);
@@ -141,6 +149,15 @@ private:
 
   virtual int sendReq(uint16_t connectionHandle, void* requestBuffer, int requestLength, uint8_t responseBuffer[]);
 
+  int peerIndex(uint16_t connectionHandle) const;
+  BLELocalCharacteristic* cccdCharacteristic(uint16_t handle) const;
+  void clearCccdValues(int peer);
+  int bondAddress(uint16_t connectionHandle, uint8_t address[6]);
+
+  virtual bool sendCachedResponse(uint16_t connectionHandle, uint8_t opcode, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu);
+  virtual void cacheResponse(uint8_t opcode, uint16_t startHandle, uint16_t endHandle, uint16_t type, uint16_t mtu, uint16_t length, const uint8_t response[]);
+  virtual void flushDiscoveryCache();
+
 private:
   uint16_t _maxMtu;
   unsigned long _timeout;
@@ -166,10 +183,23 @@ private:
     uint16_t connectionHandle;
     uint8_t op;
     uint8_t* buffer;
-    uint8_t length;
+    uint16_t length;
   } _pendingResp;
 
   BLEDeviceEventHandler _eventHandlers[2];
+
+  // encoded discovery responses, only valid for _discoveryCacheVersion of the database
+  struct {
+    uint8_t opcode;
+    uint16_t startHandle;
+    uint16_t endHandle;
+    uint16_t type;
+    uint16_t mtu;
+    uint16_t length; // 0 if nothing was found
+    uint8_t response[ATT_DISCOVERY_CACHE_RESPONSE_SIZE];
+  } _discoveryCache[ATT_DISCOVERY_CACHE_SIZE];
+  uint8_t _discoveryCacheNext;
+  uint16_t _discoveryCacheVersion;
 };
 
 extern ATTClass& ATT;
@@ -0,0 +1,33 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _ATT_CONFIG_H_
+#define _ATT_CONFIG_H_
+
+#include <Arduino.h>
+
+#if DM_CONN_MAX
+#define ATT_MAX_PEERS DM_CONN_MAX // Mbed + Cordio
+#elif __AVR__
+#define ATT_MAX_PEERS 3
+#else
+#define ATT_MAX_PEERS 8
+#endif
+
+#endif
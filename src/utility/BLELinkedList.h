@@ -37,6 +37,7 @@ public:
   T get(unsigned int index) const;
   void clear();
   T remove(unsigned int index);
+  void copyTo(T items[]) const;
 
   unsigned int size() const;
 
@@ -107,6 +108,16 @@ template <typename T> void BLELinkedList<T>::clear()
   _last = NULL;
 }
 
+template <typename T> void BLELinkedList<T>::copyTo(T items[]) const
+{
+  BLELinkedListNode<T>* itemNode = _root;
+
+  for (unsigned int i = 0; i < _size; i++) {
+    items[i] = itemNode->data;
+    itemNode = itemNode->next;
+  }
+}
+
 template <typename T> unsigned int BLELinkedList<T>::size() const
 {
   return _size;
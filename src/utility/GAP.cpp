@@ -17,7 +17,9 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include "BLEAdvertisingData.h"
 #include "BLEUuid.h"
+#include "ATT.h"
 #include "HCI.h"
 
 #include "GAP.h"
@@ -27,14 +29,83 @@
 #define GAP_ADV_IND (0x00)
 #define GAP_ADV_SCAN_IND (0x02)
 #define GAP_ADV_NONCONN_IND (0x03)
+#define GAP_ADV_SCAN_RSP (0x04)
+
+// extended advertising event properties and report event types
+#define GAP_ADV_PROP_CONNECTABLE (0x0001)
+#define GAP_ADV_PROP_SCANNABLE   (0x0002)
+#define GAP_ADV_PROP_DIRECTED    (0x0004)
+#define GAP_ADV_PROP_SCAN_RSP    (0x0008)
+#define GAP_ADV_PROP_LEGACY      (0x0010)
+
+#define GAP_EXT_DATA_COMPLETE   (0x00)
+#define GAP_EXT_DATA_INCOMPLETE (0x01)
+#define GAP_EXT_DATA_TRUNCATED  (0x02)
+
+// scanning filter policies
+#define GAP_SCAN_FILTER_NONE        (0x00)
+#define GAP_SCAN_FILTER_ACCEPT_LIST (0x01)
+
+// length of the AD structures at the start of data that were received whole
+static uint16_t completeAdLength(uint8_t data[], uint16_t length)
+{
+  uint16_t i = 0;
+
+  while (i < length && (i + 1 + data[i]) <= length) {
+    i += 1 + data[i];
+  }
+
+  return i;
+}
+
+// "aa:bb:cc:dd:ee:ff" as printed by BLEDevice::address(), to the byte order used over HCI
+static bool parseAddress(const String& address, uint8_t result[6])
+{
+  if (address.length() != 17) {
+    return false;
+  }
+
+  for (int i = 0; i < 6; i++) {
+    uint8_t value = 0;
+
+    for (int j = 0; j < 2; j++) {
+      char c = address.charAt(i * 3 + j);
+
+      value <<= 4;
+
+      if (c >= '0' && c <= '9') {
+        value |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        value |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        value |= c - 'A' + 10;
+      } else {
+        return false;
+      }
+    }
+
+    if (i < 5 && address.charAt(i * 3 + 2) != ':') {
+      return false;
+    }
+
+    result[5 - i] = value;
+  }
+
+  return true;
+}
 
 GAPClass::GAPClass() :
   _advertising(false),
   _scanning(false),
   _advertisingInterval(160),
   _connectable(true),
-  _discoverEventHandler(NULL)
+  _discoverEventHandler(NULL),
+  _advertisingSetCount(1),
+  _rotationSet(0),
+  _rotationStart(0),
+  _scanAddressValid(false)
 {
+  _extReport.length = 0;
 }
 
 GAPClass::~GAPClass()
@@ -48,58 +119,258 @@ bool GAPClass::advertising()
 
 int GAPClass::advertise(uint8_t* advData, uint8_t advDataLen, uint8_t* scanData, uint8_t scanDataLen)
 {
-  uint8_t directBdaddr[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+  AdvertisingSet& set = _advertisingSets[0];
 
-  uint8_t type = (_connectable) ? GAP_ADV_IND : (scanDataLen ? GAP_ADV_SCAN_IND : GAP_ADV_NONCONN_IND);
+  set.advData = advData;
+  set.advDataLength = advDataLen;
+  set.scanData = scanData;
+  set.scanDataLength = scanDataLen;
+  set.interval = _advertisingInterval;
+  set.weight = 1;
 
   stopAdvertise();
 
-  if (HCI.leSetAdvertisingParameters(_advertisingInterval, _advertisingInterval, type, 0x00, 0x00, directBdaddr, 0x07, 0) != 0) {
-    return 0;
+  if (HCI.leFeatureSupported(LE_FEATURE_EXTENDED_ADVERTISING)) {
+    uint8_t handles[GAP_MAX_ADVERTISING_SETS];
+    uint8_t supportedSets;
+
+    if (_advertisingSetCount > 1 && HCI.leReadNumberOfSupportedAdvertisingSets(supportedSets) == 0 &&
+        supportedSets < _advertisingSetCount) {
+      return 0;
+    }
+
+    for (int i = 0; i < _advertisingSetCount; i++) {
+      if (!advertiseExtendedSet(i)) {
+        return 0;
+      }
+      handles[i] = i;
+    }
+
+    // the controller interleaves the sets, each at its own interval
+    if (HCI.leSetExtendedAdvertisingEnable(0x01, _advertisingSetCount, handles) != 0) {
+      return 0;
+    }
+  } else {
+    for (int i = 1; i < _advertisingSetCount; i++) {
+      if (_advertisingSets[i].advDataLength > MAX_AD_DATA_LENGTH || _advertisingSets[i].scanDataLength > MAX_AD_DATA_LENGTH) {
+        return 0;
+      }
+    }
+
+    if (!advertiseLegacySet(0)) {
+      return 0;
+    }
+
+    _rotationSet = 0;
+    _rotationStart = millis();
   }
 
-  if (HCI.leSetAdvertisingData(advDataLen, advData) != 0) {
+  _advertising = true;
+
+  return 1;
+}
+
+int GAPClass::addAdvertisingSet(uint8_t* advData, uint8_t advDataLength, uint8_t* scanData, uint8_t scanDataLength,
+                                uint16_t advertisingInterval, uint8_t weight)
+{
+  if (_advertisingSetCount >= GAP_MAX_ADVERTISING_SETS) {
     return 0;
   }
 
-  if (HCI.leSetScanResponseData(scanDataLen, scanData) != 0) {
-    return 0;
+  AdvertisingSet& set = _advertisingSets[_advertisingSetCount++];
+
+  set.advData = advData;
+  set.advDataLength = advDataLength;
+  set.scanData = scanData;
+  set.scanDataLength = scanDataLength;
+  set.interval = advertisingInterval;
+  set.weight = (weight) ? weight : 1;
+
+  return 1;
+}
+
+void GAPClass::clearAdvertisingSets()
+{
+  _advertisingSetCount = 1;
+}
+
+void GAPClass::poll()
+{
+  // extended advertising sets are rotated by the controller
+  if (!_advertising || _advertisingSetCount < 2 || HCI.leFeatureSupported(LE_FEATURE_EXTENDED_ADVERTISING)) {
+    return;
   }
 
-  if (HCI.leSetAdvertiseEnable(0x01) != 0) {
+  // the controller stopped connectable advertising when the central connected,
+  // resumeAdvertising() restarts it once the connection is gone
+  if (_connectable && ATT.connected()) {
+    return;
+  }
+
+  if ((millis() - _rotationStart) < ((unsigned long)_advertisingSets[_rotationSet].weight * GAP_ADV_ROTATION_SLOT)) {
+    return;
+  }
+
+  _rotationSet = (_rotationSet + 1) % _advertisingSetCount;
+  _rotationStart = millis();
+
+  HCI.leSetAdvertiseEnable(0x00);
+  advertiseLegacySet(_rotationSet);
+}
+
+int GAPClass::advertiseLegacySet(int index)
+{
+  AdvertisingSet& set = _advertisingSets[index];
+  uint8_t directBdaddr[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+  if (set.advDataLength > MAX_AD_DATA_LENGTH || set.scanDataLength > MAX_AD_DATA_LENGTH) {
     return 0;
   }
 
-  _advertising = true;
+  uint8_t type = (_connectable) ? GAP_ADV_IND : (set.scanDataLength ? GAP_ADV_SCAN_IND : GAP_ADV_NONCONN_IND);
 
-  return 1;
+  HCI.beginCommandBatch();
+  HCI.leSetAdvertisingParameters(set.interval, set.interval, type, 0x00, 0x00, directBdaddr, 0x07, 0);
+  HCI.leSetAdvertisingData(set.advDataLength, set.advData);
+  HCI.leSetScanResponseData(set.scanDataLength, set.scanData);
+  HCI.leSetAdvertiseEnable(0x01);
+
+  return (HCI.endCommandBatch() == 0);
+}
+
+int GAPClass::advertiseExtendedSet(int index)
+{
+  AdvertisingSet& set = _advertisingSets[index];
+  uint8_t mergedData[MAX_EXT_AD_DATA_LENGTH];
+  uint8_t* advData = set.advData;
+  uint8_t advDataLen = set.advDataLength;
+  uint8_t* scanData = set.scanData;
+  uint8_t scanDataLen = set.scanDataLength;
+  uint8_t handle = index;
+  uint16_t properties;
+
+  if (advDataLen <= MAX_AD_DATA_LENGTH && scanDataLen <= MAX_AD_DATA_LENGTH) {
+    // legacy PDUs still reach every scanner
+    properties = GAP_ADV_PROP_LEGACY;
+
+    if (_connectable) {
+      properties |= GAP_ADV_PROP_CONNECTABLE | GAP_ADV_PROP_SCANNABLE;
+    } else if (scanDataLen) {
+      properties |= GAP_ADV_PROP_SCANNABLE;
+    }
+  } else {
+    // extended advertisements can't be connectable and scannable at once, the scan response
+    // is sent along with the advertising data, which also saves scanners a scan request
+    if ((advDataLen + scanDataLen) > MAX_EXT_AD_DATA_LENGTH) {
+      return 0;
+    }
+
+    memcpy(mergedData, advData, advDataLen);
+    memcpy(&mergedData[advDataLen], scanData, scanDataLen);
+    advData = mergedData;
+    advDataLen += scanDataLen;
+    scanDataLen = 0;
+
+    properties = (_connectable) ? GAP_ADV_PROP_CONNECTABLE : 0x0000;
+  }
+
+  // data left from a previous configuration may not be valid with the new properties,
+  // fails harmlessly if the set doesn't exist yet
+  HCI.leRemoveAdvertisingSet(handle);
+
+  HCI.beginCommandBatch();
+  HCI.leSetExtendedAdvertisingParameters(handle, properties, set.interval, set.interval,
+                                         0x07, 0x00, 0x00, BLEPhy1M, BLEPhy1M, index);
+  HCI.leSetExtendedAdvertisingData(handle, advDataLen, advData);
+  if (properties & GAP_ADV_PROP_SCANNABLE) {
+    HCI.leSetExtendedScanResponseData(handle, scanDataLen, scanData);
+  }
+
+  return (HCI.endCommandBatch() == 0);
 }
 
 void GAPClass::stopAdvertise()
 {
   _advertising = false;
 
-  HCI.leSetAdvertiseEnable(0x00);
+  if (HCI.leFeatureSupported(LE_FEATURE_EXTENDED_ADVERTISING)) {
+    HCI.leSetExtendedAdvertisingEnable(0x00, 0, NULL);
+  } else {
+    HCI.leSetAdvertiseEnable(0x00);
+  }
+}
+
+void GAPClass::resumeAdvertising()
+{
+  if (!_advertising) {
+    return;
+  }
+
+  // connectable advertising stops when a connection is established
+  if (HCI.leFeatureSupported(LE_FEATURE_EXTENDED_ADVERTISING)) {
+    uint8_t handles[GAP_MAX_ADVERTISING_SETS];
+
+    for (int i = 0; i < _advertisingSetCount; i++) {
+      handles[i] = i;
+    }
+
+    HCI.leSetExtendedAdvertisingEnable(0x01, _advertisingSetCount, handles);
+  } else {
+    HCI.leSetAdvertiseEnable(0x01);
+
+    // the resumed set gets a full slot before the rotation moves on
+    _rotationStart = millis();
+  }
 }
 
 int GAPClass::scan(bool withDuplicates)
 {
+  return startScan(withDuplicates, GAP_SCAN_FILTER_NONE);
+}
+
+int GAPClass::startScan(bool withDuplicates, uint8_t filterPolicy)
+{
+  _extReport.length = 0;
+
+  if (HCI.leFeatureSupported(LE_FEATURE_EXTENDED_ADVERTISING)) {
+    uint8_t phys = BLEPhy1M;
+
+    // long range advertisers are only heard on the coded PHY
+    if (HCI.leFeatureSupported(LE_FEATURE_CODED_PHY) && (HCI.preferredPhy() & BLEPhyCoded)) {
+      phys |= BLEPhyCoded;
+    }
+
+    HCI.leSetExtendedScanEnable(false, true);
+
+    HCI.beginCommandBatch();
+    HCI.leSetExtendedScanParameters(0x00, filterPolicy, phys, 0x01, 0x0020, 0x0020);
+    HCI.leSetExtendedScanEnable(true, !withDuplicates);
+
+    _scanning = true;
+
+    if (HCI.endCommandBatch() != 0) {
+      return 0;
+    }
+
+    return 1;
+  }
+
   HCI.leSetScanEnable(false, true);
 
-  // active scan, 20 ms scan interval (N * 0.625), 20 ms scan window (N * 0.625), public own address type, no filter
+  // active scan, 20 ms scan interval (N * 0.625), 20 ms scan window (N * 0.625), public own address type
   /*
     Warning (from BLUETOOTH SPECIFICATION 5.x):
     - scan interval: mandatory range from 0x0012 to 0x1000; only even values are valid
     - scan window: mandatory range from 0x0011 to 0x1000
     - The scan window can only be less than or equal to the scan interval
   */
-  if (HCI.leSetScanParameters(0x01, 0x0020, 0x0020, 0x00, 0x00) != 0) {
-    return false;
-  }
+  HCI.beginCommandBatch();
+  HCI.leSetScanParameters(0x01, 0x0020, 0x0020, 0x00, filterPolicy);
+  HCI.leSetScanEnable(true, !withDuplicates);
 
   _scanning = true;
 
-  if (HCI.leSetScanEnable(true, !withDuplicates) != 0) {
+  if (HCI.endCommandBatch() != 0) {
     return 0;
   }
 
@@ -111,6 +382,7 @@ int GAPClass::scanForName(String name, bool withDuplicates)
   _scanNameFilter    = name;
   _scanUuidFilter    = "";
   _scanAddressFilter = "";
+  _scanAddressValid  = false;
 
   return scan(withDuplicates);
 }
@@ -120,6 +392,7 @@ int GAPClass::scanForUuid(String uuid, bool withDuplicates)
   _scanNameFilter    = "";
   _scanUuidFilter    = uuid;
   _scanAddressFilter = "";
+  _scanAddressValid  = false;
 
   return scan(withDuplicates);
 }
@@ -129,15 +402,92 @@ int GAPClass::scanForAddress(String address, bool withDuplicates)
   _scanNameFilter    = "";
   _scanUuidFilter    = "";
   _scanAddressFilter = address;
+  _scanAddressValid  = parseAddress(address, _scanAddress);
 
-  return scan(withDuplicates);
+  // let the controller drop the reports of other devices, the list
+  // can't be changed while a scan uses it
+  if (_scanAddressValid) {
+    if (_scanning) {
+      stopScan();
+    }
+
+    if (clearAcceptList() && addToAcceptList(_scanAddress)) {
+      return startScan(withDuplicates, GAP_SCAN_FILTER_ACCEPT_LIST);
+    }
+  }
+
+  return startScan(withDuplicates, GAP_SCAN_FILTER_NONE);
+}
+
+int GAPClass::scanForAcceptList(bool withDuplicates)
+{
+  _scanNameFilter    = "";
+  _scanUuidFilter    = "";
+  _scanAddressFilter = "";
+  _scanAddressValid  = false;
+
+  return startScan(withDuplicates, GAP_SCAN_FILTER_ACCEPT_LIST);
+}
+
+int GAPClass::addToAcceptList(String address)
+{
+  uint8_t addressBytes[6];
+
+  if (!parseAddress(address, addressBytes)) {
+    return 0;
+  }
+
+  return addToAcceptList(addressBytes);
+}
+
+int GAPClass::addToAcceptList(uint8_t address[6])
+{
+  // the advertised address type isn't known up front
+  return (HCI.leAddDeviceToFilterAcceptList(0x00, address) == 0 &&
+          HCI.leAddDeviceToFilterAcceptList(0x01, address) == 0);
+}
+
+int GAPClass::removeFromAcceptList(String address)
+{
+  uint8_t addressBytes[6];
+
+  if (!parseAddress(address, addressBytes)) {
+    return 0;
+  }
+
+  // an entry of either type missing from the list is not an error
+  int publicResult = HCI.leRemoveDeviceFromFilterAcceptList(0x00, addressBytes);
+  int randomResult = HCI.leRemoveDeviceFromFilterAcceptList(0x01, addressBytes);
+
+  return (publicResult == 0 || randomResult == 0);
+}
+
+int GAPClass::clearAcceptList()
+{
+  return (HCI.leClearFilterAcceptList() == 0);
+}
+
+int GAPClass::acceptListSize()
+{
+  uint8_t size;
+
+  if (HCI.leReadFilterAcceptListSize(size) != 0) {
+    return 0;
+  }
+
+  return size;
 }
 
 void GAPClass::stopScan()
 {
-  HCI.leSetScanEnable(false, false);
+  if (HCI.leFeatureSupported(LE_FEATURE_EXTENDED_ADVERTISING)) {
+    HCI.leSetExtendedScanEnable(false, false);
+  } else {
+    HCI.leSetScanEnable(false, false);
+  }
 
   _scanning = false;
+  _extReport.length = 0;
 
   for (unsigned int i = 0; i < _discoveredDevices.size(); i++) {
     BLEDevice* device = _discoveredDevices.get(i);
@@ -253,9 +603,73 @@ void GAPClass::handleLeAdvertisingReport(uint8_t type, uint8_t addressType, uint
   }
 }
 
+void GAPClass::handleLeExtendedAdvertisingReport(uint16_t eventType, uint8_t addressType, uint8_t address[6],
+                                                 uint8_t sid, uint8_t dataLength, uint8_t data[], int8_t rssi)
+{
+  if (!_scanning) {
+    return;
+  }
+
+  uint8_t dataStatus = (eventType >> 5) & 0x03;
+
+  // the fragments of an advertisement are reported back to back, a report
+  // from another advertiser means the rest of the pending one was lost
+  if (_extReport.length && (_extReport.addressType != addressType || _extReport.sid != sid ||
+                            memcmp(_extReport.address, address, sizeof(_extReport.address)) != 0)) {
+    _extReport.length = 0;
+  }
+
+  uint16_t length = _extReport.length;
+
+  if (dataLength > (sizeof(_extReport.data) - length)) {
+    dataLength = sizeof(_extReport.data) - length;
+    dataStatus = GAP_EXT_DATA_TRUNCATED;
+  }
+
+  memcpy(&_extReport.data[length], data, dataLength);
+  length += dataLength;
+
+  if (dataStatus == GAP_EXT_DATA_INCOMPLETE) {
+    _extReport.addressType = addressType;
+    memcpy(_extReport.address, address, sizeof(_extReport.address));
+    _extReport.sid = sid;
+    _extReport.length = length;
+    return;
+  }
+
+  _extReport.length = 0;
+
+  if (dataStatus != GAP_EXT_DATA_COMPLETE) {
+    length = completeAdLength(_extReport.data, length);
+  }
+
+  uint8_t type;
+
+  if (eventType & GAP_ADV_PROP_SCAN_RSP) {
+    type = GAP_ADV_SCAN_RSP;
+  } else if (eventType & GAP_ADV_PROP_LEGACY) {
+    if (eventType & GAP_ADV_PROP_DIRECTED) {
+      type = 0x01;
+    } else if (eventType & GAP_ADV_PROP_CONNECTABLE) {
+      type = GAP_ADV_IND;
+    } else if (eventType & GAP_ADV_PROP_SCANNABLE) {
+      type = GAP_ADV_SCAN_IND;
+    } else {
+      type = GAP_ADV_NONCONN_IND;
+    }
+  } else {
+    // only scannable extended advertisements are followed by a scan response
+    type = (eventType & GAP_ADV_PROP_SCANNABLE) ? GAP_ADV_SCAN_IND : GAP_ADV_NONCONN_IND;
+  }
+
+  handleLeAdvertisingReport(type, addressType, address, length, _extReport.data, rssi);
+}
+
 bool GAPClass::matchesScanFilter(const BLEDevice& device)
 {
-  if (_scanAddressFilter.length() > 0 && !(_scanAddressFilter.equalsIgnoreCase(device.address()))) {
+  if (_scanAddressValid && memcmp(_scanAddress, device._address, sizeof(_scanAddress)) != 0) {
+    return false; // drop doesn't match
+  } else if (!_scanAddressValid && _scanAddressFilter.length() > 0 && !(_scanAddressFilter.equalsIgnoreCase(device.address()))) {
     return false; // drop doesn't match
   } else if (_scanNameFilter.length() > 0 && _scanNameFilter != device.localName()) {
     return false; // drop doesn't match
@@ -24,6 +24,15 @@
 
 #include "BLEDevice.h"
 
+// including the one started with advertise()
+#ifdef __AVR__
+#define GAP_MAX_ADVERTISING_SETS 2
+#else
+#define GAP_MAX_ADVERTISING_SETS 4
+#endif
+// without extended advertising the sets take turns, each for this many ms per unit of weight
+#define GAP_ADV_ROTATION_SLOT    500
+
 class GAPClass {
 public:
   GAPClass();
@@ -32,12 +41,25 @@ public:
   virtual bool advertising();
   virtual int advertise(uint8_t* advData, uint8_t advDataLength, uint8_t* scanData, uint8_t scanDataLength);
   virtual void stopAdvertise();
+  // the data must stay valid while advertising, sets are started by the next advertise()
+  virtual int addAdvertisingSet(uint8_t* advData, uint8_t advDataLength, uint8_t* scanData, uint8_t scanDataLength,
+                                uint16_t advertisingInterval, uint8_t weight);
+  virtual void clearAdvertisingSets();
+  virtual void poll();
 
   virtual int scan(bool withDuplicates);
   virtual int scanForName(String name, bool withDuplicates);
   virtual int scanForUuid(String uuid, bool withDuplicates);
   virtual int scanForAddress(String address, bool withDuplicates);
+  // only devices in the controller filter accept list are reported
+  virtual int scanForAcceptList(bool withDuplicates);
   virtual void stopScan();
+  // addresses go in with both the public and the random address type,
+  // scanForAddress() replaces the content of the list
+  virtual int addToAcceptList(String address);
+  virtual int removeFromAcceptList(String address);
+  virtual int clearAcceptList();
+  virtual int acceptListSize();
   virtual BLEDevice available();
 
   virtual void setAdvertisingInterval(uint16_t advertisingInterval);
@@ -50,9 +72,16 @@ protected:
 
   virtual void handleLeAdvertisingReport(uint8_t type, uint8_t addressType, uint8_t address[6],
                                   uint8_t eirLength, uint8_t eirData[], int8_t rssi);
+  virtual void resumeAdvertising();
+  virtual void handleLeExtendedAdvertisingReport(uint16_t eventType, uint8_t addressType, uint8_t address[6],
+                                  uint8_t sid, uint8_t dataLength, uint8_t data[], int8_t rssi);
 
 private:
   virtual bool matchesScanFilter(const BLEDevice& device);
+  virtual int startScan(bool withDuplicates, uint8_t filterPolicy);
+  virtual int addToAcceptList(uint8_t address[6]);
+  virtual int advertiseLegacySet(int index);
+  virtual int advertiseExtendedSet(int index);
 
 private:
   bool _advertising;
@@ -61,12 +90,35 @@ private:
   uint16_t _advertisingInterval;
   bool _connectable;
 
+  // extended advertising data split over several reports
+  struct {
+    uint8_t addressType;
+    uint8_t address[6];
+    uint8_t sid;
+    uint16_t length; // 0 when nothing is being reassembled
+    uint8_t data[BLE_MAX_EIR_DATA_LENGTH];
+  } _extReport;
+
   BLEDeviceEventHandler _discoverEventHandler;
+
+  struct AdvertisingSet {
+    uint8_t* advData;
+    uint8_t advDataLength;
+    uint8_t* scanData;
+    uint8_t scanDataLength;
+    uint16_t interval;
+    uint8_t weight;
+  } _advertisingSets[GAP_MAX_ADVERTISING_SETS];
+  uint8_t _advertisingSetCount;
+  uint8_t _rotationSet;
+  unsigned long _rotationStart;
   BLELinkedList<BLEDevice*> _discoveredDevices;
 
   String _scanNameFilter;
   String _scanUuidFilter;
   String _scanAddressFilter;
+  uint8_t _scanAddress[6]; // _scanAddressFilter parsed, if _scanAddressValid
+  bool _scanAddressValid;
 };
 
 extern GAPClass& GAP;
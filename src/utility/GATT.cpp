@@ -28,6 +28,10 @@
 #include "GATT.h"
 
 GATTClass::GATTClass() :
+  _attributeTable(NULL),
+  _typeIndex(NULL),
+  _typeIndexSize(0),
+  _databaseVersion(0),
   _genericAccessService(NULL),
   _deviceNameCharacteristic(NULL),
   _appearanceCharacteristic(NULL),
@@ -70,20 +74,26 @@ void GATTClass::begin()
 
 void GATTClass::end()
 {
-  if (_genericAccessService->release() == 0)
+  if (_genericAccessService && _genericAccessService->release() == 0)
     delete(_genericAccessService);
   
-  if (_deviceNameCharacteristic->release() == 0)
+  if (_deviceNameCharacteristic && _deviceNameCharacteristic->release() == 0)
     delete(_deviceNameCharacteristic);
   
-  if (_appearanceCharacteristic->release() == 0)
+  if (_appearanceCharacteristic && _appearanceCharacteristic->release() == 0)
     delete(_appearanceCharacteristic);
   
-  if (_genericAttributeService->release() == 0)
+  if (_genericAttributeService && _genericAttributeService->release() == 0)
     delete(_genericAttributeService);
   
-  if (_servicesChangedCharacteristic->release() == 0)
+  if (_servicesChangedCharacteristic && _servicesChangedCharacteristic->release() == 0)
     delete(_servicesChangedCharacteristic);
+
+  _genericAccessService = NULL;
+  _deviceNameCharacteristic = NULL;
+  _appearanceCharacteristic = NULL;
+  _genericAttributeService = NULL;
+  _servicesChangedCharacteristic = NULL;
   
   clearAttributes();
 }
@@ -114,7 +124,88 @@ unsigned int GATTClass::attributeCount() const
 
 BLELocalAttribute* GATTClass::attribute(unsigned int index) const
 {
-  return _attributes.get(index);
+  if (index >= _attributes.size()) {
+    return NULL;
+  }
+
+  if (_attributeTable == NULL && !buildAttributeTable()) {
+    return _attributes.get(index);
+  }
+
+  return _attributeTable[index];
+}
+
+uint16_t GATTClass::attributeType(uint16_t handle) const
+{
+  BLELocalAttribute* attribute = this->attribute(handle - 1);
+
+  if (attribute == NULL) {
+    return 0;
+  }
+
+  enum BLEAttributeType type = attribute->type();
+
+  if (type == BLETypeCharacteristic && ((BLELocalCharacteristic*)attribute)->handle() == handle) {
+    return BLETypeCharacteristic;
+  } else if (type == BLETypeService) {
+    return BLETypeService;
+  }
+
+  // characteristic value or descriptor, typed by its own UUID
+  if (attribute->uuidLength() != 2) {
+    return 0;
+  }
+
+  uint16_t uuid;
+  memcpy(&uuid, attribute->uuidData(), sizeof(uuid));
+
+  return uuid;
+}
+
+uint16_t GATTClass::nextHandleOfType(uint16_t type, uint16_t startHandle) const
+{
+  if (startHandle == 0) {
+    startHandle = 1;
+  }
+
+  if (_attributeTable == NULL) {
+    buildAttributeTable();
+  }
+
+  if (_typeIndex == NULL) {
+    for (unsigned int handle = startHandle; handle <= attributeCount(); handle++) {
+      if (attributeType(handle) == type) {
+        return handle;
+      }
+    }
+
+    return 0;
+  }
+
+  // lower bound of (type, startHandle)
+  unsigned int low = 0;
+  unsigned int high = _typeIndexSize;
+
+  while (low < high) {
+    unsigned int mid = (low + high) / 2;
+
+    if (_typeIndex[mid].type < type || (_typeIndex[mid].type == type && _typeIndex[mid].handle < startHandle)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low < _typeIndexSize && _typeIndex[low].type == type) {
+    return _typeIndex[low].handle;
+  }
+
+  return 0;
+}
+
+uint16_t GATTClass::databaseVersion() const
+{
+  return _databaseVersion;
 }
 
 uint16_t GATTClass::serviceUuidForCharacteristic(BLELocalCharacteristic* characteristic) const
@@ -147,6 +238,9 @@ uint16_t GATTClass::serviceUuidForCharacteristic(BLELocalCharacteristic* charact
 
 void GATTClass::addService(BLELocalService* service)
 {
+  freeAttributeTable();
+  _databaseVersion++;
+
   service->retain();
   _attributes.add(service);
   _services.add(service);
@@ -178,20 +272,98 @@ void GATTClass::addService(BLELocalService* service)
 
 void GATTClass::clearAttributes()
 {
+  freeAttributeTable();
+  _databaseVersion++;
+
+  // the services are also in _attributes, clear them before they can be deleted below
+  for (unsigned int i = 0; i < _services.size(); i++) {
+    _services.get(i)->clear();
+  }
+  _services.clear();
+
   for (unsigned int i = 0; i < attributeCount(); i++) {
-    BLELocalAttribute* a = attribute(i);
+    BLELocalAttribute* a = _attributes.get(i);
 
     if (a->release() == 0) {
       delete a;
     }
   }
   _attributes.clear();
+}
 
-  for (unsigned int i = 0; i < _services.size(); i++) {
-    _services.get(i)->clear();
+void GATTClass::freezeAttributes()
+{
+  if (_attributeTable == NULL) {
+    buildAttributeTable();
   }
-  _services.clear();
+}
+
+int GATTClass::compareTypeEntries(const void* a, const void* b)
+{
+  const AttributeTypeEntry* entryA = (const AttributeTypeEntry*)a;
+  const AttributeTypeEntry* entryB = (const AttributeTypeEntry*)b;
+
+  if (entryA->type != entryB->type) {
+    return (entryA->type < entryB->type) ? -1 : 1;
+  }
+
+  return (int)entryA->handle - (int)entryB->handle;
+}
+
+bool GATTClass::buildAttributeTable() const
+{
+  // the ATT handlers look attributes up in loops over handle ranges, walking
+  // the list for each of them would make a full discovery quadratic
+  _attributeTable = (BLELocalAttribute**)malloc(_attributes.size() * sizeof(BLELocalAttribute*));
 
+  if (_attributeTable == NULL) {
+    return false;
+  }
+
+  _attributes.copyTo(_attributeTable);
+
+  // index the handles by type, so range queries for a type visit only its handles
+  unsigned int count = 0;
+
+  for (unsigned int handle = 1; handle <= attributeCount(); handle++) {
+    if (attributeType(handle) != 0) {
+      count++;
+    }
+  }
+
+  _typeIndex = (AttributeTypeEntry*)malloc(count * sizeof(AttributeTypeEntry));
+
+  if (_typeIndex != NULL) {
+    _typeIndexSize = 0;
+
+    for (unsigned int handle = 1; handle <= attributeCount(); handle++) {
+      uint16_t type = attributeType(handle);
+
+      if (type != 0) {
+        _typeIndex[_typeIndexSize].type = type;
+        _typeIndex[_typeIndexSize].handle = handle;
+        _typeIndexSize++;
+      }
+    }
+
+    qsort(_typeIndex, _typeIndexSize, sizeof(AttributeTypeEntry), compareTypeEntries);
+  }
+
+  return true;
+}
+
+void GATTClass::freeAttributeTable()
+{
+  if (_attributeTable) {
+    free(_attributeTable);
+    _attributeTable = NULL;
+  }
+
+  if (_typeIndex) {
+    free(_typeIndex);
+    _typeIndex = NULL;
+    _typeIndexSize = 0;
+  }
 }
 
 #if !defined(FAKE_GATT)
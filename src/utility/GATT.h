@@ -41,12 +41,21 @@ public:
 
   virtual void addService(BLEService& service);
 
+  virtual void freezeAttributes();
+
 protected:
   friend class ATTClass;
 
   virtual unsigned int attributeCount() const;
   virtual BLELocalAttribute* attribute(unsigned int index) const;
 
+  // 16-bit attribute type seen by clients at the handle, 0 if it is a 128-bit UUID
+  virtual uint16_t attributeType(uint16_t handle) const;
+  // first handle >= startHandle with the given attribute type, 0 if there is none
+  virtual uint16_t nextHandleOfType(uint16_t type, uint16_t startHandle) const;
+  // changes whenever services are added or removed
+  virtual uint16_t databaseVersion() const;
+
 protected:
   friend class BLELocalCharacteristic;
 
@@ -56,11 +65,26 @@ private:
   virtual void addService(BLELocalService* service);
 
   virtual void clearAttributes();
+  static int compareTypeEntries(const void* a, const void* b);
+  bool buildAttributeTable() const;
+  void freeAttributeTable();
 
 private:
   BLELinkedList<BLELocalAttribute*> _attributes;
   BLELinkedList<BLELocalService*>   _services;
 
+  struct AttributeTypeEntry {
+    uint16_t type;
+    uint16_t handle;
+  };
+
+  // copy of _attributes indexed by handle - 1, built by the first lookup after a change
+  mutable BLELocalAttribute**   _attributeTable;
+  // (type, handle) pairs sorted by type then handle, built with _attributeTable
+  mutable AttributeTypeEntry*   _typeIndex;
+  mutable unsigned int          _typeIndexSize;
+  uint16_t                      _databaseVersion;
+
   BLELocalService*              _genericAccessService;
   BLELocalCharacteristic*       _deviceNameCharacteristic;
   BLELocalCharacteristic*       _appearanceCharacteristic;
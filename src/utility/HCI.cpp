@@ -19,6 +19,7 @@
 
 #include "ATT.h"
 #include "GAP.h"
+#include "HCICapture.h"
 #include "HCITransport.h"
 #include "L2CAPSignaling.h"
 #include "btct.h"
@@ -32,13 +33,20 @@
 #define HCI_EVENT_PKT     0x04
 #define HCI_SECURITY_PKT  0x06
 
+#define HCI_ACL_HDR_LEN   5 // type, handle and data length
+#define L2CAP_HDR_LEN     4 // length and channel id
+
+#define ACL_PB_FIRST      0x0000 // first non-automatically-flushable fragment
+#define ACL_PB_CONTINUING 0x1000
+#define HCI_EVENT_HDR_LEN 3 // type, event code and parameter length
+
 #define EVT_DISCONN_COMPLETE  0x05
 #define EVT_ENCRYPTION_CHANGE 0x08
 #define EVT_CMD_COMPLETE      0x0e
 #define EVT_CMD_STATUS        0x0f
 #define EVT_NUM_COMP_PKTS     0x13
 #define EVT_RETURN_LINK_KEYS  0x15
-#define EVT_UNKNOWN           0x10
+#define EVT_HARDWARE_ERROR    0x10
 #define EVT_LE_META_EVENT     0x3e
 
 #define EVT_LE_CONN_COMPLETE      0x01
@@ -60,25 +68,63 @@
 #define OCF_READ_RSSI          0x0005
 
 // OGF_LE_CTL
-#define OCF_LE_READ_BUFFER_SIZE           0x0002
-#define OCF_LE_SET_RANDOM_ADDRESS         0x0005
-#define OCF_LE_SET_ADVERTISING_PARAMETERS 0x0006
-#define OCF_LE_SET_ADVERTISING_DATA       0x0008
-#define OCF_LE_SET_SCAN_RESPONSE_DATA     0x0009
-#define OCF_LE_SET_ADVERTISE_ENABLE       0x000a
-#define OCF_LE_SET_SCAN_PARAMETERS        0x000b
-#define OCF_LE_SET_SCAN_ENABLE            0x000c
-#define OCF_LE_CREATE_CONN                0x000d
-#define OCF_LE_CANCEL_CONN                0x000e
-#define OCF_LE_CONN_UPDATE                0x0013
+#define OCF_LE_READ_BUFFER_SIZE            0x0002
+#define OCF_LE_READ_LOCAL_FEATURES         0x0003
+#define OCF_LE_SET_RANDOM_ADDRESS          0x0005
+#define OCF_LE_SET_ADVERTISING_PARAMETERS  0x0006
+#define OCF_LE_SET_ADVERTISING_DATA        0x0008
+#define OCF_LE_SET_SCAN_RESPONSE_DATA      0x0009
+#define OCF_LE_SET_ADVERTISE_ENABLE        0x000a
+#define OCF_LE_SET_SCAN_PARAMETERS         0x000b
+#define OCF_LE_SET_SCAN_ENABLE             0x000c
+#define OCF_LE_CREATE_CONN                 0x000d
+#define OCF_LE_CANCEL_CONN                 0x000e
+#define OCF_LE_READ_ACCEPT_LIST_SIZE       0x000f
+#define OCF_LE_CLEAR_ACCEPT_LIST           0x0010
+#define OCF_LE_ADD_TO_ACCEPT_LIST          0x0011
+#define OCF_LE_REMOVE_FROM_ACCEPT_LIST     0x0012
+#define OCF_LE_CONN_UPDATE                 0x0013
+#define OCF_LE_SET_DATA_LENGTH             0x0022
+#define OCF_LE_READ_SUGGESTED_DATA_LENGTH  0x0023
+#define OCF_LE_WRITE_SUGGESTED_DATA_LENGTH 0x0024
+#define OCF_LE_ADD_TO_RESOLVING_LIST       0x0027
+#define OCF_LE_REMOVE_FROM_RESOLVING_LIST  0x0028
+#define OCF_LE_CLEAR_RESOLVING_LIST        0x0029
+#define OCF_LE_READ_RESOLVING_LIST_SIZE    0x002a
+#define OCF_LE_READ_PEER_RESOLVABLE_ADDR   0x002b
+#define OCF_LE_SET_ADDRESS_RESOLUTION      0x002d
+#define OCF_LE_READ_PHY                    0x0030
+#define OCF_LE_SET_DEFAULT_PHY             0x0031
+#define OCF_LE_SET_PHY                     0x0032
+#define OCF_LE_SET_EXT_ADV_PARAMETERS      0x0036
+#define OCF_LE_SET_EXT_ADV_DATA            0x0037
+#define OCF_LE_SET_EXT_SCAN_RESPONSE_DATA  0x0038
+#define OCF_LE_SET_EXT_ADV_ENABLE          0x0039
+#define OCF_LE_READ_NUM_ADV_SETS           0x003b
+#define OCF_LE_REMOVE_ADV_SET              0x003c
+#define OCF_LE_SET_EXT_SCAN_PARAMETERS     0x0041
+#define OCF_LE_SET_EXT_SCAN_ENABLE         0x0042
+#define OCF_LE_EXT_CREATE_CONN             0x0043
 
 #define HCI_OE_USER_ENDED_CONNECTION 0x13
 
+#define ACL_TX_NONE 0xff
+
+struct CommandWaiter {
+  bool done;
+  int status;
+  uint8_t responseLength;
+  uint8_t response[HCI_CMD_RESPONSE_SIZE];
+};
+
 String metaEventToString(LE_META_EVENT event)
 {
   switch(event){
     case CONN_COMPLETE: return F("CONN_COMPLETE");
     case ADVERTISING_REPORT: return F("ADVERTISING_REPORT");
+    case DATA_LENGTH_CHANGE: return F("DATA_LENGTH_CHANGE");
+    case PHY_UPDATE_COMPLETE: return F("PHY_UPDATE_COMPLETE");
+    case EXTENDED_ADVERTISING_REPORT: return F("EXTENDED_ADVERTISING_REPORT");
     case LONG_TERM_KEY_REQUEST: return F("LE_LONG_TERM_KEY_REQUEST");
     case READ_LOCAL_P256_COMPLETE: return F("READ_LOCAL_P256_COMPLETE");
     case GENERATE_DH_KEY_COMPLETE: return F("GENERATE_DH_KEY_COMPLETE");
@@ -97,11 +143,72 @@ String commandToString(LE_COMMAND command){
   }
 }
 
+#ifdef HCI_STATS
+static int statsBucket(unsigned long latency)
+{
+  int bucket = 0;
+
+  for (latency /= HCI_STATS_BUCKET_BASE; latency && bucket < (HCI_STATS_BUCKETS - 1); latency >>= 1) {
+    bucket++;
+  }
+
+  return bucket;
+}
+
+// counters stick at their maximum rather than wrap
+static void statsIncrement(HCIStatsCount& count)
+{
+  if ((HCIStatsCount)(count + 1) != 0) {
+    count++;
+  }
+}
+#endif
+
+// HCI numbers the PHYs 1, 2 and 3, BLEPhy is a bit mask
+static uint8_t phyMask(uint8_t phy)
+{
+  return (phy == 0x03) ? (uint8_t)BLEPhyCoded : phy;
+}
+
 HCIClass::HCIClass() :
   _debug(NULL),
   _recvIndex(0),
-  _pendingPkt(0)
+  _recvLength(0),
+  _cmdQueueHead(0),
+  _cmdQueueCount(0),
+  _cmdCredits(1),
+  _cmdLastActivity(0),
+  _cmdBatch(false),
+  _cmdBatchStatus(0),
+  _cmdBatchPending(0),
+  _leFeatures(0),
+  _preferredTxOctets(LE_MAX_DATA_OCTETS),
+  _preferredPhys(BLEPhy2M),
+  _aclPktLen(27),
+  _pendingPkt(0),
+  _aclTxFree(ACL_TX_NONE),
+  _aclTxNext(0),
+  _jobHead(0),
+  _jobCount(0),
+  _jobsRunning(false)
 {
+  memset(_cmdInFlight, 0x00, sizeof(_cmdInFlight));
+
+  _p256KeyMaxUses = 1;
+  _p256KeyMaxAge = 0;
+
+  for (int i = 0; i < HCI_MAX_CONNECTIONS; i++) {
+    _aclConnections[i].handle = 0xffff;
+  }
+
+#ifdef HCI_STATS
+  _cmdSubmitted = 0;
+  resetStats();
+#endif
+
+  for (int i = 0; i < HCI_ACL_RX_CONTEXTS; i++) {
+    _aclRxContexts[i].handle = 0xffff;
+  }
 }
 
 HCIClass::~HCIClass()
@@ -111,6 +218,44 @@ HCIClass::~HCIClass()
 int HCIClass::begin()
 {
   _recvIndex = 0;
+  _cmdQueueHead = 0;
+  _cmdQueueCount = 0;
+  _cmdCredits = 1;
+  _cmdBatch = false;
+  memset(_cmdInFlight, 0x00, sizeof(_cmdInFlight));
+  _jobHead = 0;
+  _jobCount = 0;
+
+  for (int i = 0; i < HCI_MAX_CONNECTIONS; i++) {
+    if (_aclConnections[i].handle != 0xffff) {
+      handleDisconnect(_aclConnections[i].handle);
+    }
+  }
+
+  _aclTxFree = ACL_TX_NONE;
+  for (int i = HCI_ACL_TX_QUEUE_SIZE - 1; i >= 0; i--) {
+    _aclTxPackets[i].next = _aclTxFree;
+    _aclTxPackets[i].length = 0;
+    _aclTxFree = i;
+  }
+  _aclTxNext = 0;
+  _pendingPkt = 0;
+  _leFeatures = 0;
+  _addressResolution = false;
+  _resolvingListOverflow = false;
+  _resolvingListSize = 0;
+  _resolvingListCount = 0;
+  _resolvedPeerValid = false;
+  rpaCacheFlush();
+  _irkResolver.clear();
+  _irkResolverComplete = false;
+  _p256KeyState = P256_KEY_NONE;
+  _p256WaitingHandle = 0xffff;
+  _dhKeyPending = false;
+
+  for (int i = 0; i < HCI_ACL_RX_CONTEXTS; i++) {
+    _aclRxContexts[i].handle = 0xffff;
+  }
 
   return HCITransport.begin();
 }
@@ -127,6 +272,10 @@ void HCIClass::poll()
 
 void HCIClass::poll(unsigned long timeout)
 {
+  // event handlers expect their own commands to run to completion
+  bool batch = _cmdBatch;
+  _cmdBatch = false;
+
 #ifdef ARDUINO_AVR_UNO_WIFI_REV2
   digitalWrite(NINA_RTS, LOW);
 #endif
@@ -136,64 +285,82 @@ void HCIClass::poll(unsigned long timeout)
   }
 
   while (HCITransport.available()) {
-    byte b = HCITransport.read();
-	
-    if (_recvIndex >= sizeof(_recvBuffer)) {
+    if (_recvIndex == 0) {
+      // start of a new packet, the type selects the header length
+      _recvIndex = HCITransport.readBytes(_recvBuffer, 1);
+
+      if (_recvBuffer[0] == HCI_ACLDATA_PKT) {
+        _recvLength = HCI_ACL_HDR_LEN;
+      } else if (_recvBuffer[0] == HCI_EVENT_PKT) {
+        _recvLength = HCI_EVENT_HDR_LEN;
+      } else {
         _recvIndex = 0;
+
         if (_debug) {
-            _debug->println("_recvBuffer overflow");
+          _debug->println(_recvBuffer[0], HEX);
         }
+      }
+      continue;
     }
 
-    _recvBuffer[_recvIndex++] = b;
+    // copy as much of the header or payload as the transport has ready
+    _recvIndex += HCITransport.readBytes(&_recvBuffer[_recvIndex], _recvLength - _recvIndex);
 
-    if (_recvBuffer[0] == HCI_ACLDATA_PKT) {
-      if (_recvIndex > 5 && _recvIndex >= (5 + (_recvBuffer[3] + (_recvBuffer[4] << 8)))) {
-        if (_debug) {
-          dumpPkt("HCI ACLDATA RX <- ", _recvIndex, _recvBuffer);
-        }
-#ifdef ARDUINO_AVR_UNO_WIFI_REV2
-        digitalWrite(NINA_RTS, HIGH);
-#endif
-        int pktLen = _recvIndex - 1;
-        _recvIndex = 0;
+    if (_recvIndex < _recvLength) {
+      continue;
+    }
 
-        handleAclDataPkt(pktLen, &_recvBuffer[1]);
+    if (_recvLength == HCI_ACL_HDR_LEN && _recvBuffer[0] == HCI_ACLDATA_PKT) {
+      // header complete, the rest of the packet can be read in one go
+      _recvLength += _recvBuffer[3] + (_recvBuffer[4] << 8);
+    } else if (_recvLength == HCI_EVENT_HDR_LEN && _recvBuffer[0] == HCI_EVENT_PKT) {
+      _recvLength += _recvBuffer[2];
+    }
 
-#ifdef ARDUINO_AVR_UNO_WIFI_REV2
-        digitalWrite(NINA_RTS, LOW);  
-#endif
+    if (_recvLength > sizeof(_recvBuffer)) {
+      _recvIndex = 0;
+      if (_debug) {
+        _debug->println("_recvBuffer overflow");
       }
-    } else if (_recvBuffer[0] == HCI_EVENT_PKT) {
-      if (_recvIndex > 3 && _recvIndex >= (3 + _recvBuffer[2])) {
-        if (_debug) {
-          dumpPkt("HCI EVENT RX <- ", _recvIndex, _recvBuffer);
-        }
-#ifdef ARDUINO_AVR_UNO_WIFI_REV2
-        digitalWrite(NINA_RTS, HIGH);
-#endif
-        // received full event
-        int pktLen = _recvIndex - 1;
-        _recvIndex = 0;
+      continue;
+    }
 
-        handleEventPkt(pktLen, &_recvBuffer[1]);
+    if (_recvIndex < _recvLength) {
+      continue;
+    }
 
+    if (_debug) {
+      dumpPkt(_recvBuffer[0] == HCI_ACLDATA_PKT ? "HCI ACLDATA RX <- " : "HCI EVENT RX <- ", _recvIndex, _recvBuffer);
+    }
+    HCICapture.capture(true, _recvBuffer, _recvIndex);
 #ifdef ARDUINO_AVR_UNO_WIFI_REV2
-        digitalWrite(NINA_RTS, LOW);
+    digitalWrite(NINA_RTS, HIGH);
 #endif
-      }
-    } else {
-      _recvIndex = 0;
+    // received full packet
+    int pktLen = _recvIndex - 1;
+    _recvIndex = 0;
 
-      if (_debug) {
-        _debug->println(b, HEX);
-      }
+    if (_recvBuffer[0] == HCI_ACLDATA_PKT) {
+      handleAclDataPkt(pktLen, &_recvBuffer[1]);
+    } else {
+      handleEventPkt(pktLen, &_recvBuffer[1]);
     }
+
+    // the receive buffer is free again, do the work the handlers put off
+    runJobs();
+
+#ifdef ARDUINO_AVR_UNO_WIFI_REV2
+    digitalWrite(NINA_RTS, LOW);
+#endif
   }
 
 #ifdef ARDUINO_AVR_UNO_WIFI_REV2
   digitalWrite(NINA_RTS, HIGH);
 #endif
+
+  expireCommands();
+
+  _cmdBatch = batch;
 }
 
 int HCIClass::reset()
@@ -288,14 +455,173 @@ int HCIClass::readLeBufferSize(uint16_t& pktLen, uint8_t& maxPkt)
     pktLen = leBufferSize->pktLen;
     _maxPkt = maxPkt = leBufferSize->maxPkt;
 
-#ifndef __AVR__
-    ATT.setMaxMtu(pktLen - 9); // max pkt len - ACL header size
+    if (pktLen) {
+      _aclPktLen = pktLen;
+    }
+
+#ifdef HCI_ACL_RX_MAX_MTU
+    // outgoing frames are fragmented to pktLen, so only reassembly limits the MTU
+    ATT.setMaxMtu(HCI_ACL_RX_MAX_MTU);
 #endif
   }
 
   return result;
 }
 
+int HCIClass::leReadLocalSupportedFeatures(uint64_t& features)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_LOCAL_FEATURES);
+
+  if (result == 0) {
+    memcpy(&_leFeatures, _cmdResponse, sizeof(_leFeatures));
+    features = _leFeatures;
+  }
+
+  return result;
+}
+
+bool HCIClass::leFeatureSupported(uint64_t feature)
+{
+  return (_leFeatures & feature) != 0;
+}
+
+int HCIClass::leReadSuggestedDefaultDataLength(uint16_t& txOctets, uint16_t& txTime)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_SUGGESTED_DATA_LENGTH);
+
+  if (result == 0) {
+    struct __attribute__ ((packed)) HCILeSuggestedDataLength {
+      uint16_t txOctets;
+      uint16_t txTime;
+    } *suggestedDataLength = (HCILeSuggestedDataLength*)_cmdResponse;
+
+    txOctets = suggestedDataLength->txOctets;
+    txTime = suggestedDataLength->txTime;
+  }
+
+  return result;
+}
+
+int HCIClass::leWriteSuggestedDefaultDataLength(uint16_t txOctets, uint16_t txTime)
+{
+  struct __attribute__ ((packed)) HCILeSuggestedDataLength {
+    uint16_t txOctets;
+    uint16_t txTime;
+  } suggestedDataLength = { txOctets, txTime };
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_WRITE_SUGGESTED_DATA_LENGTH, sizeof(suggestedDataLength), &suggestedDataLength);
+}
+
+int HCIClass::leSetDataLength(uint16_t handle, uint16_t txOctets, uint16_t txTime)
+{
+  struct __attribute__ ((packed)) HCILeSetDataLength {
+    uint16_t handle;
+    uint16_t txOctets;
+    uint16_t txTime;
+  } setDataLength = { handle, txOctets, txTime };
+
+  // the controller answers with a command status and reports the outcome
+  // with a data length change event, so there is nothing to wait for
+  return sendCommandAsync(OGF_LE_CTL << 10 | OCF_LE_SET_DATA_LENGTH, sizeof(setDataLength), &setDataLength) ? 0 : -1;
+}
+
+void HCIClass::setPreferredDataLength(uint16_t txOctets)
+{
+  if (txOctets < LE_MIN_DATA_OCTETS) {
+    txOctets = LE_MIN_DATA_OCTETS;
+  } else if (txOctets > LE_MAX_DATA_OCTETS) {
+    txOctets = LE_MAX_DATA_OCTETS;
+  }
+
+  _preferredTxOctets = txOctets;
+}
+
+uint16_t HCIClass::preferredDataLength()
+{
+  return _preferredTxOctets;
+}
+
+int HCIClass::dataLength(uint16_t handle, uint16_t& txOctets, uint16_t& rxOctets)
+{
+  int connection = aclConnection(handle, false);
+
+  if (connection == -1) {
+    return 0;
+  }
+
+  txOctets = _aclConnections[connection].maxTxOctets;
+  rxOctets = _aclConnections[connection].maxRxOctets;
+
+  return 1;
+}
+
+int HCIClass::leSetDefaultPhy(uint8_t txPhys, uint8_t rxPhys)
+{
+  struct __attribute__ ((packed)) HCILeSetDefaultPhy {
+    uint8_t allPhys;
+    uint8_t txPhys;
+    uint8_t rxPhys;
+  } setDefaultPhy = { 0x00, txPhys, rxPhys };
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_DEFAULT_PHY, sizeof(setDefaultPhy), &setDefaultPhy);
+}
+
+int HCIClass::leSetPhy(uint16_t handle, uint8_t txPhys, uint8_t rxPhys)
+{
+  struct __attribute__ ((packed)) HCILeSetPhy {
+    uint16_t handle;
+    uint8_t allPhys;
+    uint8_t txPhys;
+    uint8_t rxPhys;
+    uint16_t phyOptions;
+  } setPhy = { handle, 0x00, txPhys, rxPhys, 0x0000 };
+
+  // the outcome is reported with a PHY update complete event
+  return sendCommandAsync(OGF_LE_CTL << 10 | OCF_LE_SET_PHY, sizeof(setPhy), &setPhy) ? 0 : -1;
+}
+
+int HCIClass::leReadPhy(uint16_t handle, uint8_t& txPhy, uint8_t& rxPhy)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_PHY, sizeof(handle), &handle);
+
+  if (result == 0) {
+    struct __attribute__ ((packed)) HCILeReadPhy {
+      uint16_t handle;
+      uint8_t txPhy;
+      uint8_t rxPhy;
+    } *readPhy = (HCILeReadPhy*)_cmdResponse;
+
+    txPhy = phyMask(readPhy->txPhy);
+    rxPhy = phyMask(readPhy->rxPhy);
+  }
+
+  return result;
+}
+
+void HCIClass::setPreferredPhy(uint8_t phys)
+{
+  _preferredPhys = phys & (BLEPhy1M | BLEPhy2M | BLEPhyCoded);
+}
+
+uint8_t HCIClass::preferredPhy()
+{
+  return _preferredPhys;
+}
+
+int HCIClass::phy(uint16_t handle, uint8_t& txPhy, uint8_t& rxPhy)
+{
+  int connection = aclConnection(handle, false);
+
+  if (connection == -1) {
+    return 0;
+  }
+
+  txPhy = _aclConnections[connection].txPhy;
+  rxPhy = _aclConnections[connection].rxPhy;
+
+  return 1;
+}
+
 int HCIClass::leSetRandomAddress(uint8_t addr[6])
 {
   return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_RANDOM_ADDRESS, 6, addr);
@@ -396,6 +722,186 @@ int HCIClass::leSetScanEnable(uint8_t enabled, uint8_t duplicates)
   return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_SCAN_ENABLE, sizeof(leScanEnableData), &leScanEnableData);
 }
 
+int HCIClass::leSetExtendedAdvertisingParameters(uint8_t handle, uint16_t properties,
+                                                 uint32_t minInterval, uint32_t maxInterval,
+                                                 uint8_t chanMap, uint8_t ownBdaddrType, uint8_t filter,
+                                                 uint8_t primaryPhy, uint8_t secondaryPhy, uint8_t sid)
+{
+  struct __attribute__ ((packed)) HCILeExtAdvertisingParameters {
+    uint8_t handle;
+    uint16_t properties;
+    uint8_t minInterval[3];
+    uint8_t maxInterval[3];
+    uint8_t chanMap;
+    uint8_t ownBdaddrType;
+    uint8_t peerBdaddrType;
+    uint8_t peerBdaddr[6];
+    uint8_t filter;
+    int8_t txPower;
+    uint8_t primaryPhy;
+    uint8_t secondaryMaxSkip;
+    uint8_t secondaryPhy;
+    uint8_t sid;
+    uint8_t scanRequestNotification;
+  } leExtAdvertisingParameters;
+
+  memset(&leExtAdvertisingParameters, 0, sizeof(leExtAdvertisingParameters));
+  leExtAdvertisingParameters.handle = handle;
+  leExtAdvertisingParameters.properties = properties;
+  memcpy(leExtAdvertisingParameters.minInterval, &minInterval, 3);
+  memcpy(leExtAdvertisingParameters.maxInterval, &maxInterval, 3);
+  leExtAdvertisingParameters.chanMap = chanMap;
+  leExtAdvertisingParameters.ownBdaddrType = ownBdaddrType;
+  leExtAdvertisingParameters.filter = filter;
+  leExtAdvertisingParameters.txPower = 0x7f; // no preference
+  // HCI numbers the coded PHY 3
+  leExtAdvertisingParameters.primaryPhy = (primaryPhy == BLEPhyCoded) ? 0x03 : primaryPhy;
+  leExtAdvertisingParameters.secondaryPhy = (secondaryPhy == BLEPhyCoded) ? 0x03 : secondaryPhy;
+  leExtAdvertisingParameters.sid = sid;
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_ADV_PARAMETERS, sizeof(leExtAdvertisingParameters), &leExtAdvertisingParameters);
+}
+
+int HCIClass::leSetExtendedAdvertisingData(uint8_t handle, uint8_t length, uint8_t data[])
+{
+  struct __attribute__ ((packed)) HCILeExtAdvertisingData {
+    uint8_t handle;
+    uint8_t operation;
+    uint8_t fragmentPreference;
+    uint8_t length;
+    uint8_t data[LE_MAX_DATA_OCTETS];
+  } leExtAdvertisingData;
+
+  if (length > sizeof(leExtAdvertisingData.data)) {
+    return -1;
+  }
+
+  leExtAdvertisingData.handle = handle;
+  leExtAdvertisingData.operation = 0x03; // complete data
+  leExtAdvertisingData.fragmentPreference = 0x01; // as few fragments as possible
+  leExtAdvertisingData.length = length;
+  memcpy(leExtAdvertisingData.data, data, length);
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_ADV_DATA, 4 + length, &leExtAdvertisingData);
+}
+
+int HCIClass::leSetExtendedScanResponseData(uint8_t handle, uint8_t length, uint8_t data[])
+{
+  struct __attribute__ ((packed)) HCILeExtScanResponseData {
+    uint8_t handle;
+    uint8_t operation;
+    uint8_t fragmentPreference;
+    uint8_t length;
+    uint8_t data[LE_MAX_DATA_OCTETS];
+  } leExtScanResponseData;
+
+  if (length > sizeof(leExtScanResponseData.data)) {
+    return -1;
+  }
+
+  leExtScanResponseData.handle = handle;
+  leExtScanResponseData.operation = 0x03;
+  leExtScanResponseData.fragmentPreference = 0x01;
+  leExtScanResponseData.length = length;
+  memcpy(leExtScanResponseData.data, data, length);
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_SCAN_RESPONSE_DATA, 4 + length, &leExtScanResponseData);
+}
+
+int HCIClass::leSetExtendedAdvertisingEnable(uint8_t enable, uint8_t numSets, uint8_t handles[])
+{
+  struct __attribute__ ((packed)) HCILeExtAdvertisingSet {
+    uint8_t handle;
+    uint16_t duration;
+    uint8_t maxEvents;
+  };
+  struct __attribute__ ((packed)) HCILeExtAdvertisingEnable {
+    uint8_t enable;
+    uint8_t numSets;
+    HCILeExtAdvertisingSet sets[(HCI_CMD_MAX_QUEUED_PARAMS - 2) / sizeof(HCILeExtAdvertisingSet)];
+  } leExtAdvertisingEnable;
+
+  if (numSets > (sizeof(leExtAdvertisingEnable.sets) / sizeof(leExtAdvertisingEnable.sets[0]))) {
+    return -1;
+  }
+
+  leExtAdvertisingEnable.enable = enable;
+  leExtAdvertisingEnable.numSets = numSets;
+  for (int i = 0; i < numSets; i++) {
+    // advertise until disabled
+    leExtAdvertisingEnable.sets[i].handle = handles[i];
+    leExtAdvertisingEnable.sets[i].duration = 0x0000;
+    leExtAdvertisingEnable.sets[i].maxEvents = 0x00;
+  }
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_ADV_ENABLE, 2 + numSets * sizeof(HCILeExtAdvertisingSet), &leExtAdvertisingEnable);
+}
+
+int HCIClass::leRemoveAdvertisingSet(uint8_t handle)
+{
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_REMOVE_ADV_SET, sizeof(handle), &handle);
+}
+
+int HCIClass::leReadNumberOfSupportedAdvertisingSets(uint8_t& numSets)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_NUM_ADV_SETS);
+
+  if (result == 0) {
+    numSets = _cmdResponse[0];
+  }
+
+  return result;
+}
+
+int HCIClass::leSetExtendedScanParameters(uint8_t ownBdaddrType, uint8_t filter, uint8_t phys,
+                                          uint8_t type, uint16_t interval, uint16_t window)
+{
+  struct __attribute__ ((packed)) HCILeExtScanPhy {
+    uint8_t type;
+    uint16_t interval;
+    uint16_t window;
+  };
+  struct __attribute__ ((packed)) HCILeSetExtScanParameters {
+    uint8_t ownBdaddrType;
+    uint8_t filter;
+    uint8_t phys;
+    HCILeExtScanPhy phy[2];
+  } leExtScanParameters;
+
+  uint8_t plen = 3;
+
+  phys &= (BLEPhy1M | BLEPhyCoded);
+
+  leExtScanParameters.ownBdaddrType = ownBdaddrType;
+  leExtScanParameters.filter = filter;
+  leExtScanParameters.phys = phys;
+  // one entry per PHY bit set, lowest bit first
+  for (int i = 0; i < 2; i++) {
+    if (phys & (i ? BLEPhyCoded : BLEPhy1M)) {
+      HCILeExtScanPhy& scanPhy = leExtScanParameters.phy[(plen - 3) / sizeof(HCILeExtScanPhy)];
+
+      scanPhy.type = type;
+      scanPhy.interval = interval;
+      scanPhy.window = window;
+      plen += sizeof(HCILeExtScanPhy);
+    }
+  }
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_SCAN_PARAMETERS, plen, &leExtScanParameters);
+}
+
+int HCIClass::leSetExtendedScanEnable(uint8_t enabled, uint8_t duplicates)
+{
+  struct __attribute__ ((packed)) HCILeSetExtScanEnable {
+    uint8_t enabled;
+    uint8_t duplicates;
+    uint16_t duration;
+    uint16_t period;
+  } leExtScanEnable = { enabled, duplicates, 0x0000, 0x0000 }; // scan until disabled
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_EXT_SCAN_ENABLE, sizeof(leExtScanEnable), &leExtScanEnable);
+}
+
 int HCIClass::leCreateConn(uint16_t interval, uint16_t window, uint8_t initiatorFilter,
                             uint8_t peerBdaddrType, uint8_t peerBdaddr[6], uint8_t ownBdaddrType,
                             uint16_t minInterval, uint16_t maxInterval, uint16_t latency,
@@ -432,11 +938,92 @@ int HCIClass::leCreateConn(uint16_t interval, uint16_t window, uint8_t initiator
   return sendCommand(OGF_LE_CTL << 10 | OCF_LE_CREATE_CONN, sizeof(leCreateConnData), &leCreateConnData);
 }
 
+int HCIClass::leExtendedCreateConn(uint16_t interval, uint16_t window, uint8_t initiatorFilter,
+                                    uint8_t peerBdaddrType, uint8_t peerBdaddr[6], uint8_t ownBdaddrType,
+                                    uint16_t minInterval, uint16_t maxInterval, uint16_t latency,
+                                    uint16_t supervisionTimeout, uint16_t minCeLength, uint16_t maxCeLength)
+{
+  struct __attribute__ ((packed)) HCILeExtCreateConnData {
+    uint8_t initiatorFilter;
+    uint8_t ownBdaddrType;
+    uint8_t peerBdaddrType;
+    uint8_t peerBdaddr[6];
+    uint8_t initiatingPhys;
+    uint16_t interval;
+    uint16_t window;
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t latency;
+    uint16_t supervisionTimeout;
+    uint16_t minCeLength;
+    uint16_t maxCeLength;
+  } leExtCreateConnData;
+
+  leExtCreateConnData.initiatorFilter = initiatorFilter;
+  leExtCreateConnData.ownBdaddrType = ownBdaddrType;
+  leExtCreateConnData.peerBdaddrType = peerBdaddrType;
+  memcpy(leExtCreateConnData.peerBdaddr, peerBdaddr, sizeof(leExtCreateConnData.peerBdaddr));
+  // initiate on the 1M PHY only, connections move to other PHYs afterwards
+  leExtCreateConnData.initiatingPhys = BLEPhy1M;
+  leExtCreateConnData.interval = interval;
+  leExtCreateConnData.window = window;
+  leExtCreateConnData.minInterval = minInterval;
+  leExtCreateConnData.maxInterval = maxInterval;
+  leExtCreateConnData.latency = latency;
+  leExtCreateConnData.supervisionTimeout = supervisionTimeout;
+  leExtCreateConnData.minCeLength = minCeLength;
+  leExtCreateConnData.maxCeLength = maxCeLength;
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_EXT_CREATE_CONN, sizeof(leExtCreateConnData), &leExtCreateConnData);
+}
+
 int HCIClass::leCancelConn()
 {
   return sendCommand(OGF_LE_CTL << 10 | OCF_LE_CANCEL_CONN, 0, NULL);
 }
 
+int HCIClass::leReadFilterAcceptListSize(uint8_t& size)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_ACCEPT_LIST_SIZE);
+
+  if (result == 0) {
+    size = _cmdResponse[0];
+  }
+
+  return result;
+}
+
+int HCIClass::leClearFilterAcceptList()
+{
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_CLEAR_ACCEPT_LIST);
+}
+
+int HCIClass::leAddDeviceToFilterAcceptList(uint8_t addressType, uint8_t address[6])
+{
+  struct __attribute__ ((packed)) HCILeAcceptListDevice {
+    uint8_t addressType;
+    uint8_t address[6];
+  } leAcceptListDevice;
+
+  leAcceptListDevice.addressType = addressType;
+  memcpy(leAcceptListDevice.address, address, sizeof(leAcceptListDevice.address));
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_ADD_TO_ACCEPT_LIST, sizeof(leAcceptListDevice), &leAcceptListDevice);
+}
+
+int HCIClass::leRemoveDeviceFromFilterAcceptList(uint8_t addressType, uint8_t address[6])
+{
+  struct __attribute__ ((packed)) HCILeAcceptListDevice {
+    uint8_t addressType;
+    uint8_t address[6];
+  } leAcceptListDevice;
+
+  leAcceptListDevice.addressType = addressType;
+  memcpy(leAcceptListDevice.address, address, sizeof(leAcceptListDevice.address));
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_REMOVE_FROM_ACCEPT_LIST, sizeof(leAcceptListDevice), &leAcceptListDevice);
+}
+
 int HCIClass::leConnUpdate(uint16_t handle, uint16_t minInterval, uint16_t maxInterval, 
                           uint16_t latency, uint16_t supervisionTimeout)
 {
@@ -464,24 +1051,140 @@ void HCIClass::saveNewAddress(uint8_t addressType, uint8_t* address, uint8_t* pe
   if(_storeIRK!=0){
     _storeIRK(address, peerIrk);
   }
-  // Again... this should work 
-  // leAddResolvingAddress(addressType, address, peerIrk, localIrk);
-}
-void HCIClass::leAddResolvingAddress(uint8_t addressType, uint8_t* peerAddress, uint8_t* peerIrk, uint8_t* localIrk){
-  leStopResolvingAddresses();
 
-  struct __attribute__ ((packed)) AddDevice {
-    uint8_t peerAddressType;
-    uint8_t peerAddress[6];
-    uint8_t peerIRK[16];
-    uint8_t localIRK[16];
-  } addDevice;
-  addDevice.peerAddressType = addressType;
-  for(int i=0; i<6; i++) addDevice.peerAddress[5-i] = peerAddress[i];
-  for(int i=0; i<16; i++) {
-    addDevice.peerIRK[15-i]  = peerIrk[i];
-    addDevice.localIRK[15-i] = localIrk[i];
+  // addresses nobody could resolve may belong to the new bond
+  rpaCacheFlush();
+
+  if (!_irkResolver.add(address, peerIrk)) {
+    _irkResolverComplete = false;
   }
+
+  if (!_addressResolution) {
+    // the bond is found by tryResolveAddress
+    return;
+  }
+
+  leStopResolvingAddresses();
+
+  // a bond renewed with the same device replaces its entry
+  if (leRemoveResolvingAddress(addressType, address) == 0 && _resolvingListCount > 0) {
+    _resolvingListCount--;
+  }
+
+  if (_resolvingListCount < _resolvingListSize &&
+      leAddResolvingAddress(addressType, address, peerIrk, localIrk) == 0) {
+    _resolvingListCount++;
+  } else {
+    // full, or not allowed while advertising, scanning or connecting
+    _resolvingListOverflow = true;
+  }
+
+  leStartResolvingAddresses();
+}
+
+void HCIClass::loadResolvingList()
+{
+  rpaCacheFlush();
+  _irkResolver.clear();
+  _irkResolverComplete = false;
+
+  _addressResolution = false;
+  _resolvingListOverflow = false;
+  _resolvingListCount = 0;
+
+  if (_getIRKs == 0) {
+    return;
+  }
+
+  bool resolvingList = leFeatureSupported(LE_FEATURE_LL_PRIVACY);
+
+  if (resolvingList) {
+    leStopResolvingAddresses();
+
+    if (leReadResolvingListSize(_resolvingListSize) != 0 || leClearResolvingList() != 0) {
+      resolvingList = false;
+    }
+  }
+
+  uint8_t nIRKs = 0;
+  uint8_t* BDAddrTypes = NULL;
+  uint8_t** BDAddrs = NULL;
+  uint8_t** IRKs = NULL;
+
+  if (!_getIRKs(&nIRKs, &BDAddrTypes, &BDAddrs, &IRKs)) {
+#ifdef _BLE_TRACE_
+    Serial.println("error getting IRKs.");
+#endif
+    return;
+  }
+
+  _irkResolverComplete = true;
+
+  for (int i = 0; i < nIRKs; i++) {
+    if (!_irkResolver.add(BDAddrs[i], IRKs[i])) {
+      _irkResolverComplete = false;
+    }
+
+    if (resolvingList) {
+      if (_resolvingListCount < _resolvingListSize &&
+          leAddResolvingAddress(BDAddrTypes[i], BDAddrs[i], IRKs[i], ATT.localIRK) == 0) {
+        _resolvingListCount++;
+      } else {
+        _resolvingListOverflow = true;
+      }
+    }
+
+    delete[] BDAddrs[i];
+    delete[] IRKs[i];
+  }
+  delete[] BDAddrTypes;
+  delete[] BDAddrs;
+  delete[] IRKs;
+
+  if (!resolvingList) {
+    return;
+  }
+
+#ifdef _BLE_TRACE_
+  Serial.print("Resolving list: ");
+  Serial.print(_resolvingListCount);
+  Serial.print("/");
+  Serial.println(_resolvingListSize);
+#endif
+
+  _addressResolution = (leStartResolvingAddresses() == 0);
+}
+
+int HCIClass::leReadResolvingListSize(uint8_t& size)
+{
+  int result = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_RESOLVING_LIST_SIZE);
+
+  if (result == 0) {
+    size = _cmdResponse[0];
+  }
+
+  return result;
+}
+
+int HCIClass::leClearResolvingList()
+{
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_CLEAR_RESOLVING_LIST);
+}
+
+int HCIClass::leAddResolvingAddress(uint8_t addressType, uint8_t* peerAddress, uint8_t* peerIrk, uint8_t* localIrk){
+  struct __attribute__ ((packed)) AddDevice {
+    uint8_t peerAddressType;
+    uint8_t peerAddress[6];
+    uint8_t peerIRK[16];
+    uint8_t localIRK[16];
+  } addDevice;
+  addDevice.peerAddressType = addressType;
+  for(int i=0; i<6; i++) addDevice.peerAddress[5-i] = peerAddress[i];
+  for(int i=0; i<16; i++) {
+    addDevice.peerIRK[15-i]  = peerIrk[i];
+    addDevice.localIRK[15-i] = localIrk[i];
+  }
+#ifdef _BLE_TRACE_
   Serial.print("ADDTYPE    :");
   btct.printBytes(&addDevice.peerAddressType,1);
   Serial.print("adddddd    :");
@@ -490,17 +1193,29 @@ void HCIClass::leAddResolvingAddress(uint8_t addressType, uint8_t* peerAddress,
   btct.printBytes(addDevice.peerIRK,16);
   Serial.print("localIRK   :");
   btct.printBytes(addDevice.localIRK,16);
-  sendCommand(OGF_LE_CTL << 10 | 0x27, sizeof(addDevice), &addDevice); 
+#endif
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_ADD_TO_RESOLVING_LIST, sizeof(addDevice), &addDevice);
+}
 
-  leStartResolvingAddresses();
+int HCIClass::leRemoveResolvingAddress(uint8_t addressType, uint8_t* peerAddress)
+{
+  struct __attribute__ ((packed)) RemoveDevice {
+    uint8_t peerAddressType;
+    uint8_t peerAddress[6];
+  } removeDevice;
+  removeDevice.peerAddressType = addressType;
+  for(int i=0; i<6; i++) removeDevice.peerAddress[5-i] = peerAddress[i];
+
+  return sendCommand(OGF_LE_CTL << 10 | OCF_LE_REMOVE_FROM_RESOLVING_LIST, sizeof(removeDevice), &removeDevice);
 }
+
 int HCIClass::leStopResolvingAddresses(){
     uint8_t enable = 0;
-    return HCI.sendCommand(OGF_LE_CTL << 10 | 0x2D, 1,&enable); // Disable address resolution
+    return HCI.sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_ADDRESS_RESOLUTION, 1,&enable); // Disable address resolution
 }
 int HCIClass::leStartResolvingAddresses(){
   uint8_t enable = 1;
-  return HCI.sendCommand(OGF_LE_CTL << 10 | 0x2D, 1,&enable); // Disable address resolution
+  return HCI.sendCommand(OGF_LE_CTL << 10 | OCF_LE_SET_ADDRESS_RESOLUTION, 1,&enable); // Enable address resolution
 }
 int HCIClass::leReadPeerResolvableAddress(uint8_t peerAddressType, uint8_t* peerIdentityAddress, uint8_t* peerResolvableAddress){
   struct __attribute__ ((packed)) Request {
@@ -511,7 +1226,7 @@ int HCIClass::leReadPeerResolvableAddress(uint8_t peerAddressType, uint8_t* peer
   for(int i=0; i<6; i++) request.identityAddress[5-i] = peerIdentityAddress[i];
   
 
-  int res = sendCommand(OGF_LE_CTL << 10 | 0x2B, sizeof(request), &request);
+  int res = sendCommand(OGF_LE_CTL << 10 | OCF_LE_READ_PEER_RESOLVABLE_ADDR, sizeof(request), &request);
   Serial.print("res: 0x");
   Serial.println(res, HEX);
   if(res==0){
@@ -527,6 +1242,54 @@ int HCIClass::leReadPeerResolvableAddress(uint8_t peerAddressType, uint8_t* peer
   return res;
 }
 
+void HCIClass::setLocalP256KeyRotation(uint8_t maxPairings, unsigned long maxAge)
+{
+  _p256KeyMaxUses = maxPairings;
+  _p256KeyMaxAge = maxAge;
+}
+
+void HCIClass::generateLocalP256Key()
+{
+  if (_p256KeyState == P256_KEY_PENDING || _dhKeyPending) {
+    // a new key pair would change the private key the DH key is computed with
+    return;
+  }
+
+  _p256KeyState = P256_KEY_PENDING;
+
+  if (!sendCommandAsync(OGF_LE_CTL << 10 | LE_COMMAND::READ_LOCAL_P256, 0, NULL, p256CommandComplete, this)) {
+    _p256KeyState = P256_KEY_NONE;
+  }
+}
+
+void HCIClass::pairingPublicKeyReceived(uint16_t handle)
+{
+  if (_p256KeyState == P256_KEY_READY && (!localP256KeyExpired() || _dhKeyPending)) {
+    _p256KeyUses++;
+    _dhKeyPending = true;
+    memcpy(localPublicKeyBuffer, _p256PublicKey, 64);
+    deferJob(&HCIClass::sendPairingConfirmJob, handle);
+    return;
+  }
+
+  // no key was generated in advance, the pairing continues once it is ready
+  _p256WaitingHandle = handle;
+
+  if (_p256KeyState != P256_KEY_PENDING) {
+    _p256KeyState = P256_KEY_NONE;
+    generateLocalP256Key();
+  }
+}
+
+bool HCIClass::localP256KeyExpired()
+{
+  if (_p256KeyMaxUses != 0 && _p256KeyUses >= _p256KeyMaxUses) {
+    return true;
+  }
+
+  return (_p256KeyMaxAge != 0 && (millis() - _p256KeyTime) >= _p256KeyMaxAge);
+}
+
 void HCIClass::writeLK(uint8_t peerAddress[], uint8_t LK[]){
   struct __attribute__ ((packed)) StoreLK {
     uint8_t nKeys;
@@ -553,16 +1316,56 @@ int HCIClass::readStoredLK(uint8_t BD_ADDR[], uint8_t read_all ){
 }
 
 int HCIClass::tryResolveAddress(uint8_t* BDAddr, uint8_t* address){
+  if (_resolvedPeerValid && memcmp(BDAddr, _resolvedPeerAddress, 6) == 0) {
+    _resolvedPeerValid = false;
+    memcpy(address, _resolvedPeerIdentity, 6);
+    return 1;
+  }
+  _resolvedPeerValid = false;
+
+  if (_addressResolution && !_resolvingListOverflow) {
+    // the controller already tried every bonded IRK
+    return 0;
+  }
+
+  if ((BDAddr[0] & 0xc0) != 0x40) {
+    // only resolvable private addresses carry a hash
+    return 0;
+  }
+
+  int cached = rpaCacheLookup(BDAddr, address);
+
+  if (cached != -1) {
+    return cached;
+  }
+
+  int index = _irkResolver.resolve(BDAddr);
+
+  if (index != -1) {
+    memcpy(address, _irkResolver.identity(index), 6);
+    rpaCacheStore(BDAddr, address);
+    return 1;
+  }
+
+  if (_irkResolverComplete) {
+    rpaCacheStore(BDAddr, NULL);
+    return 0;
+  }
+
+  // some bonds are only known to the getIRKs callback
+
   bool foundMatch = false;
   if(HCI._getIRKs!=0){
     uint8_t nIRKs = 0;
     uint8_t** BDAddrType = new uint8_t*;
     uint8_t*** BADDRs = new uint8_t**;
     uint8_t*** IRKs = new uint8_t**;
+    bool gotIRKs = true;
 
 
     if(!HCI._getIRKs(&nIRKs, BDAddrType, BADDRs, IRKs)){
       Serial.println("error getting IRKs.");
+      gotIRKs = false;
     }
     for(int i=0; i<nIRKs; i++){
       if(!foundMatch){
@@ -604,6 +1407,10 @@ int HCIClass::tryResolveAddress(uint8_t* BDAddr, uint8_t* address){
     delete BADDRs;
     delete[] (*IRKs);
     delete IRKs;
+
+    if (gotIRKs) {
+      rpaCacheStore(BDAddr, foundMatch ? address : NULL);
+    }
     
     if(foundMatch){
       return 1;
@@ -612,766 +1419,1777 @@ int HCIClass::tryResolveAddress(uint8_t* BDAddr, uint8_t* address){
   return 0;
 }
 
-int HCIClass::sendAclPkt(uint16_t handle, uint8_t cid, uint8_t plen, void* data)
+int HCIClass::rpaCacheLookup(uint8_t* BDAddr, uint8_t* address)
 {
-  while (_pendingPkt >= _maxPkt) {
-    poll();
-  }
+  unsigned long now = millis();
 
-  struct __attribute__ ((packed)) HCIACLHdr {
-    uint8_t pktType;
-    uint16_t handle;
-    uint16_t dlen;
-    uint16_t plen;
-    uint16_t cid;
-  } aclHdr = { HCI_ACLDATA_PKT, handle, uint8_t(plen + 4), plen, cid };
+  for (int i = 0; i < HCI_RPA_CACHE_SIZE; i++) {
+    RpaCacheEntry& entry = _rpaCache[i];
 
-  uint8_t txBuffer[sizeof(aclHdr) + plen];
-  memcpy(txBuffer, &aclHdr, sizeof(aclHdr));
-  memcpy(&txBuffer[sizeof(aclHdr)], data, plen);
+    if (entry.state == RPA_CACHE_FREE || memcmp(entry.address, BDAddr, 6) != 0) {
+      continue;
+    }
 
-  if (_debug) {
-    dumpPkt("HCI ACLDATA TX -> ", sizeof(aclHdr) + plen, txBuffer);
-  }
-#ifdef _BLE_TRACE_
-  Serial.print("Data tx -> ");
-  for(int i=0; i< sizeof(aclHdr) + plen;i++){
-    Serial.print(" 0x");
-    Serial.print(txBuffer[i],HEX);
-  }
-  Serial.println(".");
-#endif
+    if ((now - entry.seen) >= HCI_RPA_CACHE_TIMEOUT) {
+      // the peer has moved on to a new address by now
+      entry.state = RPA_CACHE_FREE;
+      return -1;
+    }
 
-  _pendingPkt++;
-  HCITransport.write(txBuffer, sizeof(aclHdr) + plen);
+    if (entry.state == RPA_CACHE_UNRESOLVED) {
+      return 0;
+    }
 
-  return 0;
+    memcpy(address, entry.identity, 6);
+    return 1;
+  }
+
+  return -1;
 }
 
-int HCIClass::disconnect(uint16_t handle)
+void HCIClass::rpaCacheStore(uint8_t* BDAddr, uint8_t* identity)
 {
-    struct __attribute__ ((packed)) HCIDisconnectData {
-    uint16_t handle;
-    uint8_t reason;
-  } disconnectData = { handle, HCI_OE_USER_ENDED_CONNECTION };
+  unsigned long now = millis();
+  int slot = 0;
+
+  // a free slot, otherwise the one seen first
+  for (int i = 0; i < HCI_RPA_CACHE_SIZE; i++) {
+    if (_rpaCache[i].state == RPA_CACHE_FREE) {
+      slot = i;
+      break;
+    }
 
-  return sendCommand(OGF_LINK_CTL << 10 | OCF_DISCONNECT, sizeof(disconnectData), &disconnectData);
-}
+    if ((now - _rpaCache[i].seen) > (now - _rpaCache[slot].seen)) {
+      slot = i;
+    }
+  }
 
-void HCIClass::debug(Stream& stream)
-{
-  _debug = &stream;
+  RpaCacheEntry& entry = _rpaCache[slot];
+
+  memcpy(entry.address, BDAddr, 6);
+  if (identity != NULL) {
+    memcpy(entry.identity, identity, 6);
+    entry.state = RPA_CACHE_RESOLVED;
+  } else {
+    entry.state = RPA_CACHE_UNRESOLVED;
+  }
+  entry.seen = now;
 }
 
-void HCIClass::noDebug()
+void HCIClass::rpaCacheFlush()
 {
-  _debug = NULL;
+  for (int i = 0; i < HCI_RPA_CACHE_SIZE; i++) {
+    _rpaCache[i].state = RPA_CACHE_FREE;
+  }
 }
 
-int HCIClass::sendCommand(uint16_t opcode, uint8_t plen, void* parameters)
+int HCIClass::sendAclPkt(uint16_t handle, uint8_t cid, uint16_t plen, void* data)
 {
-  struct __attribute__ ((packed)) {
-    uint8_t pktType;
-    uint16_t opcode;
-    uint8_t plen;
-  } pktHdr = {HCI_COMMAND_PKT, opcode, plen};
+  int connection = aclConnection(handle, false);
 
-  uint8_t txBuffer[sizeof(pktHdr) + plen];
-  memcpy(txBuffer, &pktHdr, sizeof(pktHdr));
-  memcpy(&txBuffer[sizeof(pktHdr)], parameters, plen);
+  if (connection == -1 || HCI_ACL_HDR_LEN + L2CAP_HDR_LEN + plen > HCI_ACL_TX_POOL_SIZE) {
+    return -1;
+  }
 
-  if (_debug) {
-    dumpPkt("HCI COMMAND TX -> ", sizeof(pktHdr) + plen, txBuffer);
+#ifdef HCI_STATS
+  unsigned long start = micros();
+
+  _aclWaitStats.count++;
+  if (!aclTxSpace(connection, plen)) {
+    _aclWaitStats.waits++;
   }
-#ifdef _BLE_TRACE_
-  Serial.print("Command tx -> ");
-  for(int i=0; i< sizeof(pktHdr) + plen;i++){
-    Serial.print(" 0x");
-    Serial.print(txBuffer[i],HEX);
-    
+#endif
+
+  while (!aclTxSpace(connection, plen)) {
+    poll();
+
+    // the connection may have been closed while waiting
+    if (_aclConnections[connection].handle != handle) {
+      return -1;
+    }
   }
-  Serial.println("");
+
+#ifdef HCI_STATS
+  unsigned long wait = micros() - start;
+
+  _aclWaitStats.maxWait = max(_aclWaitStats.maxWait, (uint32_t)wait);
+  statsIncrement(_aclWaitStats.histogram[statsBucket(wait)]);
 #endif
-  HCITransport.write(txBuffer, sizeof(pktHdr) + plen);
 
-  _cmdCompleteOpcode = 0xffff;
-  _cmdCompleteStatus = -1;
+  return (enqueueAclPkt(connection, cid, plen, data) == 1) ? 0 : -1;
+}
 
-  for (unsigned long start = millis(); _cmdCompleteOpcode != opcode && millis() < (start + 1000);) {
-    poll();
+int HCIClass::queueAclPkt(uint16_t handle, uint8_t cid, uint16_t plen, void* data)
+{
+  int connection = aclConnection(handle, false);
+
+  if (connection == -1 || HCI_ACL_HDR_LEN + L2CAP_HDR_LEN + plen > HCI_ACL_TX_POOL_SIZE) {
+    return -1;
+  }
+
+  if (!aclTxSpace(connection, plen)) {
+    _aclConnections[connection].tx.rejected++;
+
+    return 0;
   }
 
-  return _cmdCompleteStatus;
+  return enqueueAclPkt(connection, cid, plen, data);
 }
 
-void HCIClass::handleAclDataPkt(uint8_t /*plen*/, uint8_t pdata[])
+int HCIClass::aclTxCounters(uint16_t handle, HCIAclTxCounters& counters)
 {
-  struct __attribute__ ((packed)) HCIACLHdr {
-    uint16_t handle;
-    uint16_t dlen;
-    uint16_t len;
-    uint16_t cid;
-  } *aclHdr = (HCIACLHdr*)pdata;
+  int connection = aclConnection(handle, false);
 
+  if (connection == -1) {
+    return 0;
+  }
 
-  uint16_t aclFlags = (aclHdr->handle & 0xf000) >> 12;
+  counters = _aclConnections[connection].tx;
 
-  if ((aclHdr->dlen - 4) != aclHdr->len) {
-    // packet is fragmented
-    if (aclFlags != 0x01) {
-      // copy into ACL buffer
-      memcpy(_aclPktBuffer, &_recvBuffer[1], sizeof(HCIACLHdr) + aclHdr->dlen - 4);
-    } else {
-      // copy next chunk into the buffer
-      HCIACLHdr* aclBufferHeader = (HCIACLHdr*)_aclPktBuffer;
+  return 1;
+}
 
-      memcpy(&_aclPktBuffer[sizeof(HCIACLHdr) + aclBufferHeader->dlen - 4], &_recvBuffer[1 + sizeof(aclHdr->handle) + sizeof(aclHdr->dlen)], aclHdr->dlen);
+int HCIClass::aclConnection(uint16_t handle, bool create)
+{
+  int freeSlot = -1;
 
-      aclBufferHeader->dlen += aclHdr->dlen;
-      aclHdr = aclBufferHeader;
+  for (int i = 0; i < HCI_MAX_CONNECTIONS; i++) {
+    if (_aclConnections[i].handle == handle) {
+      return i;
+    } else if (_aclConnections[i].handle == 0xffff && freeSlot == -1) {
+      freeSlot = i;
     }
   }
 
-  if ((aclHdr->dlen - 4) != aclHdr->len) {
-#ifdef _BLE_TRACE_
-    Serial.println("Don't have full packet yet");
-    Serial.print("Handle: ");
-    btct.printBytes((uint8_t*)&aclHdr->handle,2);
-    Serial.print("dlen: ");
-    btct.printBytes((uint8_t*)&aclHdr->dlen,2);
-    Serial.print("len: ");
-    btct.printBytes((uint8_t*)&aclHdr->len,2);
-    Serial.print("cid: ");
-    btct.printBytes((uint8_t*)&aclHdr->cid,2);
-#endif
-    // don't have the full packet yet
-    return;
+  if (!create || freeSlot == -1) {
+    return -1;
   }
 
-  if (aclHdr->cid == ATT_CID) {
-    if (aclFlags == 0x01) {
-      // use buffered packet
-      ATT.handleData(aclHdr->handle & 0x0fff, aclHdr->len, &_aclPktBuffer[sizeof(HCIACLHdr)]);
-    } else {
-      // use the recv buffer
-      ATT.handleData(aclHdr->handle & 0x0fff, aclHdr->len, &_recvBuffer[1 + sizeof(HCIACLHdr)]);
-    }
-  } else if (aclHdr->cid == SIGNALING_CID) {
-#ifdef _BLE_TRACE_
-    Serial.println("Signalling");
-#endif
-    L2CAPSignaling.handleData(aclHdr->handle & 0x0fff, aclHdr->len, &_recvBuffer[1 + sizeof(HCIACLHdr)]);
-  } else if (aclHdr->cid == SECURITY_CID){
-    // Security manager
-#ifdef _BLE_TRACE_
-    Serial.println("Security data");
-#endif
-    if (aclFlags == 0x1){
-      L2CAPSignaling.handleSecurityData(aclHdr->handle & 0x0fff, aclHdr->len, &_aclPktBuffer[sizeof(HCIACLHdr)]);
-    }else{
-      L2CAPSignaling.handleSecurityData(aclHdr->handle & 0x0fff, aclHdr->len, &_recvBuffer[1 + sizeof(HCIACLHdr)]);
-    }
+  AclConnection& connection = _aclConnections[freeSlot];
 
-  }else {
-    struct __attribute__ ((packed)) {
-      uint8_t op;
-      uint8_t id;
-      uint16_t length;
-      uint16_t reason;
-      uint16_t localCid;
-      uint16_t remoteCid;
-    } l2capRejectCid= { 0x01, 0x00, 0x006, 0x0002, aclHdr->cid, 0x0000 };
-#ifdef _BLE_TRACE_
-    Serial.print("rejecting packet cid: 0x");
-    Serial.println(aclHdr->cid,HEX);
-#endif
+  memset(&connection, 0x00, sizeof(connection));
+  connection.handle = handle;
+  connection.txHead = ACL_TX_NONE;
+  connection.txTail = ACL_TX_NONE;
+  connection.maxTxOctets = LE_MIN_DATA_OCTETS;
+  connection.maxRxOctets = LE_MIN_DATA_OCTETS;
+  connection.txPhy = BLEPhy1M;
+  connection.rxPhy = BLEPhy1M;
 
-    sendAclPkt(aclHdr->handle & 0x0fff, 0x0005, sizeof(l2capRejectCid), &l2capRejectCid);
-  }
+  return freeSlot;
 }
 
-void HCIClass::handleNumCompPkts(uint16_t /*handle*/, uint16_t numPkts)
+int HCIClass::aclTxSpace(int connection, uint16_t plen)
 {
-  if (numPkts && _pendingPkt > numPkts) {
-    _pendingPkt -= numPkts;
-  } else {
-    _pendingPkt = 0;
-  }
+  return (_aclTxFree != ACL_TX_NONE && _aclConnections[connection].tx.queued < HCI_ACL_TX_MAX_PER_CONN &&
+          aclTxAlloc(HCI_ACL_HDR_LEN + L2CAP_HDR_LEN + plen) != -1);
 }
 
-void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
+int HCIClass::aclTxAlloc(uint16_t size)
 {
-  struct __attribute__ ((packed)) HCIEventHdr {
-    uint8_t evt;
-    uint8_t plen;
-  } *eventHdr = (HCIEventHdr*)pdata;
-#ifdef _BLE_TRACE_
-  Serial.print("HCI event: ");
-  Serial.println(eventHdr->evt, HEX);
-#endif
+  // first fit, the slice may start at the beginning of the pool or right after another slice
+  for (int i = -1; i < HCI_ACL_TX_QUEUE_SIZE; i++) {
+    uint16_t start = 0;
 
-  if (eventHdr->evt == EVT_DISCONN_COMPLETE)
-  {
-    struct __attribute__ ((packed)) DisconnComplete {
-      uint8_t status;
-      uint16_t handle;
-      uint8_t reason;
-    } *disconnComplete = (DisconnComplete*)&pdata[sizeof(HCIEventHdr)];
+    if (i != -1) {
+      AclTxPacket& other = _aclTxPackets[i];
 
-    ATT.removeConnection(disconnComplete->handle, disconnComplete->reason);
-    L2CAPSignaling.removeConnection(disconnComplete->handle, disconnComplete->reason);
+      if (other.length == 0) {
+        continue;
+      }
 
-    HCI.leSetAdvertiseEnable(0x01);
+      start = other.start + HCI_ACL_HDR_LEN + other.length;
+    }
+
+    if (size > HCI_ACL_TX_POOL_SIZE - start) {
+      continue;
+    }
+
+    bool overlaps = false;
+
+    for (int j = 0; j < HCI_ACL_TX_QUEUE_SIZE && !overlaps; j++) {
+      AclTxPacket& other = _aclTxPackets[j];
+
+      if (other.length == 0) {
+        continue;
+      }
+
+      overlaps = (start < other.start + HCI_ACL_HDR_LEN + other.length) && (other.start < start + size);
+    }
+
+    if (!overlaps) {
+      return start;
+    }
   }
-  else if (eventHdr->evt == EVT_ENCRYPTION_CHANGE)
-  {
-    struct __attribute__ ((packed)) EncryptionChange {
-      uint8_t status;
-      uint16_t connectionHandle;
-      uint8_t enabled;
-    } *encryptionChange = (EncryptionChange*)&pdata[sizeof(HCIEventHdr)];
+
+  return -1;
+}
+
+int HCIClass::enqueueAclPkt(int connection, uint8_t cid, uint16_t plen, void* data)
+{
+  AclConnection& aclConnection = _aclConnections[connection];
+
+  struct __attribute__ ((packed)) L2CAPHdr {
+    uint16_t len;
+    uint16_t cid;
+  } l2capHdr = { plen, cid };
+
+  // the HCI ACL header of each fragment is filled in when it is sent
+  uint16_t length = sizeof(l2capHdr) + plen;
+  int start = aclTxAlloc(HCI_ACL_HDR_LEN + length);
+
+  if (_aclTxFree == ACL_TX_NONE || start == -1) {
+    return -1;
+  }
+
+  uint8_t* buffer = &_aclTxPool[start];
+
+  memcpy(&buffer[HCI_ACL_HDR_LEN], &l2capHdr, sizeof(l2capHdr));
+  memcpy(&buffer[HCI_ACL_HDR_LEN + sizeof(l2capHdr)], data, plen);
+
+  uint8_t index = _aclTxFree;
+  AclTxPacket& packet = _aclTxPackets[index];
+
+  _aclTxFree = packet.next;
+
+  packet.next = ACL_TX_NONE;
+  packet.length = length;
+  packet.offset = 0;
+  packet.start = start;
+
+  if (aclConnection.txTail == ACL_TX_NONE) {
+    aclConnection.txHead = index;
+  } else {
+    _aclTxPackets[aclConnection.txTail].next = index;
+  }
+  aclConnection.txTail = index;
+
+  aclConnection.tx.queued++;
+  if (aclConnection.tx.queued > aclConnection.tx.maxQueued) {
+    aclConnection.tx.maxQueued = aclConnection.tx.queued;
+  }
+
+  sendQueuedAclPkts();
+
+  return 1;
+}
+
+void HCIClass::sendQueuedAclPkts()
+{
+  while (_pendingPkt < _maxPkt) {
+    // round robin over the connections that have something queued
+    int connection = -1;
+
+    for (int i = 0; i < HCI_MAX_CONNECTIONS; i++) {
+      int candidate = (_aclTxNext + i) % HCI_MAX_CONNECTIONS;
+
+      if (_aclConnections[candidate].handle != 0xffff && _aclConnections[candidate].txHead != ACL_TX_NONE) {
+        connection = candidate;
+        break;
+      }
+    }
+
+    if (connection == -1) {
+      break;
+    }
+
+    _aclTxNext = (connection + 1) % HCI_MAX_CONNECTIONS;
+
+    AclConnection& aclConnection = _aclConnections[connection];
+    uint8_t index = aclConnection.txHead;
+    AclTxPacket& packet = _aclTxPackets[index];
+
+    uint16_t fragmentLength = min((uint16_t)(packet.length - packet.offset), _aclPktLen);
+    uint16_t handle = aclConnection.handle | ((packet.offset == 0) ? ACL_PB_FIRST : ACL_PB_CONTINUING);
+
+    // the header of a continuation fragment goes over the tail of the previous
+    // fragment, which has already been written out
+    uint8_t* fragment = &_aclTxPool[packet.start + packet.offset];
+
+    fragment[0] = HCI_ACLDATA_PKT;
+    memcpy(&fragment[1], &handle, sizeof(handle));
+    memcpy(&fragment[3], &fragmentLength, sizeof(fragmentLength));
+
+    if (_debug) {
+      dumpPkt("HCI ACLDATA TX -> ", HCI_ACL_HDR_LEN + fragmentLength, fragment);
+    }
+    HCICapture.capture(false, fragment, HCI_ACL_HDR_LEN + fragmentLength);
 #ifdef _BLE_TRACE_
-    Serial.println("[Info] Encryption changed");
-    Serial.print("status : ");
-    btct.printBytes(&encryptionChange->status,1);
-    Serial.print("handle : ");
-    btct.printBytes((uint8_t*)&encryptionChange->connectionHandle,2);
-    Serial.print("enabled: ");
-    btct.printBytes(&encryptionChange->enabled,1);
-#endif
-    if(encryptionChange->enabled>0){
-      // 0001 1110
-      if((ATT.getPeerEncryption(encryptionChange->connectionHandle)&PEER_ENCRYPTION::PAIRING_REQUEST)>0){
-        if(ATT.localKeyDistribution.EncKey()){
+    Serial.print("Data tx -> ");
+    for(int i=0; i< HCI_ACL_HDR_LEN + fragmentLength;i++){
+      Serial.print(" 0x");
+      Serial.print(fragment[i],HEX);
+    }
+    Serial.println(".");
+#endif
+
+    _pendingPkt++;
+    aclConnection.tx.inFlight++;
+    aclConnection.tx.sent++;
+
+    HCITransport.write(fragment, HCI_ACL_HDR_LEN + fragmentLength);
+
+    packet.offset += fragmentLength;
+
+    if (packet.offset < packet.length) {
+      continue;
+    }
+
+    aclConnection.txHead = packet.next;
+    if (aclConnection.txHead == ACL_TX_NONE) {
+      aclConnection.txTail = ACL_TX_NONE;
+    }
+    aclConnection.tx.queued--;
+
+    packet.length = 0;
+    packet.next = _aclTxFree;
+    _aclTxFree = index;
+  }
+}
+
+int HCIClass::aclRxContext(uint16_t handle)
+{
+  for (int i = 0; i < HCI_ACL_RX_CONTEXTS; i++) {
+    if (_aclRxContexts[i].handle == handle) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+int HCIClass::aclRxAlloc(int context, uint16_t length)
+{
+  // first fit, the slice may start at the beginning of the pool or right after another slice
+  for (int i = -1; i < HCI_ACL_RX_CONTEXTS; i++) {
+    uint16_t start = 0;
+
+    if (i != -1) {
+      AclRxContext& other = _aclRxContexts[i];
+
+      if (i == context || other.handle == 0xffff || other.received < L2CAP_HDR_LEN) {
+        continue;
+      }
+
+      start = other.offset + (other.header[0] | (other.header[1] << 8));
+    }
+
+    if (length > HCI_ACL_RX_POOL_SIZE - start) {
+      continue;
+    }
+
+    bool overlaps = false;
+
+    for (int j = 0; j < HCI_ACL_RX_CONTEXTS && !overlaps; j++) {
+      AclRxContext& other = _aclRxContexts[j];
+
+      if (j == context || other.handle == 0xffff || other.received < L2CAP_HDR_LEN) {
+        continue;
+      }
+
+      uint16_t otherLength = other.header[0] | (other.header[1] << 8);
+
+      overlaps = (start < other.offset + otherLength) && (other.offset < start + length);
+    }
+
+    if (!overlaps) {
+      _aclRxContexts[context].offset = start;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void HCIClass::aclRxRelease(uint16_t handle)
+{
+  int context = aclRxContext(handle);
+
+  if (context != -1) {
+    _aclRxContexts[context].handle = 0xffff;
+  }
+}
+
+int HCIClass::disconnect(uint16_t handle)
+{
+    struct __attribute__ ((packed)) HCIDisconnectData {
+    uint16_t handle;
+    uint8_t reason;
+  } disconnectData = { handle, HCI_OE_USER_ENDED_CONNECTION };
+
+  return sendCommand(OGF_LINK_CTL << 10 | OCF_DISCONNECT, sizeof(disconnectData), &disconnectData);
+}
+
+void HCIClass::debug(Stream& stream)
+{
+  _debug = &stream;
+}
+
+void HCIClass::noDebug()
+{
+  _debug = NULL;
+}
+
+int HCIClass::sendCommand(uint16_t opcode, uint8_t plen, void* parameters)
+{
+  if (_cmdBatch && sendCommandAsync(opcode, plen, parameters, batchCommandComplete, this)) {
+    _cmdBatchPending++;
+
+    return 0;
+  }
+
+  CommandWaiter waiter;
+  waiter.done = false;
+  waiter.status = -1;
+  waiter.responseLength = 0;
+
+#ifdef HCI_STATS
+  unsigned long submitted = micros();
+#endif
+
+  // commands queued earlier go out first so the controller sees them in order
+  for (unsigned long start = millis(); _cmdQueueCount || !commandSlotAvailable();) {
+    if ((millis() - start) >= HCI_CMD_TIMEOUT) {
+      if (_cmdQueueCount) {
+#ifdef HCI_STATS
+        recordCommand(opcode, -1, submitted);
+#endif
+        return -1;
+      }
+      // credits were lost, send anyway
+      break;
+    }
+    poll();
+  }
+
+#ifdef HCI_STATS
+  _cmdSubmitted = submitted;
+#endif
+  writeCommand(opcode, plen, parameters, commandWaiterComplete, &waiter);
+
+  for (unsigned long start = millis(); !waiter.done && (millis() - start) < HCI_CMD_TIMEOUT;) {
+    poll();
+  }
+
+  if (!waiter.done) {
+    // don't leave a callback pointing at this stack frame
+    for (int i = 0; i < HCI_CMD_MAX_IN_FLIGHT; i++) {
+      if (_cmdInFlight[i].context == &waiter) {
+        _cmdInFlight[i].opcode = 0x0000;
+      }
+    }
+  }
+
+  _cmdResponseLen = waiter.responseLength;
+  memcpy(_cmdResponse, waiter.response, waiter.responseLength);
+
+  if (_cmdBatch && waiter.status != 0 && _cmdBatchStatus == 0) {
+    _cmdBatchStatus = waiter.status;
+  }
+
+  return waiter.status;
+}
+
+int HCIClass::sendCommandAsync(uint16_t opcode, uint8_t plen, void* parameters,
+                               HCICommandCallback callback, void* context)
+{
+  if (plen > HCI_CMD_MAX_QUEUED_PARAMS || _cmdQueueCount >= HCI_CMD_QUEUE_SIZE) {
+    return 0;
+  }
+
+  QueuedCommand& command = _cmdQueue[(_cmdQueueHead + _cmdQueueCount) % HCI_CMD_QUEUE_SIZE];
+
+  command.opcode = opcode;
+  command.plen = plen;
+  memcpy(command.parameters, parameters, plen);
+  command.callback = callback;
+  command.context = context;
+#ifdef HCI_STATS
+  command.queued = micros();
+#endif
+
+  _cmdQueueCount++;
+
+  sendQueuedCommands();
+
+  return 1;
+}
+
+void HCIClass::beginCommandBatch()
+{
+  _cmdBatch = true;
+  _cmdBatchStatus = 0;
+  _cmdBatchPending = 0;
+}
+
+int HCIClass::endCommandBatch()
+{
+  _cmdBatch = false;
+
+  // in flight commands time out, so this always terminates
+  while (_cmdBatchPending) {
+    poll();
+  }
+
+  return _cmdBatchStatus;
+}
+
+int HCIClass::pendingCommands()
+{
+  int pending = _cmdQueueCount;
+
+  for (int i = 0; i < HCI_CMD_MAX_IN_FLIGHT; i++) {
+    if (_cmdInFlight[i].opcode != 0x0000) {
+      pending++;
+    }
+  }
+
+  return pending;
+}
+
+#ifdef HCI_STATS
+int HCIClass::commandStats(int index, HCICommandStats& stats)
+{
+  if (index < 0 || index >= HCI_STATS_OPCODES || _cmdStats[index].opcode == 0x0000) {
+    return 0;
+  }
+
+  stats = _cmdStats[index];
+
+  return 1;
+}
+
+void HCIClass::aclWaitStats(HCIAclWaitStats& stats)
+{
+  stats = _aclWaitStats;
+}
+
+void HCIClass::resetStats()
+{
+  memset(_cmdStats, 0x00, sizeof(_cmdStats));
+  memset(&_aclWaitStats, 0x00, sizeof(_aclWaitStats));
+}
+
+void HCIClass::recordCommand(uint16_t opcode, int status, unsigned long submitted)
+{
+  unsigned long latency = micros() - submitted;
+  HCICommandStats* stats = NULL;
+
+  // the last entry collects the opcodes that don't have one of their own
+  for (int i = 0; i < HCI_STATS_OPCODES && stats == NULL; i++) {
+    if (_cmdStats[i].opcode == opcode || _cmdStats[i].opcode == 0x0000) {
+      stats = &_cmdStats[i];
+    }
+  }
+
+  if (stats == NULL || (stats->opcode == 0x0000 && stats == &_cmdStats[HCI_STATS_OPCODES - 1])) {
+    stats = &_cmdStats[HCI_STATS_OPCODES - 1];
+    opcode = 0xffff;
+  }
+
+  stats->opcode = opcode;
+  stats->count++;
+  if (status == -1) {
+    stats->timeouts++;
+  } else if (status != 0) {
+    stats->errors++;
+  }
+  stats->maxLatency = max(stats->maxLatency, (uint32_t)latency);
+  statsIncrement(stats->histogram[statsBucket(latency)]);
+}
+#endif
+
+int HCIClass::writeCommand(uint16_t opcode, uint8_t plen, void* parameters,
+                           HCICommandCallback callback, void* context)
+{
+  struct __attribute__ ((packed)) {
+    uint8_t pktType;
+    uint16_t opcode;
+    uint8_t plen;
+  } pktHdr = {HCI_COMMAND_PKT, opcode, plen};
+
+  uint8_t txBuffer[sizeof(pktHdr) + plen];
+  memcpy(txBuffer, &pktHdr, sizeof(pktHdr));
+  memcpy(&txBuffer[sizeof(pktHdr)], parameters, plen);
+
+  if (_debug) {
+    dumpPkt("HCI COMMAND TX -> ", sizeof(pktHdr) + plen, txBuffer);
+  }
+  HCICapture.capture(false, txBuffer, sizeof(pktHdr) + plen);
 #ifdef _BLE_TRACE_
-          Serial.println("Enc key set but should be ignored");
+  Serial.print("Command tx -> ");
+  for(int i=0; i< sizeof(pktHdr) + plen;i++){
+    Serial.print(" 0x");
+    Serial.print(txBuffer[i],HEX);
+    
+  }
+  Serial.println("");
+#endif
+
+  for (int i = 0; i < HCI_CMD_MAX_IN_FLIGHT; i++) {
+    if (_cmdInFlight[i].opcode == 0x0000) {
+      _cmdInFlight[i].opcode = opcode;
+      _cmdInFlight[i].start = millis();
+      _cmdInFlight[i].callback = callback;
+      _cmdInFlight[i].context = context;
+#ifdef HCI_STATS
+      _cmdInFlight[i].submitted = _cmdSubmitted;
+#endif
+      break;
+    }
+  }
+
+  if (_cmdCredits) {
+    _cmdCredits--;
+  }
+  _cmdLastActivity = millis();
+
+  return HCITransport.write(txBuffer, sizeof(pktHdr) + plen);
+}
+
+void HCIClass::sendQueuedCommands()
+{
+  while (_cmdQueueCount && commandSlotAvailable()) {
+    QueuedCommand& command = _cmdQueue[_cmdQueueHead];
+
+    _cmdQueueHead = (_cmdQueueHead + 1) % HCI_CMD_QUEUE_SIZE;
+    _cmdQueueCount--;
+
+#ifdef HCI_STATS
+    _cmdSubmitted = command.queued;
+#endif
+    writeCommand(command.opcode, command.plen, command.parameters, command.callback, command.context);
+  }
+}
+
+int HCIClass::commandSlotAvailable()
+{
+  if (_cmdCredits == 0) {
+    return 0;
+  }
+
+  for (int i = 0; i < HCI_CMD_MAX_IN_FLIGHT; i++) {
+    if (_cmdInFlight[i].opcode == 0x0000) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void HCIClass::handleCommandComplete(uint8_t ncmd, uint16_t opcode, int status,
+                                     uint8_t responseLength, uint8_t response[])
+{
+  _cmdCredits = ncmd;
+  _cmdLastActivity = millis();
+
+  // completions come back in order, so pick the oldest command with this opcode
+  int match = -1;
+
+  for (int i = 0; i < HCI_CMD_MAX_IN_FLIGHT; i++) {
+    if (opcode != 0x0000 && _cmdInFlight[i].opcode == opcode &&
+        (match == -1 || (long)(_cmdInFlight[i].start - _cmdInFlight[match].start) < 0)) {
+      match = i;
+    }
+  }
+
+  if (match != -1) {
+    PendingCommand command = _cmdInFlight[match];
+
+    _cmdInFlight[match].opcode = 0x0000;
+#ifdef HCI_STATS
+    recordCommand(opcode, status, command.submitted);
+#endif
+
+    if (command.callback) {
+      command.callback(opcode, status, responseLength, response, command.context);
+    }
+  }
+
+  sendQueuedCommands();
+}
+
+void HCIClass::expireCommands()
+{
+  unsigned long now = millis();
+  bool inFlight = false;
+
+  for (int i = 0; i < HCI_CMD_MAX_IN_FLIGHT; i++) {
+    if (_cmdInFlight[i].opcode == 0x0000) {
+      continue;
+    }
+
+    if ((now - _cmdInFlight[i].start) < HCI_CMD_TIMEOUT) {
+      inFlight = true;
+      continue;
+    }
+
+    PendingCommand command = _cmdInFlight[i];
+
+    _cmdInFlight[i].opcode = 0x0000;
+#ifdef HCI_STATS
+    recordCommand(command.opcode, -1, command.submitted);
 #endif
-        }else{
+
+    // assume the controller dropped it and returned the credit
+    if (_cmdCredits == 0) {
+      _cmdCredits = 1;
+    }
+
+    if (command.callback) {
+      command.callback(command.opcode, -1, 0, NULL, command.context);
+    }
+  }
+
+  if (!inFlight && _cmdCredits == 0 && (now - _cmdLastActivity) >= HCI_CMD_TIMEOUT) {
+    _cmdCredits = 1;
+  }
+
+  sendQueuedCommands();
+}
+
+void HCIClass::commandWaiterComplete(uint16_t /*opcode*/, int status, uint8_t responseLength, uint8_t response[], void* context)
+{
+  CommandWaiter* waiter = (CommandWaiter*)context;
+
+  if (responseLength > sizeof(waiter->response)) {
+    responseLength = sizeof(waiter->response);
+  }
+
+  waiter->done = true;
+  waiter->status = status;
+  waiter->responseLength = responseLength;
+  if (responseLength) {
+    memcpy(waiter->response, response, responseLength);
+  }
+}
+
+void HCIClass::p256CommandComplete(uint16_t opcode, int status, uint8_t /*responseLength*/, uint8_t /*response*/[], void* context)
+{
+  HCIClass* hci = (HCIClass*)context;
+
+  if (status == 0) {
+    // the key or DH key follows in an LE meta event
+    return;
+  }
+
+  if (opcode == (OGF_LE_CTL << 10 | LE_COMMAND::READ_LOCAL_P256)) {
+    hci->_p256KeyState = P256_KEY_NONE;
+    hci->_p256WaitingHandle = 0xffff;
+  } else {
+    hci->_dhKeyPending = false;
+  }
+}
+
+void HCIClass::batchCommandComplete(uint16_t /*opcode*/, int status, uint8_t /*responseLength*/, uint8_t /*response*/[], void* context)
+{
+  HCIClass* hci = (HCIClass*)context;
+
+  if (status != 0 && hci->_cmdBatchStatus == 0) {
+    hci->_cmdBatchStatus = status;
+  }
+
+  if (hci->_cmdBatchPending) {
+    hci->_cmdBatchPending--;
+  }
+}
+
+void HCIClass::handleAclDataPkt(uint16_t /*plen*/, uint8_t pdata[])
+{
+  struct __attribute__ ((packed)) HCIACLHdr {
+    uint16_t handle;
+    uint16_t dlen;
+  } *aclHdr = (HCIACLHdr*)pdata;
+
+  uint16_t handle = aclHdr->handle & 0x0fff;
+  uint16_t aclFlags = (aclHdr->handle & 0x3000) >> 12;
+  uint16_t dlen = aclHdr->dlen;
+  uint8_t* data = &pdata[sizeof(HCIACLHdr)];
+  int context;
+
+  if (aclFlags != 0x01) {
+    // start of a new frame, whatever was left of the previous one is lost
+    aclRxRelease(handle);
+
+    if (dlen >= L2CAP_HDR_LEN) {
+      uint16_t len = data[0] | (data[1] << 8);
+
+      if (len == dlen - L2CAP_HDR_LEN) {
+        // not fragmented, use the recv buffer
+        handleL2capFrame(handle, data[2] | (data[3] << 8), len, &data[L2CAP_HDR_LEN]);
+        return;
+      }
+    }
+
+    context = aclRxContext(0xffff);
+
+    if (context == -1) {
+#ifdef _BLE_TRACE_
+      Serial.println("No reassembly context, dropping frame");
+#endif
+      return;
+    }
+
+    _aclRxContexts[context].handle = handle;
+    _aclRxContexts[context].received = 0;
+  } else {
+    context = aclRxContext(handle);
+
+    if (context == -1) {
+      // the start of this frame was dropped
+      return;
+    }
+  }
+
+  AclRxContext& rx = _aclRxContexts[context];
+
+  while (dlen && rx.received < L2CAP_HDR_LEN) {
+    rx.header[rx.received++] = *data++;
+    dlen--;
+
+    if (rx.received == L2CAP_HDR_LEN && !aclRxAlloc(context, rx.header[0] | (rx.header[1] << 8))) {
+#ifdef _BLE_TRACE_
+      Serial.println("Reassembly pool full, dropping frame");
+#endif
+      rx.handle = 0xffff;
+      return;
+    }
+  }
+
+  if (rx.received < L2CAP_HDR_LEN) {
+    // don't have the L2CAP header yet
+    return;
+  }
+
+  uint16_t len = rx.header[0] | (rx.header[1] << 8);
+  uint16_t payloadReceived = rx.received - L2CAP_HDR_LEN;
+
+  if (dlen > len - payloadReceived) {
+#ifdef _BLE_TRACE_
+    Serial.println("Fragment overflows frame, dropping frame");
+#endif
+    rx.handle = 0xffff;
+    return;
+  }
+
+  memcpy(&_aclRxPool[rx.offset + payloadReceived], data, dlen);
+  rx.received += dlen;
+
+  if (rx.received - L2CAP_HDR_LEN != len) {
+#ifdef _BLE_TRACE_
+    Serial.print("Don't have full packet yet, handle: ");
+    Serial.print(handle, HEX);
+    Serial.print(" received: ");
+    Serial.print(rx.received - L2CAP_HDR_LEN);
+    Serial.print(" of ");
+    Serial.println(len);
+#endif
+    // don't have the full packet yet
+    return;
+  }
+
+  handleL2capFrame(handle, rx.header[2] | (rx.header[3] << 8), len, &_aclRxPool[rx.offset]);
+
+  // the handler may have reused the context for a new frame of the same handle
+  if (rx.handle == handle && rx.received == L2CAP_HDR_LEN + len) {
+    rx.handle = 0xffff;
+  }
+}
+
+void HCIClass::handleL2capFrame(uint16_t handle, uint16_t cid, uint16_t len, uint8_t data[])
+{
+  if (cid == ATT_CID) {
+    ATT.handleData(handle, len, data);
+  } else if (cid == SIGNALING_CID) {
+#ifdef _BLE_TRACE_
+    Serial.println("Signalling");
+#endif
+    L2CAPSignaling.handleData(handle, len, data);
+  } else if (cid == SECURITY_CID){
+    // Security manager
+#ifdef _BLE_TRACE_
+    Serial.println("Security data");
+#endif
+    L2CAPSignaling.handleSecurityData(handle, len, data);
+  }else {
+    struct __attribute__ ((packed)) {
+      uint8_t op;
+      uint8_t id;
+      uint16_t length;
+      uint16_t reason;
+      uint16_t localCid;
+      uint16_t remoteCid;
+    } l2capRejectCid= { 0x01, 0x00, 0x006, 0x0002, cid, 0x0000 };
+#ifdef _BLE_TRACE_
+    Serial.print("rejecting packet cid: 0x");
+    Serial.println(cid,HEX);
+#endif
+
+    sendAclPkt(handle, 0x0005, sizeof(l2capRejectCid), &l2capRejectCid);
+  }
+}
+
+void HCIClass::handleNumCompPkts(uint16_t handle, uint16_t numPkts)
+{
+  if (numPkts && _pendingPkt > numPkts) {
+    _pendingPkt -= numPkts;
+  } else {
+    _pendingPkt = 0;
+  }
+
+  int connection = aclConnection(handle, false);
+
+  if (connection != -1) {
+    HCIAclTxCounters& tx = _aclConnections[connection].tx;
+
+    tx.inFlight = (tx.inFlight > numPkts) ? (tx.inFlight - numPkts) : 0;
+  }
+}
+
+void HCIClass::handleConnectionComplete(uint16_t handle)
+{
+  if (aclConnection(handle, true) == -1) {
+    return;
+  }
+
+  // data length and PHY requests wait for their commands to complete
+  deferJob(&HCIClass::configureConnectionJob, handle);
+}
+
+void HCIClass::handleDisconnect(uint16_t handle)
+{
+  aclRxRelease(handle);
+
+  int connection = aclConnection(handle, false);
+
+  if (connection == -1) {
+    return;
+  }
+
+  AclConnection& aclConnection = _aclConnections[connection];
+
+  // the controller flushes the packets it still holds for a closed connection
+  _pendingPkt = (_pendingPkt > aclConnection.tx.inFlight) ? (_pendingPkt - aclConnection.tx.inFlight) : 0;
+
+  while (aclConnection.txHead != ACL_TX_NONE) {
+    uint8_t index = aclConnection.txHead;
+    AclTxPacket& packet = _aclTxPackets[index];
+
+    aclConnection.txHead = packet.next;
+
+    packet.length = 0;
+    packet.next = _aclTxFree;
+    _aclTxFree = index;
+  }
+
+  aclConnection.txTail = ACL_TX_NONE;
+  memset(&aclConnection.tx, 0x00, sizeof(aclConnection.tx));
+  aclConnection.handle = 0xffff;
+}
+
+// most frequent events first, the tables are searched in order
+const HCIClass::EventHandlerEntry HCIClass::_eventHandlers[] = {
+  { EVT_NUM_COMP_PKTS,     &HCIClass::handleNumCompPktsEvent },
+  { EVT_CMD_COMPLETE,      &HCIClass::handleCmdCompleteEvent },
+  { EVT_CMD_STATUS,        &HCIClass::handleCmdStatusEvent },
+  { EVT_LE_META_EVENT,     &HCIClass::handleLeMetaEvent },
+  { EVT_DISCONN_COMPLETE,  &HCIClass::handleDisconnCompleteEvent },
+  { EVT_ENCRYPTION_CHANGE, &HCIClass::handleEncryptionChangeEvent },
+  { EVT_HARDWARE_ERROR,    &HCIClass::handleHardwareErrorEvent }
+};
+
+const HCIClass::EventHandlerEntry HCIClass::_leMetaEventHandlers[] = {
+  { ADVERTISING_REPORT,          &HCIClass::handleLeAdvertisingReportEvent },
+  { EXTENDED_ADVERTISING_REPORT, &HCIClass::handleLeExtendedAdvertisingReportEvent },
+  { CONN_COMPLETE,               &HCIClass::handleLeConnCompleteEvent },
+  { ENHANCED_CONN_COMPLETE,      &HCIClass::handleLeEnhancedConnCompleteEvent },
+  { DATA_LENGTH_CHANGE,          &HCIClass::handleLeDataLengthChangeEvent },
+  { PHY_UPDATE_COMPLETE,         &HCIClass::handleLePhyUpdateCompleteEvent },
+  { LONG_TERM_KEY_REQUEST,       &HCIClass::handleLeLongTermKeyRequestEvent },
+  { REMOTE_CONN_PARAM_REQ,       &HCIClass::handleLeRemoteConnParamReqEvent },
+  { READ_LOCAL_P256_COMPLETE,    &HCIClass::handleLeReadLocalP256CompleteEvent },
+  { GENERATE_DH_KEY_COMPLETE,    &HCIClass::handleLeGenerateDHKeyCompleteEvent }
+};
+
+void HCIClass::handleEventPkt(uint8_t /*plen*/, uint8_t pdata[])
+{
+  struct __attribute__ ((packed)) HCIEventHdr {
+    uint8_t evt;
+    uint8_t plen;
+  } *eventHdr = (HCIEventHdr*)pdata;
+#ifdef _BLE_TRACE_
+  Serial.print("HCI event: ");
+  Serial.println(eventHdr->evt, HEX);
+#endif
+
+  for (unsigned int i = 0; i < (sizeof(_eventHandlers) / sizeof(_eventHandlers[0])); i++) {
+    if (_eventHandlers[i].code == eventHdr->evt) {
+      (this->*_eventHandlers[i].handler)(eventHdr->plen, &pdata[sizeof(HCIEventHdr)]);
+      return;
+    }
+  }
+
+#ifdef _BLE_TRACE_
+  Serial.println("[Info] Unhandled event");
+#endif
+}
+
+void HCIClass::handleLeMetaEvent(uint8_t plen, uint8_t data[])
+{
+  // a malformed event without a subevent code
+  if (plen < 1) {
+    return;
+  }
+
+  uint8_t subevent = data[0];
+#ifdef _BLE_TRACE_
+  Serial.print("\tSubEvent: 0x");
+  Serial.println(subevent,HEX);
+#endif
+
+  for (unsigned int i = 0; i < (sizeof(_leMetaEventHandlers) / sizeof(_leMetaEventHandlers[0])); i++) {
+    if (_leMetaEventHandlers[i].code == subevent) {
+      (this->*_leMetaEventHandlers[i].handler)(plen - 1, &data[1]);
+      return;
+    }
+  }
+
+#ifdef _BLE_TRACE_
+  Serial.println("[Info] Unhandled meta event");
+#endif
+}
+
+void HCIClass::handleDisconnCompleteEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) DisconnComplete {
+    uint8_t status;
+    uint16_t handle;
+    uint8_t reason;
+  } *disconnComplete = (DisconnComplete*)data;
+
+  if (disconnComplete->status == 0x00) {
+    handleDisconnect(disconnComplete->handle);
+  }
+
+  ATT.removeConnection(disconnComplete->handle, disconnComplete->reason);
+  L2CAPSignaling.removeConnection(disconnComplete->handle, disconnComplete->reason);
+
+  // restarting the advertising waits for several commands
+  deferJob(&HCIClass::resumeAdvertisingJob, disconnComplete->handle);
+}
+
+void HCIClass::handleEncryptionChangeEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EncryptionChange {
+    uint8_t status;
+    uint16_t connectionHandle;
+    uint8_t enabled;
+  } *encryptionChange = (EncryptionChange*)data;
 #ifdef _BLE_TRACE_
-          Serial.println("No enc key distribution");
+  Serial.println("[Info] Encryption changed");
+  Serial.print("status : ");
+  btct.printBytes(&encryptionChange->status,1);
+  Serial.print("handle : ");
+  btct.printBytes((uint8_t*)&encryptionChange->connectionHandle,2);
+  Serial.print("enabled: ");
+  btct.printBytes(&encryptionChange->enabled,1);
 #endif
-        }
-        // From page 1681 bluetooth standard - order matters
-        if(ATT.localKeyDistribution.IdKey()){
-          /// We shall distribute IRK and address using identity information 
-          {
-            uint8_t response[17];
-            response[0] = CONNECTION_IDENTITY_INFORMATION; // Identity information.
-            for(int i=0; i<16; i++) response[16-i] = ATT.localIRK[i];
-            HCI.sendAclPkt(encryptionChange->connectionHandle, SECURITY_CID, sizeof(response), response);
+  if(encryptionChange->enabled>0){
+    // key distribution and the held back ATT responses may wait for buffer space
+    deferJob(&HCIClass::encryptionEnabledJob, encryptionChange->connectionHandle);
+  }else{
+    ATT.setPeerEncryption(encryptionChange->connectionHandle, PEER_ENCRYPTION::NO_ENCRYPTION);
+  }
+}
+
+void HCIClass::handleCmdCompleteEvent(uint8_t plen, uint8_t data[])
+{
+  struct __attribute__ ((packed)) CmdComplete {
+    uint8_t ncmd;
+    uint16_t opcode;
+    uint8_t status;
+  } *cmdCompleteHeader = (CmdComplete*)data;
 #ifdef _BLE_TRACE_
-            Serial.println("Distribute ID Key");
+  Serial.print("E ncmd:   0x");
+  Serial.println(cmdCompleteHeader->ncmd,HEX);
+  Serial.print("E opcode: 0x");
+  Serial.println(cmdCompleteHeader->opcode, HEX);
+  Serial.print("E status: 0x");
+  Serial.println(cmdCompleteHeader->status, HEX);
 #endif
-          }
-          {
-            uint8_t response[8];
-            response[0] = CONNECTION_IDENTITY_ADDRESS; // Identity address information
-            response[1] = 0x00; // Static local address
-            for(int i=0; i<6; i++) response[7-i] = HCI.localAddr[i];
-            HCI.sendAclPkt(encryptionChange->connectionHandle, SECURITY_CID, sizeof(response), response);
-          }
-        }
-        if(ATT.localKeyDistribution.SignKey()){
-          /// We shall distribut CSRK
+  handleCommandComplete(cmdCompleteHeader->ncmd, cmdCompleteHeader->opcode, cmdCompleteHeader->status,
+                        plen - sizeof(CmdComplete), &data[sizeof(CmdComplete)]);
+}
+
+void HCIClass::handleCmdStatusEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) CmdStatus {
+    uint8_t status;
+    uint8_t ncmd;
+    uint16_t opcode;
+  } *cmdStatusHeader = (CmdStatus*)data;
+
 #ifdef _BLE_TRACE_
-          Serial.println("We shall distribute CSRK // not implemented");
+  Serial.print("F n cmd:  0x");
+  Serial.println(cmdStatusHeader->ncmd, HEX);
+  Serial.print("F status: 0x");
+  Serial.println(cmdStatusHeader->status, HEX);
+  Serial.print("F opcode: 0x");
+  Serial.println(cmdStatusHeader->opcode, HEX);
 #endif
+  handleCommandComplete(cmdStatusHeader->ncmd, cmdStatusHeader->opcode, cmdStatusHeader->status, 0, NULL);
+}
 
-        }else{
-          // Serial.println("We don't want to distribute CSRK");
-        }
-        if(ATT.localKeyDistribution.LinkKey()){
+void HCIClass::handleNumCompPktsEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  uint8_t numHandles = data[0];
+  uint16_t* handles = (uint16_t*)&data[sizeof(numHandles)];
+
+  for (uint8_t i = 0; i < numHandles; i++) {
+    handleNumCompPkts(handles[0], handles[1]);
 #ifdef _BLE_TRACE_
-          Serial.println("We would like to use LTK to generate BR/EDR // not implemented");
+    Serial.print("Outstanding packets: ");
+    Serial.println(_pendingPkt);
+    Serial.print("Data[0]: 0x");
+    Serial.println(handles[0]);
+    Serial.print("Data[1]: 0x");
+    Serial.println(handles[1]);
 #endif
-        }
-      }else{
+    handles += 2;
+  }
+
+  sendQueuedAclPkts();
+}
+
+void HCIClass::handleHardwareErrorEvent(uint8_t /*plen*/, uint8_t data[])
+{
 #ifdef _BLE_TRACE_
-        Serial.println("Reconnection, not pairing so no keys");
-        Serial.println(ATT.getPeerEncryption(encryptionChange->connectionHandle),HEX);
+  Serial.print("Bluetooth hardware error.");
+  Serial.print(" Code: 0x");
+  Serial.println(data[0], HEX);
+#else
+  (void)data;
 #endif
-      }
+}
+
+void HCIClass::handleLeConnCompleteEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EvtLeConnectionComplete {
+    uint8_t status;
+    uint16_t handle;
+    uint8_t role;
+    uint8_t peerBdaddrType;
+    uint8_t peerBdaddr[6];
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t supervisionTimeout;
+    uint8_t masterClockAccuracy;
+  } *leConnectionComplete = (EvtLeConnectionComplete*)data;
+
+  if (leConnectionComplete->status == 0x00) {
+    handleConnectionComplete(leConnectionComplete->handle);
+
+    ATT.addConnection(leConnectionComplete->handle,
+                      leConnectionComplete->role,
+                      leConnectionComplete->peerBdaddrType,
+                      leConnectionComplete->peerBdaddr,
+                      leConnectionComplete->interval,
+                      leConnectionComplete->latency,
+                      leConnectionComplete->supervisionTimeout,
+                      leConnectionComplete->masterClockAccuracy);
+
+    L2CAPSignaling.addConnection(leConnectionComplete->handle,
+                          leConnectionComplete->role,
+                          leConnectionComplete->peerBdaddrType,
+                          leConnectionComplete->peerBdaddr,
+                          leConnectionComplete->interval,
+                          leConnectionComplete->latency,
+                          leConnectionComplete->supervisionTimeout,
+                          leConnectionComplete->masterClockAccuracy);
+  }
+}
 
-      ATT.setPeerEncryption(encryptionChange->connectionHandle, PEER_ENCRYPTION::ENCRYPTED_AES);
-      if(ATT.writeBufferSize > 0){
-        ATT.processWriteBuffer();
+void HCIClass::handleLeEnhancedConnCompleteEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EvtLeConnectionComplete {
+    uint8_t status;
+    uint16_t handle;
+    uint8_t role;
+    uint8_t peerBdaddrType;
+    uint8_t peerBdaddr[6];
+    uint8_t localResolvablePrivateAddress[6];
+    uint8_t peerResolvablePrivateAddress[6];
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t supervisionTimeout;
+    uint8_t masterClockAccuracy;
+  } *leConnectionComplete = (EvtLeConnectionComplete*)data;
+
+  if (leConnectionComplete->status == 0x00) {
+    uint8_t peerBdaddrType = leConnectionComplete->peerBdaddrType;
+    uint8_t* peerBdaddr = leConnectionComplete->peerBdaddr;
+
+    if (peerBdaddrType & 0x02) {
+      // resolved by the controller, the rest of the stack keeps using the address the peer
+      // connected with and gets the identity address from tryResolveAddress
+      for (int i = 0; i < 6; i++) {
+        _resolvedPeerAddress[5 - i] = leConnectionComplete->peerResolvablePrivateAddress[i];
+        _resolvedPeerIdentity[5 - i] = peerBdaddr[i];
       }
-      if(ATT.holdBufferSize>0){
+      _resolvedPeerValid = true;
+
+      peerBdaddrType = 0x01;
+      peerBdaddr = leConnectionComplete->peerResolvablePrivateAddress;
+    }
+
+    handleConnectionComplete(leConnectionComplete->handle);
+
+    ATT.addConnection(leConnectionComplete->handle,
+                      leConnectionComplete->role,
+                      peerBdaddrType,
+                      peerBdaddr,
+                      leConnectionComplete->interval,
+                      leConnectionComplete->latency,
+                      leConnectionComplete->supervisionTimeout,
+                      leConnectionComplete->masterClockAccuracy);
+
+    L2CAPSignaling.addConnection(leConnectionComplete->handle,
+                          leConnectionComplete->role,
+                          peerBdaddrType,
+                          peerBdaddr,
+                          leConnectionComplete->interval,
+                          leConnectionComplete->latency,
+                          leConnectionComplete->supervisionTimeout,
+                          leConnectionComplete->masterClockAccuracy);
+  }
+
 #ifdef _BLE_TRACE_
-        Serial.print("Sending queued response size: ");
-        Serial.println(ATT.holdBufferSize);
+  Serial.print("Resolved peer     : ");
+  btct.printBytes(leConnectionComplete->peerResolvablePrivateAddress,6);
+  Serial.print("Resolved local    : ");
+  btct.printBytes(leConnectionComplete->localResolvablePrivateAddress,6);
 #endif
-        HCI.sendAclPkt(encryptionChange->connectionHandle, ATT_CID, ATT.holdBufferSize, ATT.holdBuffer);
-        ATT.holdBufferSize = 0;
-      }
-    }else{
-      ATT.setPeerEncryption(encryptionChange->connectionHandle, PEER_ENCRYPTION::NO_ENCRYPTION);
+}
+
+void HCIClass::handleLeAdvertisingReportEvent(uint8_t plen, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EvtLeAdvertisingReport {
+    uint8_t type;
+    uint8_t peerBdaddrType;
+    uint8_t peerBdaddr[6];
+    uint8_t eirLength;
+    uint8_t eirData[];   // followed by the RSSI
+  } *leAdvertisingReport;
+
+  uint8_t numReports = data[0];
+  int offset = 1;
+  int eventEnd = plen;
+
+  for (int i = 0; i < numReports; i++) {
+    leAdvertisingReport = (EvtLeAdvertisingReport*)&data[offset];
+
+    // the reports that follow can't be located past a bad length
+    if ((offset + (int)sizeof(EvtLeAdvertisingReport)) > eventEnd ||
+        (offset + (int)sizeof(EvtLeAdvertisingReport) + leAdvertisingReport->eirLength + 1) > eventEnd) {
+      break;
+    }
+    offset += sizeof(EvtLeAdvertisingReport) + leAdvertisingReport->eirLength + 1;
+
+    if (leAdvertisingReport->eirLength > 31) {
+      continue;
     }
+
+    int8_t rssi = (int8_t)leAdvertisingReport->eirData[leAdvertisingReport->eirLength];
+
+    GAP.handleLeAdvertisingReport(leAdvertisingReport->type,
+                                  leAdvertisingReport->peerBdaddrType,
+                                  leAdvertisingReport->peerBdaddr,
+                                  leAdvertisingReport->eirLength,
+                                  leAdvertisingReport->eirData,
+                                  rssi);
+  }
+}
+
+void HCIClass::handleLeExtendedAdvertisingReportEvent(uint8_t plen, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EvtLeExtAdvertisingReport {
+    uint16_t eventType;
+    uint8_t peerBdaddrType;
+    uint8_t peerBdaddr[6];
+    uint8_t primaryPhy;
+    uint8_t secondaryPhy;
+    uint8_t sid;
+    int8_t txPower;
+    int8_t rssi;
+    uint16_t periodicInterval;
+    uint8_t directBdaddrType;
+    uint8_t directBdaddr[6];
+    uint8_t dataLength;
+    uint8_t data[];
+  } *leExtAdvertisingReport;
+
+  uint8_t numReports = data[0];
+  int offset = 1;
+  int eventEnd = plen;
+
+  for (int i = 0; i < numReports; i++) {
+    leExtAdvertisingReport = (EvtLeExtAdvertisingReport*)&data[offset];
+
+    if ((offset + (int)sizeof(EvtLeExtAdvertisingReport)) > eventEnd ||
+        (offset + (int)sizeof(EvtLeExtAdvertisingReport) + leExtAdvertisingReport->dataLength) > eventEnd) {
+      break;
+    }
+    offset += sizeof(EvtLeExtAdvertisingReport) + leExtAdvertisingReport->dataLength;
+
+    GAP.handleLeExtendedAdvertisingReport(leExtAdvertisingReport->eventType,
+                                          leExtAdvertisingReport->peerBdaddrType,
+                                          leExtAdvertisingReport->peerBdaddr,
+                                          leExtAdvertisingReport->sid,
+                                          leExtAdvertisingReport->dataLength,
+                                          leExtAdvertisingReport->data,
+                                          leExtAdvertisingReport->rssi);
+  }
+}
+
+void HCIClass::handleLeDataLengthChangeEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EvtLeDataLengthChange {
+    uint16_t handle;
+    uint16_t maxTxOctets;
+    uint16_t maxTxTime;
+    uint16_t maxRxOctets;
+    uint16_t maxRxTime;
+  } *leDataLengthChange = (EvtLeDataLengthChange*)data;
+
+  int connection = aclConnection(leDataLengthChange->handle, false);
+
+  if (connection != -1) {
+    _aclConnections[connection].maxTxOctets = leDataLengthChange->maxTxOctets;
+    _aclConnections[connection].maxRxOctets = leDataLengthChange->maxRxOctets;
   }
-  else if (eventHdr->evt == EVT_CMD_COMPLETE)
-  {
-    struct __attribute__ ((packed)) CmdComplete {
-      uint8_t ncmd;
-      uint16_t opcode;
-      uint8_t status;
-    } *cmdCompleteHeader = (CmdComplete*)&pdata[sizeof(HCIEventHdr)];
 #ifdef _BLE_TRACE_
-    Serial.print("E ncmd:   0x");
-    Serial.println(cmdCompleteHeader->ncmd,HEX);
-    Serial.print("E opcode: 0x");
-    Serial.println(cmdCompleteHeader->opcode, HEX);
-    Serial.print("E status: 0x");
-    Serial.println(cmdCompleteHeader->status, HEX);
+  Serial.print("Data length, tx: ");
+  Serial.print(leDataLengthChange->maxTxOctets);
+  Serial.print(" rx: ");
+  Serial.println(leDataLengthChange->maxRxOctets);
 #endif
-    _cmdCompleteOpcode = cmdCompleteHeader->opcode;
-    _cmdCompleteStatus = cmdCompleteHeader->status;
-    _cmdResponseLen = pdata[1] - sizeof(CmdComplete);
-    _cmdResponse = &pdata[sizeof(HCIEventHdr) + sizeof(CmdComplete)];
+}
 
-  }
-  else if (eventHdr->evt == EVT_CMD_STATUS)
-  {
-    struct __attribute__ ((packed)) CmdStatus {
-      uint8_t status;
-      uint8_t ncmd;
-      uint16_t opcode;
-    } *cmdStatusHeader = (CmdStatus*)&pdata[sizeof(HCIEventHdr)];
+void HCIClass::handleLePhyUpdateCompleteEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EvtLePhyUpdateComplete {
+    uint8_t status;
+    uint16_t handle;
+    uint8_t txPhy;
+    uint8_t rxPhy;
+  } *lePhyUpdateComplete = (EvtLePhyUpdateComplete*)data;
+
+  int connection = aclConnection(lePhyUpdateComplete->handle, false);
 
+  if (lePhyUpdateComplete->status == 0x00 && connection != -1) {
+    _aclConnections[connection].txPhy = phyMask(lePhyUpdateComplete->txPhy);
+    _aclConnections[connection].rxPhy = phyMask(lePhyUpdateComplete->rxPhy);
+  }
 #ifdef _BLE_TRACE_
-    Serial.print("F n cmd:  0x");
-    Serial.println(cmdStatusHeader->ncmd, HEX);
-    Serial.print("F status: 0x");
-    Serial.println(cmdStatusHeader->status, HEX);
-    Serial.print("F opcode: 0x");
-    Serial.println(cmdStatusHeader->opcode, HEX);
-#endif
-    _cmdCompleteOpcode = cmdStatusHeader->opcode;
-    _cmdCompleteStatus = cmdStatusHeader->status;
-    _cmdResponseLen = 0;
-  }
-  else if (eventHdr->evt == EVT_NUM_COMP_PKTS)
-  {
-    uint8_t numHandles = pdata[sizeof(HCIEventHdr)];
-    uint16_t* data = (uint16_t*)&pdata[sizeof(HCIEventHdr) + sizeof(numHandles)];
+  Serial.print("PHY update, status: 0x");
+  Serial.print(lePhyUpdateComplete->status, HEX);
+  Serial.print(" tx: ");
+  Serial.print(lePhyUpdateComplete->txPhy);
+  Serial.print(" rx: ");
+  Serial.println(lePhyUpdateComplete->rxPhy);
+#endif
+}
 
-    for (uint8_t i = 0; i < numHandles; i++) {
-      handleNumCompPkts(data[0], data[1]);
+void HCIClass::handleLeLongTermKeyRequestEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) LTKRequest
+  {
+    uint16_t connectionHandle;
+    uint8_t randomNumber[8];
+    uint8_t encryptedDiversifier[2];
+  } *ltkRequest = (LTKRequest*)data;
 #ifdef _BLE_TRACE_
-      Serial.print("Outstanding packets: ");
-      Serial.println(_pendingPkt);
-      Serial.print("Data[0]: 0x");
-      Serial.println(data[0]);
-      Serial.print("Data[1]: 0x");
-      Serial.println(data[1]);
+  Serial.println("LTK request received");
+  Serial.print("Connection Handle: ");
+  btct.printBytes((uint8_t*)&ltkRequest->connectionHandle,2);
+  Serial.print("Random Number    : ");
+  btct.printBytes(ltkRequest->randomNumber,8);
+  Serial.print("EDIV           : ");
+  btct.printBytes(ltkRequest->encryptedDiversifier,2);
 #endif
-      data += 2;
+  // Load our LTK for this connection.
+  uint8_t peerAddr[7];
+  uint8_t resolvableAddr[6];
+  uint8_t foundLTK;
+  ATT.getPeerAddrWithType(ltkRequest->connectionHandle, peerAddr);
+
+  if((ATT.getPeerEncryption(ltkRequest->connectionHandle) & PEER_ENCRYPTION::PAIRING_REQUEST)>0){
+    // Pairing request - LTK is one in buffer already
+    foundLTK = 1;
+  }else{
+    if(ATT.getPeerResolvedAddress(ltkRequest->connectionHandle, resolvableAddr)){
+      foundLTK = getLTK(resolvableAddr, HCI.LTK);
+    }else{
+      foundLTK = getLTK(&peerAddr[1], HCI.LTK);
     }
   }
-  else if(eventHdr->evt == 0x10)
-  {
+  // Send our LTK back
+  if(foundLTK){
+    struct __attribute__ ((packed)) LTKReply
+    {
+      uint16_t connectionHandle;
+      uint8_t LTK[16];
+    } ltkReply = {0,0};
+    ltkReply.connectionHandle = ltkRequest->connectionHandle;
+    for(int i=0; i<16; i++) ltkReply.LTK[15-i] = HCI.LTK[i];
+    sendCommandAsync(OGF_LE_CTL << 10 | LE_COMMAND::LONG_TERM_KEY_REPLY, sizeof(ltkReply), &ltkReply);
+
 #ifdef _BLE_TRACE_
-    struct __attribute__ ((packed)) CmdHardwareError {
-      uint8_t hardwareCode;
-    } *cmdHardwareError = (CmdHardwareError*)&pdata[sizeof(HCIEventHdr)];
-    Serial.print("Bluetooth hardware error.");
-    Serial.print(" Code: 0x");
-    Serial.println(cmdHardwareError->hardwareCode, HEX);
+    Serial.println("Sending LTK as: ");
+    btct.printBytes(ltkReply.LTK,16);
 #endif
-  }
-  else if (eventHdr->evt == EVT_LE_META_EVENT)
-  {
-    struct __attribute__ ((packed)) LeMetaEventHeader {
-      uint8_t subevent;
-    } *leMetaHeader = (LeMetaEventHeader*)&pdata[sizeof(HCIEventHdr)];
+  }else{
+    /// do LTK rejection
 #ifdef _BLE_TRACE_
-    Serial.print("\tSubEvent: 0x");
-    Serial.println(leMetaHeader->subevent,HEX);
-#endif
-    switch((LE_META_EVENT)leMetaHeader->subevent){
-      case 0x0A:{
-        struct __attribute__ ((packed)) EvtLeConnectionComplete {
-          uint8_t status;
-          uint16_t handle;
-          uint8_t role;
-          uint8_t peerBdaddrType;
-          uint8_t peerBdaddr[6];
-          uint8_t localResolvablePrivateAddress[6];
-          uint8_t peerResolvablePrivateAddress[6];
-          uint16_t interval;
-          uint16_t latency;
-          uint16_t supervisionTimeout;
-          uint8_t masterClockAccuracy;
-        } *leConnectionComplete = (EvtLeConnectionComplete*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
-      
-        if (leConnectionComplete->status == 0x00) {
-          ATT.addConnection(leConnectionComplete->handle,
-                            leConnectionComplete->role,
-                            leConnectionComplete->peerBdaddrType,
-                            leConnectionComplete->peerBdaddr,
-                            leConnectionComplete->interval,
-                            leConnectionComplete->latency,
-                            leConnectionComplete->supervisionTimeout,
-                            leConnectionComplete->masterClockAccuracy);
-
-          L2CAPSignaling.addConnection(leConnectionComplete->handle,
-                                leConnectionComplete->role,
-                                leConnectionComplete->peerBdaddrType,
-                                leConnectionComplete->peerBdaddr,
-                                leConnectionComplete->interval,
-                                leConnectionComplete->latency,
-                                leConnectionComplete->supervisionTimeout,
-                                leConnectionComplete->masterClockAccuracy);
-        }
-        // uint8_t address[6];
-        // uint8_t BDAddr[6];
-        // for(int i=0; i<6; i++) BDAddr[5-i] = leConnectionComplete->peerBdaddr[i];
-        // leReadPeerResolvableAddress(leConnectionComplete->peerBdaddrType,BDAddr,address);
-        // Serial.print("Resolving address: ");
-        // btct.printBytes(BDAddr, 6);
-        // Serial.print("BT answer         : ");
-        // btct.printBytes(address, 6);
+    Serial.println("LTK not found, rejecting");
+#endif
+    sendCommandAsync(OGF_LE_CTL << 10 | LE_COMMAND::LONG_TERM_KEY_NEGATIVE_REPLY,2, &ltkRequest->connectionHandle);
+  }
+}
 
+void HCIClass::handleLeRemoteConnParamReqEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) RemoteConnParamReq {
+    uint16_t connectionHandle;
+    uint16_t intervalMin;
+    uint16_t intervalMax;
+    uint16_t latency;
+    uint16_t timeOut;
+  } *remoteConnParamReq = (RemoteConnParamReq*)data;
 #ifdef _BLE_TRACE_
-        Serial.print("Resolved peer     : ");
-        btct.printBytes(leConnectionComplete->peerResolvablePrivateAddress,6);
-        Serial.print("Resolved local    : ");
-        btct.printBytes(leConnectionComplete->localResolvablePrivateAddress,6);
+  Serial.println("--- Remtoe conn param req");
+  Serial.print("Handle      : ");
+  btct.printBytes((uint8_t*)&remoteConnParamReq->connectionHandle,2);
+  Serial.print("Interval min: ");
+  btct.printBytes((uint8_t*)&remoteConnParamReq->intervalMin,2);
+  Serial.print("Interval max: ");
+  btct.printBytes((uint8_t*)&remoteConnParamReq->intervalMax,2);
+  Serial.print("Latency     : ");
+  btct.printBytes((uint8_t*)&remoteConnParamReq->latency,2);
+  Serial.print("Timeout     : ");
+  btct.printBytes((uint8_t*)&remoteConnParamReq->timeOut,2);
 #endif
-        break;
-      }
-      case CONN_COMPLETE:{
-        struct __attribute__ ((packed)) EvtLeConnectionComplete {
-          uint8_t status;
-          uint16_t handle;
-          uint8_t role;
-          uint8_t peerBdaddrType;
-          uint8_t peerBdaddr[6];
-          uint16_t interval;
-          uint16_t latency;
-          uint16_t supervisionTimeout;
-          uint8_t masterClockAccuracy;
-        } *leConnectionComplete = (EvtLeConnectionComplete*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
-      
-        if (leConnectionComplete->status == 0x00) {
-          ATT.addConnection(leConnectionComplete->handle,
-                            leConnectionComplete->role,
-                            leConnectionComplete->peerBdaddrType,
-                            leConnectionComplete->peerBdaddr,
-                            leConnectionComplete->interval,
-                            leConnectionComplete->latency,
-                            leConnectionComplete->supervisionTimeout,
-                            leConnectionComplete->masterClockAccuracy);
-
-          L2CAPSignaling.addConnection(leConnectionComplete->handle,
-                                leConnectionComplete->role,
-                                leConnectionComplete->peerBdaddrType,
-                                leConnectionComplete->peerBdaddr,
-                                leConnectionComplete->interval,
-                                leConnectionComplete->latency,
-                                leConnectionComplete->supervisionTimeout,
-                                leConnectionComplete->masterClockAccuracy);
-        }
-        // leReadPeerResolvableAddress(leConnectionComplete->peerBdaddrType,BDAddr,address);
-        // Serial.print("Resolving address: ");
-        // btct.printBytes(BDAddr, 6);
-        // Serial.print("BT answer         : ");
-        // btct.printBytes(address, 6);
-        break;
-      }
-      case ADVERTISING_REPORT:{
-        struct __attribute__ ((packed)) EvtLeAdvertisingReport {
-          uint8_t status;
-          uint8_t type;
-          uint8_t peerBdaddrType;
-          uint8_t peerBdaddr[6];
-          uint8_t eirLength;
-          uint8_t eirData[31];
-        } *leAdvertisingReport = (EvtLeAdvertisingReport*)&pdata[sizeof(HCIEventHdr) + sizeof(LeMetaEventHeader)];
-
-        if(leAdvertisingReport->eirLength > sizeof(leAdvertisingReport->eirData)){
-          return ;
-        }
 
-        if (leAdvertisingReport->status == 0x01) {
-          // last byte is RSSI
-          int8_t rssi = leAdvertisingReport->eirData[leAdvertisingReport->eirLength];
+  struct __attribute__ ((packed)) RemoteConnParamReqReply {
+    uint16_t connectionHandle;
+    uint16_t intervalMin;
+    uint16_t intervalMax;
+    uint16_t latency;
+    uint16_t timeOut;
+    uint16_t minLength;
+    uint16_t maxLength;
+  } remoteConnParamReqReply;
+  memcpy(&remoteConnParamReqReply, remoteConnParamReq, sizeof(RemoteConnParamReq));
+
+  remoteConnParamReqReply.minLength = 0x000F;
+  remoteConnParamReqReply.maxLength = 0x0FFF;
+  sendCommandAsync(OGF_LE_CTL << 10 | 0x20, sizeof(RemoteConnParamReqReply), &remoteConnParamReqReply);
+}
 
-          GAP.handleLeAdvertisingReport(leAdvertisingReport->type,
-                                        leAdvertisingReport->peerBdaddrType,
-                                        leAdvertisingReport->peerBdaddr,
-                                        leAdvertisingReport->eirLength,
-                                        leAdvertisingReport->eirData,
-                                        rssi);
-        }
-        break;
-      }
-      case LONG_TERM_KEY_REQUEST:{
-        struct __attribute__ ((packed)) LTKRequest
-        {
-          uint8_t subEventCode;
-          uint16_t connectionHandle;
-          uint8_t randomNumber[8];
-          uint8_t encryptedDiversifier[2];
-        } *ltkRequest = (LTKRequest*)&pdata[sizeof(HCIEventHdr)];
-#ifdef _BLE_TRACE_
-        Serial.println("LTK request received");
-        Serial.print("Connection Handle: ");
-        btct.printBytes((uint8_t*)&ltkRequest->connectionHandle,2);
-        Serial.print("Random Number    : ");
-        btct.printBytes(ltkRequest->randomNumber,8);
-        Serial.print("EDIV           : ");
-        btct.printBytes(ltkRequest->encryptedDiversifier,2);
-#endif
-        // Load our LTK for this connection.
-        uint8_t peerAddr[7];
-        uint8_t resolvableAddr[6];
-        uint8_t foundLTK;
-        ATT.getPeerAddrWithType(ltkRequest->connectionHandle, peerAddr);
-        
-        if((ATT.getPeerEncryption(ltkRequest->connectionHandle) & PEER_ENCRYPTION::PAIRING_REQUEST)>0){
-          // Pairing request - LTK is one in buffer already
-          foundLTK = 1;
-        }else{
-          if(ATT.getPeerResolvedAddress(ltkRequest->connectionHandle, resolvableAddr)){
-            foundLTK = getLTK(resolvableAddr, HCI.LTK);
-          }else{
-            foundLTK = getLTK(&peerAddr[1], HCI.LTK);
-          }
-        }
-        // } //2d
-        // Send our LTK back
-        if(foundLTK){
-          struct __attribute__ ((packed)) LTKReply
-          {
-            uint16_t connectionHandle;
-            uint8_t LTK[16];
-          } ltkReply = {0,0};
-          ltkReply.connectionHandle = ltkRequest->connectionHandle;
-          for(int i=0; i<16; i++) ltkReply.LTK[15-i] = HCI.LTK[i];
-          int result = sendCommand(OGF_LE_CTL << 10 | LE_COMMAND::LONG_TERM_KEY_REPLY,sizeof(ltkReply), &ltkReply);
-
-  #ifdef _BLE_TRACE_
-          Serial.println("Sending LTK as: ");
-          btct.printBytes(ltkReply.LTK,16);
-  #endif
-
-          if(result == 0){
-            struct __attribute__ ((packed)) LTKReplyResult
-            {
-              uint8_t status;
-              uint16_t connectionHandle;
-            } ltkReplyResult = {0,0};
-            memcpy(&ltkReplyResult, _cmdResponse, 3);
-
-  #ifdef _BLE_TRACE_
-            Serial.println("LTK send success");
-            Serial.print("status     : ");
-            btct.printBytes(&ltkReplyResult.status,1);
-            Serial.print("Conn Handle: ");
-            btct.printBytes((uint8_t*)&ltkReplyResult.connectionHandle,2);
-  #endif
-          }else{
-  #ifdef _BLE_TRACE_
-            Serial.print("Failed to send LTK...: ");
-            btct.printBytes((uint8_t*)&result,2);
-  #endif
-          }
-        }else{
-          /// do LTK rejection
+void HCIClass::handleLeReadLocalP256CompleteEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EvtReadLocalP256Complete{
+    uint8_t status;
+    uint8_t localPublicKey[64];
+  } *evtReadLocalP256Complete = (EvtReadLocalP256Complete*)data;
+  if(evtReadLocalP256Complete->status == 0x0){
 #ifdef _BLE_TRACE_
-          Serial.println("LTK not found, rejecting");
+    Serial.println("Key read success");
 #endif
-          sendCommand(OGF_LE_CTL << 10 | LE_COMMAND::LONG_TERM_KEY_NEGATIVE_REPLY,2, &ltkRequest->connectionHandle);
-        }
-        break;
-      }
-      case REMOTE_CONN_PARAM_REQ:{
-        struct __attribute__ ((packed)) RemoteConnParamReq {
-          uint8_t subEventCode;
-          uint16_t connectionHandle;
-          uint16_t intervalMin;
-          uint16_t intervalMax;
-          uint16_t latency;
-          uint16_t timeOut;
-        } *remoteConnParamReq = (RemoteConnParamReq*)&pdata[sizeof(HCIEventHdr)];
-#ifdef _BLE_TRACE_
-        Serial.println("--- Remtoe conn param req");
-        Serial.print("Handle      : ");
-        btct.printBytes((uint8_t*)&remoteConnParamReq->connectionHandle,2);
-        Serial.print("Interval min: ");
-        btct.printBytes((uint8_t*)&remoteConnParamReq->intervalMin,2);
-        Serial.print("Interval max: ");
-        btct.printBytes((uint8_t*)&remoteConnParamReq->intervalMax,2);
-        Serial.print("Latency     : ");
-        btct.printBytes((uint8_t*)&remoteConnParamReq->latency,2);
-        Serial.print("Timeout     : ");
-        btct.printBytes((uint8_t*)&remoteConnParamReq->timeOut,2);
-#endif
-        
-        struct __attribute__ ((packed)) RemoteConnParamReqReply {
-          uint16_t connectionHandle;
-          uint16_t intervalMin;
-          uint16_t intervalMax;
-          uint16_t latency;
-          uint16_t timeOut;
-          uint16_t minLength;
-          uint16_t maxLength;
-        } remoteConnParamReqReply;
-        memcpy(&remoteConnParamReqReply, &remoteConnParamReq->connectionHandle, sizeof(RemoteConnParamReq)-1);
-
-        remoteConnParamReqReply.minLength = 0x000F;
-        remoteConnParamReqReply.maxLength = 0x0FFF;
-        sendCommand(OGF_LE_CTL << 10 | 0x20, sizeof(RemoteConnParamReqReply), &remoteConnParamReqReply);
-        break;
-      }
-      case READ_LOCAL_P256_COMPLETE:{
-        struct __attribute__ ((packed)) EvtReadLocalP256Complete{
-          uint8_t subEventCode;
-          uint8_t status;
-          uint8_t localPublicKey[64];
-        } *evtReadLocalP256Complete = (EvtReadLocalP256Complete*)&pdata[sizeof(HCIEventHdr)];
-        if(evtReadLocalP256Complete->status == 0x0){
+    // a pairing still in progress keeps using localPublicKeyBuffer
+    memcpy(_p256PublicKey, evtReadLocalP256Complete->localPublicKey, 64);
+    _p256KeyState = P256_KEY_READY;
+    _p256KeyUses = 0;
+    _p256KeyTime = millis();
+
+    uint16_t connectionHandle = _p256WaitingHandle;
+    if(connectionHandle == 0xffff){
+      // generated in advance
+      return;
+    }
+    _p256WaitingHandle = 0xffff;
+    _p256KeyUses++;
+    _dhKeyPending = true;
+    memcpy(localPublicKeyBuffer, _p256PublicKey, 64);
+    // the confirm value needs random numbers from the controller
+    deferJob(&HCIClass::sendPairingConfirmJob, connectionHandle);
+  }else{
+    _p256KeyState = P256_KEY_NONE;
+    _p256WaitingHandle = 0xffff;
 #ifdef _BLE_TRACE_
-          Serial.println("Key read success");
-#endif
-          struct __attribute__ ((packed)) PairingPublicKey
-          {
-            uint8_t code;
-            uint8_t publicKey[64];
-          } pairingPublicKey = {CONNECTION_PAIRING_PUBLIC_KEY,0};
-          memcpy(pairingPublicKey.publicKey,evtReadLocalP256Complete->localPublicKey,64);
-          memcpy(localPublicKeyBuffer,      evtReadLocalP256Complete->localPublicKey,64);
-
-          // Send the local public key to the remote
-          uint16_t connectionHandle = ATT.getPeerEncrptingConnectionHandle();
-          if(connectionHandle>ATT_MAX_PEERS){
+    Serial.print("Key read error: 0x");
+    Serial.println(evtReadLocalP256Complete->status,HEX);
+    for(int i=0; i<64; i++){
+      Serial.print(" 0x");
+      Serial.print(evtReadLocalP256Complete->localPublicKey[i],HEX);
+    }
+    Serial.println(".");
+#endif
+  }
+}
+
+void HCIClass::handleLeGenerateDHKeyCompleteEvent(uint8_t /*plen*/, uint8_t data[])
+{
+  struct __attribute__ ((packed)) EvtLeDHKeyComplete{
+    uint8_t status;
+    uint8_t DHKey[32];
+  } *evtLeDHKeyComplete = (EvtLeDHKeyComplete*)data;
+
+  // the private key may change now, the next pairing gets a fresh key pair if this one is used up
+  _dhKeyPending = false;
+  if (_p256KeyState == P256_KEY_READY && localP256KeyExpired()) {
+    generateLocalP256Key();
+  }
+
+  if(evtLeDHKeyComplete->status == 0x0){
 #ifdef _BLE_TRACE_
-            Serial.println("failed to find connection handle");
+    Serial.println("DH key generated");
 #endif
-            break;
-          }
-          HCI.sendAclPkt(connectionHandle,SECURITY_CID,sizeof(PairingPublicKey),&pairingPublicKey);
-          uint8_t encryption = ATT.getPeerEncryption(connectionHandle) | PEER_ENCRYPTION::SENT_PUBKEY;
-          ATT.setPeerEncryption(connectionHandle, encryption);
-          
-
-          uint8_t Z = 0;
-          
-          HCI.leRand(Nb);
-          HCI.leRand(&Nb[8]);
-          
+    uint16_t connectionHandle = ATT.getPeerEncrptingConnectionHandle();
+    if(connectionHandle>ATT_MAX_PEERS){
 #ifdef _BLE_TRACE_
-          Serial.print("nb: ");
-          btct.printBytes(Nb, 16);
-#endif
-          struct __attribute__ ((packed)) F4Params
-          {
-            uint8_t U[32];
-            uint8_t V[32];
-            uint8_t Z;
-          } f4Params = {0,0,Z};
-          for(int i=0; i<32; i++){
-            f4Params.U[31-i] = pairingPublicKey.publicKey[i]; 
-            f4Params.V[31-i] = HCI.remotePublicKeyBuffer[i];
-          }
-          
-          struct __attribute__ ((packed)) PairingConfirm
-          {
-            uint8_t code;
-            uint8_t cb[16];
-          } pairingConfirm = {CONNECTION_PAIRING_CONFIRM,0};
-          
-          btct.AES_CMAC(Nb,(unsigned char *)&f4Params,sizeof(f4Params),pairingConfirm.cb);
+      Serial.println("Failed to find connection handle DH key check");
+#endif
+      return;
+    }
+
+    for(int i=0; i<32; i++) DHKey[31-i] = evtLeDHKeyComplete->DHKey[i];
 
 #ifdef _BLE_TRACE_
-          Serial.print("cb: ");
-          btct.printBytes(pairingConfirm.cb, 16);
+    Serial.println("Stored our DHKey:");
+    btct.printBytes(DHKey,32);
 #endif
+    uint8_t encryption = ATT.getPeerEncryption(connectionHandle) | PEER_ENCRYPTION::DH_KEY_CALULATED;
+    ATT.setPeerEncryption(connectionHandle, encryption);
 
-          uint8_t cb_temp[sizeof(pairingConfirm.cb)];
-          for(int i=0; i<sizeof(pairingConfirm.cb);i++){
-            cb_temp[sizeof(pairingConfirm.cb)-1-i] = pairingConfirm.cb[i];
-          }
-          /// cb wa back to front.
-          memcpy(pairingConfirm.cb,cb_temp,sizeof(pairingConfirm.cb));
-
-          // Send Pairing confirm response
-          HCI.sendAclPkt(connectionHandle, SECURITY_CID, sizeof(pairingConfirm), &pairingConfirm);
-          
-          HCI.sendCommand( (OGF_LE_CTL << 10) | LE_COMMAND::GENERATE_DH_KEY_V1, sizeof(HCI.remotePublicKeyBuffer), HCI.remotePublicKeyBuffer);
-        }else{
+    if((encryption & PEER_ENCRYPTION::RECEIVED_DH_CHECK) > 0){
 #ifdef _BLE_TRACE_
-          Serial.print("Key read error: 0x");
-          Serial.println(evtReadLocalP256Complete->status,HEX);
-          for(int i=0; i<64; i++){
-            Serial.print(" 0x");
-            Serial.print(evtReadLocalP256Complete->localPublicKey[i],HEX);
-          }
-          Serial.println(".");
+      Serial.println("Received DHKey check already so calculate f5, f6 now.");
 #endif
-        }
-        break;
-      }
-      case GENERATE_DH_KEY_COMPLETE:{
-        struct __attribute__ ((packed)) EvtLeDHKeyComplete{
-          uint8_t subEventCode;
-          uint8_t status;
-          uint8_t DHKey[32];
-        } *evtLeDHKeyComplete = (EvtLeDHKeyComplete*)&pdata[sizeof(HCIEventHdr)];
-        if(evtLeDHKeyComplete->status == 0x0){
+      deferJob(&HCIClass::calculateLTKJob, connectionHandle);
+    }else{
 #ifdef _BLE_TRACE_
-          Serial.println("DH key generated");
+      Serial.println("Waiting on other DHKey check before calculating.");
 #endif
-          uint16_t connectionHandle = ATT.getPeerEncrptingConnectionHandle();
-          if(connectionHandle>ATT_MAX_PEERS){
+    }
+  }else{
 #ifdef _BLE_TRACE_
-            Serial.println("Failed to find connection handle DH key check");
+    Serial.print("Key generation error: 0x");
+    Serial.println(evtLeDHKeyComplete->status, HEX);
 #endif
-            break;
-          }
-          
-          
-          for(int i=0; i<32; i++) DHKey[31-i] = evtLeDHKeyComplete->DHKey[i];
+  }
+}
 
-#ifdef _BLE_TRACE_
-          Serial.println("Stored our DHKey:");
-          btct.printBytes(DHKey,32);
-#endif
-          uint8_t encryption = ATT.getPeerEncryption(connectionHandle) | PEER_ENCRYPTION::DH_KEY_CALULATED;
-          ATT.setPeerEncryption(connectionHandle, encryption);
+void HCIClass::deferJob(JobHandler job, uint16_t handle)
+{
+  if (_jobCount >= HCI_JOB_QUEUE_SIZE) {
+    // better late in the event handler than never
+    (this->*job)(handle);
+    return;
+  }
+
+  Job& entry = _jobs[(_jobHead + _jobCount) % HCI_JOB_QUEUE_SIZE];
+
+  entry.handler = job;
+  entry.handle = handle;
+  _jobCount++;
+}
+
+void HCIClass::runJobs()
+{
+  // jobs may poll while they wait, the outer call keeps running the queue in order
+  if (_jobsRunning) {
+    return;
+  }
+
+  _jobsRunning = true;
+
+  while (_jobCount) {
+    Job job = _jobs[_jobHead];
+
+    _jobHead = (_jobHead + 1) % HCI_JOB_QUEUE_SIZE;
+    _jobCount--;
+
+    (this->*job.handler)(job.handle);
+  }
 
-          if((encryption & PEER_ENCRYPTION::RECEIVED_DH_CHECK) > 0){
+  _jobsRunning = false;
+}
+
+void HCIClass::resumeAdvertisingJob(uint16_t /*handle*/)
+{
+  GAP.resumeAdvertising();
+}
+
+void HCIClass::configureConnectionJob(uint16_t handle)
+{
+  // the link may have gone while the job was waiting
+  if (aclConnection(handle, false) == -1) {
+    return;
+  }
+
+  if (leFeatureSupported(LE_FEATURE_DATA_LENGTH_EXTENSION) && _preferredTxOctets > LE_MIN_DATA_OCTETS) {
+    leSetDataLength(handle, _preferredTxOctets, LE_DATA_TIME(_preferredTxOctets));
+  }
+
+  uint8_t phys = _preferredPhys & (BLEPhy1M |
+                                   (leFeatureSupported(LE_FEATURE_2M_PHY) ? BLEPhy2M : 0) |
+                                   (leFeatureSupported(LE_FEATURE_CODED_PHY) ? BLEPhyCoded : 0));
+
+  if (phys & ~BLEPhy1M) {
+    leSetPhy(handle, phys, phys);
+  }
+}
+
+void HCIClass::encryptionEnabledJob(uint16_t connectionHandle)
+{
+  // 0001 1110
+  if((ATT.getPeerEncryption(connectionHandle)&PEER_ENCRYPTION::PAIRING_REQUEST)>0){
+    if(ATT.localKeyDistribution.EncKey()){
 #ifdef _BLE_TRACE_
-            Serial.println("Received DHKey check already so calculate f5, f6 now.");
+      Serial.println("Enc key set but should be ignored");
 #endif
-            L2CAPSignaling.smCalculateLTKandConfirm(connectionHandle, HCI.remoteDHKeyCheckBuffer);
-	  
-          }else{
+    }else{
 #ifdef _BLE_TRACE_
-            Serial.println("Waiting on other DHKey check before calculating.");
+      Serial.println("No enc key distribution");
 #endif
-          }
-        }else{
+    }
+    // From page 1681 bluetooth standard - order matters
+    if(ATT.localKeyDistribution.IdKey()){
+      /// We shall distribute IRK and address using identity information 
+      {
+        uint8_t response[17];
+        response[0] = CONNECTION_IDENTITY_INFORMATION; // Identity information.
+        for(int i=0; i<16; i++) response[16-i] = ATT.localIRK[i];
+        HCI.sendAclPkt(connectionHandle, SECURITY_CID, sizeof(response), response);
 #ifdef _BLE_TRACE_
-          Serial.print("Key generation error: 0x");
-          Serial.println(evtLeDHKeyComplete->status, HEX);
+        Serial.println("Distribute ID Key");
 #endif
-        }
-        break;
       }
-      default:
       {
+        uint8_t response[8];
+        response[0] = CONNECTION_IDENTITY_ADDRESS; // Identity address information
+        response[1] = 0x00; // Static local address
+        for(int i=0; i<6; i++) response[7-i] = HCI.localAddr[i];
+        HCI.sendAclPkt(connectionHandle, SECURITY_CID, sizeof(response), response);
+      }
+    }
+    if(ATT.localKeyDistribution.SignKey()){
+      /// We shall distribut CSRK
 #ifdef _BLE_TRACE_
-        Serial.println("[Info] Unhandled meta event");
+      Serial.println("We shall distribute CSRK // not implemented");
+#endif
+
+    }else{
+      // Serial.println("We don't want to distribute CSRK");
+    }
+    if(ATT.localKeyDistribution.LinkKey()){
+#ifdef _BLE_TRACE_
+      Serial.println("We would like to use LTK to generate BR/EDR // not implemented");
 #endif
-      }
     }
   }else{
 #ifdef _BLE_TRACE_
-    Serial.println("[Info] Unhandled event");
+    Serial.println("Reconnection, not pairing so no keys");
+    Serial.println(ATT.getPeerEncryption(connectionHandle),HEX);
+#endif
+    // restore the subscriptions of the bonded peer
+    ATT.loadCccdValues(connectionHandle);
+  }
+
+  ATT.setPeerEncryption(connectionHandle, PEER_ENCRYPTION::ENCRYPTED_AES);
+  if(ATT.writeBufferSize > 0){
+    ATT.processWriteBuffer();
+  }
+  if(ATT.holdBufferSize>0){
+#ifdef _BLE_TRACE_
+    Serial.print("Sending queued response size: ");
+    Serial.println(ATT.holdBufferSize);
+#endif
+    HCI.sendAclPkt(connectionHandle, ATT_CID, ATT.holdBufferSize, ATT.holdBuffer);
+    ATT.holdBufferSize = 0;
+  }
+}
+
+void HCIClass::sendPairingConfirmJob(uint16_t connectionHandle)
+{
+  struct __attribute__ ((packed)) PairingPublicKey
+  {
+    uint8_t code;
+    uint8_t publicKey[64];
+  } pairingPublicKey = {CONNECTION_PAIRING_PUBLIC_KEY,0};
+  memcpy(pairingPublicKey.publicKey,localPublicKeyBuffer,64);
+
+  // Send the local public key to the remote
+  HCI.sendAclPkt(connectionHandle,SECURITY_CID,sizeof(PairingPublicKey),&pairingPublicKey);
+  uint8_t encryption = ATT.getPeerEncryption(connectionHandle) | PEER_ENCRYPTION::SENT_PUBKEY;
+  ATT.setPeerEncryption(connectionHandle, encryption);
+
+
+  uint8_t Z = 0;
+
+  HCI.leRand(Nb);
+  HCI.leRand(&Nb[8]);
+
+#ifdef _BLE_TRACE_
+  Serial.print("nb: ");
+  btct.printBytes(Nb, 16);
 #endif
+  struct __attribute__ ((packed)) F4Params
+  {
+    uint8_t U[32];
+    uint8_t V[32];
+    uint8_t Z;
+  } f4Params = {0,0,Z};
+  for(int i=0; i<32; i++){
+    f4Params.U[31-i] = pairingPublicKey.publicKey[i]; 
+    f4Params.V[31-i] = HCI.remotePublicKeyBuffer[i];
+  }
+
+  struct __attribute__ ((packed)) PairingConfirm
+  {
+    uint8_t code;
+    uint8_t cb[16];
+  } pairingConfirm = {CONNECTION_PAIRING_CONFIRM,0};
+
+  btct.AES_CMAC(Nb,(unsigned char *)&f4Params,sizeof(f4Params),pairingConfirm.cb);
+
+#ifdef _BLE_TRACE_
+  Serial.print("cb: ");
+  btct.printBytes(pairingConfirm.cb, 16);
+#endif
+
+  uint8_t cb_temp[sizeof(pairingConfirm.cb)];
+  for(int i=0; i<sizeof(pairingConfirm.cb);i++){
+    cb_temp[sizeof(pairingConfirm.cb)-1-i] = pairingConfirm.cb[i];
+  }
+  /// cb wa back to front.
+  memcpy(pairingConfirm.cb,cb_temp,sizeof(pairingConfirm.cb));
+
+  // Send Pairing confirm response
+  HCI.sendAclPkt(connectionHandle, SECURITY_CID, sizeof(pairingConfirm), &pairingConfirm);
+
+  if (!sendCommandAsync( (OGF_LE_CTL << 10) | LE_COMMAND::GENERATE_DH_KEY_V1, sizeof(HCI.remotePublicKeyBuffer), HCI.remotePublicKeyBuffer,
+                         p256CommandComplete, this)) {
+    _dhKeyPending = false;
   }
 }
+
+void HCIClass::calculateLTKJob(uint16_t connectionHandle)
+{
+  L2CAPSignaling.smCalculateLTKandConfirm(connectionHandle, HCI.remoteDHKeyCheckBuffer);
+}
+
 int HCIClass::leEncrypt(uint8_t* key, uint8_t* plaintext, uint8_t* status, uint8_t* ciphertext){
   struct __attribute__ ((packed)) LeEncryptCommand
   {
@@ -1461,12 +3279,12 @@ AuthReq HCIClass::localAuthreq(){
   return LOCAL_AUTHREQ;
 }
 
-void HCIClass::dumpPkt(const char* prefix, uint8_t plen, uint8_t pdata[])
+void HCIClass::dumpPkt(const char* prefix, uint16_t plen, uint8_t pdata[])
 {
   if (_debug) {
     _debug->print(prefix);
 
-    for (uint8_t i = 0; i < plen; i++) {
+    for (uint16_t i = 0; i < plen; i++) {
       byte b = pdata[i];
 
       if (b < 16) {
@@ -23,7 +23,9 @@
 #include <Arduino.h>
 #include "bitDescriptions.h"
 
+#include "ATT.h"
 #include "L2CAPSignaling.h"
+#include "IRKResolver.h"
 
 #define OGF_LINK_CTL           0x01
 #define OGF_HOST_CTL           0x03
@@ -45,12 +47,128 @@ enum LE_META_EVENT {
   ADVERTISING_REPORT        = 0x02,
   LONG_TERM_KEY_REQUEST     = 0x05,
   REMOTE_CONN_PARAM_REQ     = 0x06,
+  DATA_LENGTH_CHANGE        = 0x07,
   READ_LOCAL_P256_COMPLETE  = 0x08,
-  GENERATE_DH_KEY_COMPLETE  = 0x09
+  GENERATE_DH_KEY_COMPLETE  = 0x09,
+  ENHANCED_CONN_COMPLETE    = 0x0A,
+  PHY_UPDATE_COMPLETE       = 0x0C,
+  EXTENDED_ADVERTISING_REPORT = 0x0D
 };
 String metaEventToString(LE_META_EVENT event);
 String commandToString(LE_COMMAND command);
 
+#ifdef __AVR__
+#define HCI_CMD_QUEUE_SIZE    2
+#define HCI_CMD_MAX_IN_FLIGHT 2
+#else
+#define HCI_CMD_QUEUE_SIZE    8
+#define HCI_CMD_MAX_IN_FLIGHT 4
+#endif
+#define HCI_CMD_MAX_QUEUED_PARAMS 64 // large enough for LE Generate DHKey
+#define HCI_CMD_RESPONSE_SIZE     64
+#define HCI_CMD_TIMEOUT           1000
+
+// LE supported features
+#define LE_FEATURE_DATA_LENGTH_EXTENSION (1 << 5)
+#define LE_FEATURE_LL_PRIVACY            (1 << 6)
+#define LE_FEATURE_2M_PHY                (1 << 8)
+#define LE_FEATURE_CODED_PHY             (1 << 11)
+#define LE_FEATURE_EXTENDED_ADVERTISING  (1 << 12)
+
+// link layer payload limits, times assume the 1M PHY
+#define LE_MIN_DATA_OCTETS 27
+#define LE_MAX_DATA_OCTETS 251
+#define LE_DATA_TIME(octets) (((octets) + 14) * 8)
+
+#define HCI_MAX_CONNECTIONS ATT_MAX_PEERS
+#ifdef __AVR__
+#define HCI_ACL_TX_QUEUE_SIZE   4
+#else
+#define HCI_ACL_TX_QUEUE_SIZE   16
+#endif
+// no single connection may take more than half of the queue
+#define HCI_ACL_TX_MAX_PER_CONN (HCI_ACL_TX_QUEUE_SIZE / 2)
+// queued frames are stored in slices of a shared pool, each slice holds an HCI ACL
+// header followed by the L2CAP frame and must fit the largest frame that is sent
+#ifdef __AVR__
+#define HCI_ACL_TX_POOL_SIZE    160  // largest SMP PDU is 65 bytes
+#else
+#define HCI_ACL_TX_POOL_SIZE    2048 // three frames at the largest MTU
+#endif
+
+// work put off by the event handlers until the receive buffer is free
+#ifdef __AVR__
+#define HCI_JOB_QUEUE_SIZE 4
+#else
+#define HCI_JOB_QUEUE_SIZE 8
+#endif
+
+// addresses resolved in software, or found to belong to no bond, are remembered until the
+// peer would have changed them: the recommended private address timeout is 15 minutes
+#ifdef __AVR__
+#define HCI_RPA_CACHE_SIZE    2
+#else
+#define HCI_RPA_CACHE_SIZE    8
+#endif
+#define HCI_RPA_CACHE_TIMEOUT (15 * 60 * 1000UL)
+
+// fragmented incoming L2CAP frames are reassembled in slices of a shared pool,
+// each slice is sized to the frame length announced in its first fragment
+#ifdef __AVR__
+#define HCI_ACL_RX_CONTEXTS   1
+#define HCI_ACL_RX_POOL_SIZE  72   // largest SMP PDU is 65 bytes
+#else
+#define HCI_ACL_RX_CONTEXTS   4
+#define HCI_ACL_RX_POOL_SIZE  1536
+#define HCI_ACL_RX_MAX_MTU    517
+#endif
+
+struct HCIAclTxCounters {
+  uint8_t queued;    // L2CAP frames waiting in the host queue
+  uint8_t inFlight;  // ACL packets handed to the controller and not completed yet
+  uint8_t maxQueued; // high water mark of queued
+  uint32_t sent;     // ACL packets handed to the controller
+  uint32_t rejected; // queueAclPkt calls refused because the queue was full
+};
+
+// define HCI_STATS, here or on the compiler command line, to record per opcode command
+// statistics and the time sendAclPkt waits for buffer space, see commandStats()
+// #define HCI_STATS
+
+#ifdef HCI_STATS
+#ifdef __AVR__
+#define HCI_STATS_OPCODES 4
+typedef uint16_t HCIStatsCount;
+#else
+#define HCI_STATS_OPCODES 16
+typedef uint32_t HCIStatsCount;
+#endif
+// latency histogram: bucket 0 counts waits under HCI_STATS_BUCKET_BASE us,
+// bucket i those under HCI_STATS_BUCKET_BASE << i us, the last one everything longer
+#define HCI_STATS_BUCKETS     16
+#define HCI_STATS_BUCKET_BASE 64
+
+struct HCICommandStats {
+  uint16_t opcode;        // 0xffff for the entry shared by the opcodes that found the table full
+  uint32_t count;         // commands completed or timed out
+  uint32_t errors;        // completed with a non zero status
+  uint32_t timeouts;      // not answered within HCI_CMD_TIMEOUT
+  uint32_t maxLatency;    // us, from submission to completion
+  HCIStatsCount histogram[HCI_STATS_BUCKETS];
+};
+
+struct HCIAclWaitStats {
+  uint32_t count;         // sendAclPkt calls
+  uint32_t waits;         // calls that found the queue full
+  uint32_t maxWait;       // us
+  HCIStatsCount histogram[HCI_STATS_BUCKETS];
+};
+#endif
+
+// status is the HCI status of the command, or -1 if the controller did not answer in time,
+// response is only valid for the duration of the callback
+typedef void (*HCICommandCallback)(uint16_t opcode, int status, uint8_t responseLength, uint8_t response[], void* context);
+
 class HCIClass {
 public:
   HCIClass();
@@ -74,6 +192,25 @@ public:
   virtual int setEventMask(uint64_t eventMask);
   virtual int setLeEventMask(uint64_t leEventMask);
   virtual int readLeBufferSize(uint16_t& pktLen, uint8_t& maxPkt);
+  virtual int leReadLocalSupportedFeatures(uint64_t& features);
+  virtual bool leFeatureSupported(uint64_t feature);
+  virtual int leReadSuggestedDefaultDataLength(uint16_t& txOctets, uint16_t& txTime);
+  virtual int leWriteSuggestedDefaultDataLength(uint16_t txOctets, uint16_t txTime);
+  virtual int leSetDataLength(uint16_t handle, uint16_t txOctets, uint16_t txTime);
+  // octets requested on every new connection, LE_MIN_DATA_OCTETS leaves links at the default
+  virtual void setPreferredDataLength(uint16_t txOctets);
+  virtual uint16_t preferredDataLength();
+  // max payload octets in each direction as last reported by the controller
+  virtual int dataLength(uint16_t handle, uint16_t& txOctets, uint16_t& rxOctets);
+  // PHYs are BLEPhy bit masks
+  virtual int leSetDefaultPhy(uint8_t txPhys, uint8_t rxPhys);
+  virtual int leSetPhy(uint16_t handle, uint8_t txPhys, uint8_t rxPhys);
+  virtual int leReadPhy(uint16_t handle, uint8_t& txPhy, uint8_t& rxPhy);
+  // PHYs requested on every new connection, BLEPhy1M leaves links on the 1M PHY
+  virtual void setPreferredPhy(uint8_t phys);
+  virtual uint8_t preferredPhy();
+  // PHYs in use as last reported by the controller
+  virtual int phy(uint16_t handle, uint8_t& txPhy, uint8_t& rxPhy);
   virtual int leSetRandomAddress(uint8_t addr[6]);
   virtual int leSetAdvertisingParameters(uint16_t minInterval, uint16_t maxInterval,
                                  uint8_t advType, uint8_t ownBdaddrType,
@@ -86,13 +223,38 @@ public:
   virtual int leSetScanParameters(uint8_t type, uint16_t interval, uint16_t window, 
                           uint8_t ownBdaddrType, uint8_t filter);
   virtual int leSetScanEnable(uint8_t enabled, uint8_t duplicates);
+  // once one of the extended advertising, scanning or connection commands has been used,
+  // the controller may reject the legacy ones until it is reset
+  virtual int leSetExtendedAdvertisingParameters(uint8_t handle, uint16_t properties,
+                                 uint32_t minInterval, uint32_t maxInterval,
+                                 uint8_t chanMap, uint8_t ownBdaddrType, uint8_t filter,
+                                 uint8_t primaryPhy, uint8_t secondaryPhy, uint8_t sid);
+  virtual int leSetExtendedAdvertisingData(uint8_t handle, uint8_t length, uint8_t data[]);
+  virtual int leSetExtendedScanResponseData(uint8_t handle, uint8_t length, uint8_t data[]);
+  // no sets disables all of them
+  virtual int leSetExtendedAdvertisingEnable(uint8_t enable, uint8_t numSets, uint8_t handles[]);
+  virtual int leRemoveAdvertisingSet(uint8_t handle);
+  virtual int leReadNumberOfSupportedAdvertisingSets(uint8_t& numSets);
+  // scanning PHYs are a BLEPhy mask without BLEPhy2M, the same parameters are used on each
+  virtual int leSetExtendedScanParameters(uint8_t ownBdaddrType, uint8_t filter, uint8_t phys,
+                                 uint8_t type, uint16_t interval, uint16_t window);
+  virtual int leSetExtendedScanEnable(uint8_t enabled, uint8_t duplicates);
   virtual int leCreateConn(uint16_t interval, uint16_t window, uint8_t initiatorFilter,
                   uint8_t peerBdaddrType, uint8_t peerBdaddr[6], uint8_t ownBdaddrType,
                   uint16_t minInterval, uint16_t maxInterval, uint16_t latency,
                   uint16_t supervisionTimeout, uint16_t minCeLength, uint16_t maxCeLength);
+  virtual int leExtendedCreateConn(uint16_t interval, uint16_t window, uint8_t initiatorFilter,
+                  uint8_t peerBdaddrType, uint8_t peerBdaddr[6], uint8_t ownBdaddrType,
+                  uint16_t minInterval, uint16_t maxInterval, uint16_t latency,
+                  uint16_t supervisionTimeout, uint16_t minCeLength, uint16_t maxCeLength);
   virtual int leConnUpdate(uint16_t handle, uint16_t minInterval, uint16_t maxInterval, 
                   uint16_t latency, uint16_t supervisionTimeout);
   virtual int leCancelConn();
+  // the list can't be changed while scanning, advertising or connecting uses it
+  virtual int leReadFilterAcceptListSize(uint8_t& size);
+  virtual int leClearFilterAcceptList();
+  virtual int leAddDeviceToFilterAcceptList(uint8_t addressType, uint8_t address[6]);
+  virtual int leRemoveDeviceFromFilterAcceptList(uint8_t addressType, uint8_t address[6]);
   virtual int leEncrypt(uint8_t* Key, uint8_t* plaintext, uint8_t* status, uint8_t* ciphertext);
   // Generate a 64 bit random number
   virtual int leRand(uint8_t rand[]);
@@ -100,17 +262,35 @@ public:
   virtual uint8_t localIOCap();
 
   virtual void saveNewAddress(uint8_t addressType, uint8_t* address, uint8_t* peerIrk, uint8_t* remoteIrk);
-  virtual void leAddResolvingAddress(uint8_t addressType, uint8_t* address, uint8_t* peerIrk, uint8_t* remoteIrk);
+  // like the accept list, the resolving list can't be changed while address resolution is enabled
+  virtual int leReadResolvingListSize(uint8_t& size);
+  virtual int leClearResolvingList();
+  virtual int leAddResolvingAddress(uint8_t addressType, uint8_t* address, uint8_t* peerIrk, uint8_t* remoteIrk);
+  virtual int leRemoveResolvingAddress(uint8_t addressType, uint8_t* address);
   virtual int leStopResolvingAddresses();
   virtual int leStartResolvingAddresses();
+  // fills the resolving list with the keys returned by the getIRKs callback and lets the
+  // controller resolve addresses, call it again after bonds were deleted from storage
+  virtual void loadResolvingList();
   virtual int leReadPeerResolvableAddress(uint8_t peerAddressType, uint8_t* peerIdentityAddress, uint8_t* peerResolvableAddress);
 
+  // the local P-256 key pair is generated ahead of pairing and replaced, once no DH key
+  // is being computed with it, after maxPairings pairings or when older than maxAge ms
+  // (0 for no limit), the default is a new key for every pairing
+  virtual void setLocalP256KeyRotation(uint8_t maxPairings, unsigned long maxAge = 0);
+  virtual void generateLocalP256Key();
+  // answers the public key of the remote device with the local one
+  virtual void pairingPublicKeyReceived(uint16_t handle);
+
   virtual void readStoredLKs();
   virtual int readStoredLK(uint8_t BD_ADDR[], uint8_t read_all = 0);
   virtual void writeLK(uint8_t peerAddress[], uint8_t LK[]);
   virtual int tryResolveAddress(uint8_t* BDAddr, uint8_t* address);
 
-  virtual int sendAclPkt(uint16_t handle, uint8_t cid, uint8_t plen, void* data);
+  virtual int sendAclPkt(uint16_t handle, uint8_t cid, uint16_t plen, void* data);
+  // non-blocking version of sendAclPkt, returns 0 if the queue for handle is full
+  virtual int queueAclPkt(uint16_t handle, uint8_t cid, uint16_t plen, void* data);
+  virtual int aclTxCounters(uint16_t handle, HCIAclTxCounters& counters);
 
   virtual int disconnect(uint16_t handle);
 
@@ -119,6 +299,20 @@ public:
 
   // TODO: Send command be private again & use ATT implementation of send command within ATT.
   virtual int sendCommand(uint16_t opcode, uint8_t plen = 0, void* parameters = NULL);
+  // queue a command without waiting for it to complete, returns 0 if the queue is full
+  virtual int sendCommandAsync(uint16_t opcode, uint8_t plen = 0, void* parameters = NULL,
+                               HCICommandCallback callback = NULL, void* context = NULL);
+  // between these calls, commands that only return a status are queued instead of waited for,
+  // endCommandBatch() waits for all of them and returns the first failing status
+  virtual void beginCommandBatch();
+  virtual int endCommandBatch();
+  virtual int pendingCommands();
+#ifdef HCI_STATS
+  // statistics of the index-th opcode sent since the last resetStats(), returns 0 past the last one
+  virtual int commandStats(int index, HCICommandStats& stats);
+  virtual void aclWaitStats(HCIAclWaitStats& stats);
+  virtual void resetStats();
+#endif
   uint8_t remotePublicKeyBuffer[64];
   uint8_t localPublicKeyBuffer[64];
   uint8_t remoteDHKeyCheckBuffer[16];
@@ -139,26 +333,213 @@ public:
 
 private:
 
-  virtual void handleAclDataPkt(uint8_t plen, uint8_t pdata[]);
+  virtual void handleAclDataPkt(uint16_t plen, uint8_t pdata[]);
+  virtual void handleL2capFrame(uint16_t handle, uint16_t cid, uint16_t len, uint8_t data[]);
   virtual void handleNumCompPkts(uint16_t handle, uint16_t numPkts);
+  virtual void handleConnectionComplete(uint16_t handle);
+  virtual void handleDisconnect(uint16_t handle);
   virtual void handleEventPkt(uint8_t plen, uint8_t pdata[]);
 
-  virtual void dumpPkt(const char* prefix, uint8_t plen, uint8_t pdata[]);
+  // event handlers get the event parameters, after the subevent code for LE meta events
+  typedef void (HCIClass::*EventHandler)(uint8_t plen, uint8_t data[]);
+  struct EventHandlerEntry {
+    uint8_t code;
+    EventHandler handler;
+  };
+  static const EventHandlerEntry _eventHandlers[];
+  static const EventHandlerEntry _leMetaEventHandlers[];
+
+  virtual void handleDisconnCompleteEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleEncryptionChangeEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleCmdCompleteEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleCmdStatusEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleNumCompPktsEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleHardwareErrorEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeMetaEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeConnCompleteEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeEnhancedConnCompleteEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeAdvertisingReportEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeExtendedAdvertisingReportEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeDataLengthChangeEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLePhyUpdateCompleteEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeLongTermKeyRequestEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeRemoteConnParamReqEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeReadLocalP256CompleteEvent(uint8_t plen, uint8_t data[]);
+  virtual void handleLeGenerateDHKeyCompleteEvent(uint8_t plen, uint8_t data[]);
+
+  // jobs run from poll() once the packet that queued them has been handled,
+  // so they may send commands and wait for their completion
+  typedef void (HCIClass::*JobHandler)(uint16_t handle);
+  virtual void deferJob(JobHandler job, uint16_t handle);
+  virtual void runJobs();
+
+  virtual void resumeAdvertisingJob(uint16_t handle);
+  virtual void configureConnectionJob(uint16_t handle);
+  virtual void encryptionEnabledJob(uint16_t handle);
+  virtual void sendPairingConfirmJob(uint16_t handle);
+  virtual void calculateLTKJob(uint16_t handle);
+
+  virtual void dumpPkt(const char* prefix, uint16_t plen, uint8_t pdata[]);
+
+  virtual int writeCommand(uint16_t opcode, uint8_t plen, void* parameters,
+                           HCICommandCallback callback, void* context);
+  virtual void sendQueuedCommands();
+  virtual void handleCommandComplete(uint8_t ncmd, uint16_t opcode, int status,
+                                     uint8_t responseLength, uint8_t response[]);
+  virtual void expireCommands();
+  virtual int commandSlotAvailable();
+
+  virtual int aclConnection(uint16_t handle, bool create);
+  virtual int aclTxSpace(int connection, uint16_t plen);
+  virtual int aclTxAlloc(uint16_t size);
+  virtual int enqueueAclPkt(int connection, uint8_t cid, uint16_t plen, void* data);
+  virtual void sendQueuedAclPkts();
+  virtual int aclRxContext(uint16_t handle);
+  virtual int aclRxAlloc(int context, uint16_t length);
+  virtual void aclRxRelease(uint16_t handle);
+
+  // returns 1 and the identity address for a cached match, 0 for a cached miss, -1 when not cached
+  virtual int rpaCacheLookup(uint8_t* BDAddr, uint8_t* address);
+  virtual void rpaCacheStore(uint8_t* BDAddr, uint8_t* identity);
+  virtual void rpaCacheFlush();
+
+#ifdef HCI_STATS
+  virtual void recordCommand(uint16_t opcode, int status, unsigned long submitted);
+#endif
+
+  static void commandWaiterComplete(uint16_t opcode, int status, uint8_t responseLength, uint8_t response[], void* context);
+  static void batchCommandComplete(uint16_t opcode, int status, uint8_t responseLength, uint8_t response[], void* context);
+  static void p256CommandComplete(uint16_t opcode, int status, uint8_t responseLength, uint8_t response[], void* context);
+  virtual bool localP256KeyExpired();
 
   Stream* _debug;
 
   int _recvIndex;
+  uint16_t _recvLength;
   uint8_t _recvBuffer[3 + 255];
 
-  uint16_t _cmdCompleteOpcode;
-  int _cmdCompleteStatus;
   uint8_t _cmdResponseLen;
-  uint8_t* _cmdResponse;
+  uint8_t _cmdResponse[HCI_CMD_RESPONSE_SIZE];
+
+  struct QueuedCommand {
+    uint16_t opcode;
+    uint8_t plen;
+    uint8_t parameters[HCI_CMD_MAX_QUEUED_PARAMS];
+    HCICommandCallback callback;
+    void* context;
+#ifdef HCI_STATS
+    unsigned long queued; // micros()
+#endif
+  } _cmdQueue[HCI_CMD_QUEUE_SIZE];
+  uint8_t _cmdQueueHead;
+  uint8_t _cmdQueueCount;
 
+  struct PendingCommand {
+    uint16_t opcode; // 0x0000 when the slot is free
+    unsigned long start;
+    HCICommandCallback callback;
+    void* context;
+#ifdef HCI_STATS
+    unsigned long submitted; // micros() when queued or, for blocking commands, called
+#endif
+  } _cmdInFlight[HCI_CMD_MAX_IN_FLIGHT];
+  uint8_t _cmdCredits;
+  unsigned long _cmdLastActivity;
+
+  bool _cmdBatch;
+  int _cmdBatchStatus;
+  uint8_t _cmdBatchPending;
+
+#ifdef HCI_STATS
+  unsigned long _cmdSubmitted; // picked up by the next writeCommand
+  HCICommandStats _cmdStats[HCI_STATS_OPCODES];
+  HCIAclWaitStats _aclWaitStats;
+#endif
+
+  uint64_t _leFeatures;
+
+  // tryResolveAddress only resolves in software when some bond did not fit the resolving list
+  bool _addressResolution;
+  bool _resolvingListOverflow;
+  uint8_t _resolvingListSize;
+  uint8_t _resolvingListCount;
+  // set by the enhanced connection complete event for the tryResolveAddress call it causes
+  bool _resolvedPeerValid;
+  uint8_t _resolvedPeerAddress[6];
+  uint8_t _resolvedPeerIdentity[6];
+
+  enum {
+    RPA_CACHE_FREE,
+    RPA_CACHE_RESOLVED,
+    RPA_CACHE_UNRESOLVED
+  };
+  struct RpaCacheEntry {
+    uint8_t state;
+    uint8_t address[6];  // in the order tryResolveAddress gets it
+    uint8_t identity[6];
+    unsigned long seen;  // millis() when resolved
+  } _rpaCache[HCI_RPA_CACHE_SIZE];
+
+  // the bonded IRKs with their expanded keys, complete when no bond was left out
+  IRKResolver _irkResolver;
+  bool _irkResolverComplete;
+
+  enum {
+    P256_KEY_NONE,
+    P256_KEY_PENDING,
+    P256_KEY_READY
+  };
+  uint8_t _p256KeyState;
+  uint8_t _p256KeyUses;
+  uint8_t _p256KeyMaxUses;
+  unsigned long _p256KeyTime;
+  unsigned long _p256KeyMaxAge;
+  uint8_t _p256PublicKey[64];  // of the key pair currently in the controller
+  uint16_t _p256WaitingHandle; // pairing waiting for the key being generated
+  bool _dhKeyPending;          // a pairing needs the current private key for its DH key
+  uint16_t _preferredTxOctets;
+  uint8_t _preferredPhys;
+
+  uint16_t _aclPktLen;
   uint8_t _maxPkt;
   uint8_t _pendingPkt;
 
-  uint8_t _aclPktBuffer[255];
+  struct AclConnection {
+    uint16_t handle; // 0xffff when the slot is free
+    uint8_t txHead;
+    uint8_t txTail;
+    HCIAclTxCounters tx;
+    uint16_t maxTxOctets;
+    uint16_t maxRxOctets;
+    uint8_t txPhy;
+    uint8_t rxPhy;
+  } _aclConnections[HCI_MAX_CONNECTIONS];
+
+  struct AclTxPacket {
+    uint8_t next;
+    uint16_t length; // L2CAP frame length, 0 when the packet is free
+    uint16_t offset; // start of the next fragment to send
+    uint16_t start;  // slice in the pool, room for an HCI ACL header followed by the L2CAP frame
+  } _aclTxPackets[HCI_ACL_TX_QUEUE_SIZE];
+  uint8_t _aclTxPool[HCI_ACL_TX_POOL_SIZE];
+  uint8_t _aclTxFree;
+  uint8_t _aclTxNext; // connection to serve first on the next drain
+
+  struct Job {
+    JobHandler handler;
+    uint16_t handle;
+  } _jobs[HCI_JOB_QUEUE_SIZE];
+  uint8_t _jobHead;
+  uint8_t _jobCount;
+  bool _jobsRunning;
+
+  struct AclRxContext {
+    uint16_t handle;   // 0xffff when the context is free
+    uint16_t received; // L2CAP header and payload bytes received so far
+    uint8_t header[4]; // L2CAP length and channel id
+    uint16_t offset;   // payload slice in the pool, valid once the header is complete
+  } _aclRxContexts[HCI_ACL_RX_CONTEXTS];
+  uint8_t _aclRxPool[HCI_ACL_RX_POOL_SIZE];
 };
 
 extern HCIClass& HCI;
@@ -0,0 +1,223 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "HCICapture.h"
+
+#define HCI_COMMAND_PKT 0x01
+#define HCI_EVENT_PKT   0x04
+
+#define BTSNOOP_FLAG_RECEIVED 0x01
+#define BTSNOOP_FLAG_COMMAND  0x02 // commands and events, as opposed to data
+
+// microseconds from year 0 to 1970, captures start at the Unix epoch
+#define BTSNOOP_EPOCH_DELTA 0x00dcddb30f2f8000ULL
+
+// single core targets only need the compiler to keep the order of the accesses
+#define CAPTURE_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+struct __attribute__ ((packed)) CaptureRecord {
+  uint16_t length;         // original packet length
+  uint16_t includedLength; // bytes following the record in the buffer
+  uint8_t flags;
+  uint32_t drops;          // packets dropped before this one
+  uint32_t timestamp;      // micros()
+};
+
+static const uint8_t btsnoopHeader[16] = {
+  'b', 't', 's', 'n', 'o', 'o', 'p', 0x00,
+  0x00, 0x00, 0x00, 0x01, // version 1
+  0x00, 0x00, 0x03, 0xea  // datalink 1002, HCI UART (H4)
+};
+
+static void putBigEndian(uint8_t* data, uint64_t value, int length)
+{
+  for (int i = length - 1; i >= 0; i--) {
+    data[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+HCICaptureClass::HCICaptureClass() :
+  _buffer(NULL),
+  _size(0),
+  _snapLength(0xffff),
+  _head(0),
+  _tail(0),
+  _dropped(0),
+  _headerWritten(false),
+  _lastTimestamp(0),
+  _timestampWraps(0)
+{
+}
+
+HCICaptureClass::~HCICaptureClass()
+{
+}
+
+void HCICaptureClass::begin(uint8_t* buffer, uint32_t size, uint16_t snapLength)
+{
+  end();
+
+  if (size <= sizeof(CaptureRecord)) {
+    return;
+  }
+
+  _size = size;
+  _snapLength = snapLength;
+  _head = 0;
+  _tail = 0;
+  _dropped = 0;
+  _headerWritten = false;
+  _lastTimestamp = 0;
+  _timestampWraps = 0;
+
+  CAPTURE_BARRIER();
+  _buffer = buffer;
+}
+
+void HCICaptureClass::end()
+{
+  _buffer = NULL;
+}
+
+bool HCICaptureClass::capturing() const
+{
+  return (_buffer != NULL);
+}
+
+void HCICaptureClass::capture(bool received, const uint8_t* packet, uint16_t length)
+{
+  if (_buffer == NULL || length == 0) {
+    return;
+  }
+
+  CaptureRecord record;
+
+  record.length = length;
+  record.includedLength = min(length, _snapLength);
+  record.flags = (received ? BTSNOOP_FLAG_RECEIVED : 0x00) |
+                 ((packet[0] == HCI_COMMAND_PKT || packet[0] == HCI_EVENT_PKT) ? BTSNOOP_FLAG_COMMAND : 0x00);
+  record.drops = _dropped;
+  record.timestamp = micros();
+
+  // one byte stays unused so that a full buffer can be told from an empty one
+  uint32_t head = _head;
+  uint32_t space = (_tail + _size - head - 1) % _size;
+
+  if (space < (sizeof(record) + record.includedLength)) {
+    _dropped++;
+    return;
+  }
+
+  head = put(head, &record, sizeof(record));
+  head = put(head, packet, record.includedLength);
+
+  // the reader may only see the record once it is complete
+  CAPTURE_BARRIER();
+  _head = head;
+}
+
+size_t HCICaptureClass::write(Stream& stream)
+{
+  size_t written = 0;
+
+  if (_buffer == NULL) {
+    return 0;
+  }
+
+  if (!_headerWritten) {
+    written += stream.write(btsnoopHeader, sizeof(btsnoopHeader));
+    _headerWritten = true;
+  }
+
+  uint32_t head = _head;
+  uint32_t tail = _tail;
+
+  CAPTURE_BARRIER();
+
+  while (tail != head) {
+    CaptureRecord record;
+    uint8_t btsnoopRecord[24];
+
+    tail = get(tail, &record, sizeof(record));
+
+    if (record.timestamp < _lastTimestamp) {
+      _timestampWraps++;
+    }
+    _lastTimestamp = record.timestamp;
+
+    // btsnoop fields are big endian
+    putBigEndian(&btsnoopRecord[0], record.length, 4);
+    putBigEndian(&btsnoopRecord[4], record.includedLength, 4);
+    putBigEndian(&btsnoopRecord[8], record.flags, 4);
+    putBigEndian(&btsnoopRecord[12], record.drops, 4);
+    putBigEndian(&btsnoopRecord[16], BTSNOOP_EPOCH_DELTA + (((uint64_t)_timestampWraps << 32) | record.timestamp), 8);
+
+    written += stream.write(btsnoopRecord, sizeof(btsnoopRecord));
+
+    // the packet goes out straight from the buffer, in two parts when it wraps
+    uint32_t first = min((uint32_t)record.includedLength, _size - tail);
+
+    written += stream.write(&_buffer[tail], first);
+    written += stream.write(_buffer, record.includedLength - first);
+    tail = (tail + record.includedLength) % _size;
+
+    CAPTURE_BARRIER();
+    _tail = tail;
+  }
+
+  return written;
+}
+
+uint32_t HCICaptureClass::available() const
+{
+  if (_buffer == NULL) {
+    return 0;
+  }
+
+  return (_head + _size - _tail) % _size;
+}
+
+uint32_t HCICaptureClass::dropped() const
+{
+  return _dropped;
+}
+
+uint32_t HCICaptureClass::put(uint32_t offset, const void* data, uint32_t length)
+{
+  uint32_t first = min(length, _size - offset);
+
+  memcpy(&_buffer[offset], data, first);
+  memcpy(_buffer, (const uint8_t*)data + first, length - first);
+
+  return (offset + length) % _size;
+}
+
+uint32_t HCICaptureClass::get(uint32_t offset, void* data, uint32_t length)
+{
+  uint32_t first = min(length, _size - offset);
+
+  memcpy(data, &_buffer[offset], first);
+  memcpy((uint8_t*)data + first, _buffer, length - first);
+
+  return (offset + length) % _size;
+}
+
+HCICaptureClass HCICaptureObj;
+HCICaptureClass& HCICapture = HCICaptureObj;
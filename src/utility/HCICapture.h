@@ -0,0 +1,73 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _HCI_CAPTURE_H_
+#define _HCI_CAPTURE_H_
+
+#include <Arduino.h>
+
+// Binary capture of the HCI traffic, exported in the btsnoop format (H4 datalink)
+// that Wireshark and extras/arduino-ble-parser.py read.
+//
+// Packets are appended to a ring buffer by the stack and taken out by write(),
+// one writer and one reader never wait on each other. A packet that doesn't
+// fit in the free space is dropped and counted instead of blocking the stack.
+class HCICaptureClass {
+public:
+  HCICaptureClass();
+  virtual ~HCICaptureClass();
+
+  // the buffer belongs to the caller and must stay valid until end(),
+  // only the first snapLength bytes of each packet are kept
+  virtual void begin(uint8_t* buffer, uint32_t size, uint16_t snapLength = 0xffff);
+  virtual void end();
+  virtual bool capturing() const;
+
+  // packet starts with the H4 packet type
+  virtual void capture(bool received, const uint8_t* packet, uint16_t length);
+
+  // write the packets captured so far as btsnoop records and free their space,
+  // the btsnoop file header goes first after begin(), returns the number of bytes written
+  virtual size_t write(Stream& stream);
+
+  // bytes held by captured packets
+  virtual uint32_t available() const;
+  // packets lost because the buffer was full
+  virtual uint32_t dropped() const;
+
+private:
+  uint32_t put(uint32_t offset, const void* data, uint32_t length);
+  uint32_t get(uint32_t offset, void* data, uint32_t length);
+
+  uint8_t* _buffer;
+  uint32_t _size;
+  uint16_t _snapLength;
+
+  volatile uint32_t _head; // only moved by capture()
+  volatile uint32_t _tail; // only moved by write()
+  volatile uint32_t _dropped;
+
+  bool _headerWritten;
+  uint32_t _lastTimestamp;
+  uint32_t _timestampWraps;
+};
+
+extern HCICaptureClass& HCICapture;
+
+#endif
@@ -269,6 +269,17 @@ int HCICordioTransportClass::read()
   return _rxBuf.read_char();
 }
 
+size_t HCICordioTransportClass::readBytes(uint8_t* data, size_t length)
+{
+  size_t count = 0;
+
+  while (count < length && _rxBuf.available()) {
+    data[count++] = _rxBuf.read_char();
+  }
+
+  return count;
+}
+
 size_t HCICordioTransportClass::write(const uint8_t* data, size_t length)
 {
   if (!_begun) {
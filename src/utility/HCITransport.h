@@ -33,6 +33,18 @@ public:
   virtual int peek() = 0;
   virtual int read() = 0;
 
+  // read up to length bytes that are already available, returns the number of bytes read
+  virtual size_t readBytes(uint8_t* data, size_t length)
+  {
+    size_t count = 0;
+
+    while (count < length && available()) {
+      data[count++] = read();
+    }
+
+    return count;
+  }
+
   virtual size_t write(const uint8_t* data, size_t length) = 0;
 };
 
@@ -85,6 +85,17 @@ int HCIUartTransportClass::read()
   return _uart->read();
 }
 
+size_t HCIUartTransportClass::readBytes(uint8_t* data, size_t length)
+{
+  size_t avail = _uart->available();
+
+  if (length > avail) {
+    length = avail;
+  }
+
+  return _uart->readBytes(data, length);
+}
+
 size_t HCIUartTransportClass::write(const uint8_t* data, size_t length)
 {
 #ifdef ARDUINO_AVR_UNO_WIFI_REV2
@@ -129,6 +129,11 @@ int HCIVirtualTransportClass::read()
   return -1;
 }
 
+size_t HCIVirtualTransportClass::readBytes(uint8_t* data, size_t length)
+{
+  return xStreamBufferReceive(rec_buffer, data, length, 0);
+}
+
 size_t HCIVirtualTransportClass::write(const uint8_t* data, size_t length)
 {
   size_t result = xStreamBufferSend(send_buffer,data,length,portMAX_DELAY);
@@ -0,0 +1,126 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "IRKResolver.h"
+
+IRKResolver::IRKResolver() :
+  _count(0)
+{
+}
+
+void IRKResolver::clear()
+{
+  _count = 0;
+}
+
+int IRKResolver::add(const uint8_t identity[6], const uint8_t irk[16])
+{
+  int index = find(identity);
+
+  if (index == -1) {
+    if (_count == IRK_RESOLVER_SIZE) {
+      return 0;
+    }
+
+    index = _count++;
+    memcpy(_identities[index], identity, 6);
+  }
+
+  _ciphers[index].setKey(irk);
+
+  return 1;
+}
+
+int IRKResolver::remove(const uint8_t identity[6])
+{
+  int index = find(identity);
+
+  if (index == -1) {
+    return 0;
+  }
+
+  // keep the entries packed, the last one takes the free slot
+  _count--;
+  if (index != _count) {
+    memcpy(_identities[index], _identities[_count], 6);
+    _ciphers[index] = _ciphers[_count];
+  }
+
+  return 1;
+}
+
+int IRKResolver::count() const
+{
+  return _count;
+}
+
+int IRKResolver::resolve(const uint8_t address[6]) const
+{
+  int result;
+
+  resolve((const uint8_t (*)[6])address, 1, &result);
+
+  return result;
+}
+
+void IRKResolver::resolve(const uint8_t addresses[][6], int count, int results[]) const
+{
+  uint8_t hashes[IRK_RESOLVER_SIZE][BLE_AES128_BLOCK_SIZE];
+  uint8_t prand[BLE_AES128_BLOCK_SIZE];
+
+  for (int i = 0; i < count; i++) {
+    const uint8_t* address = addresses[i];
+
+    results[i] = -1;
+
+    if ((address[0] & 0xc0) != 0x40) {
+      // not a resolvable private address
+      continue;
+    }
+
+    // ah(k, r) = e(k, padding || prand), compared with the hash half of the address
+    memset(prand, 0x00, sizeof(prand));
+    memcpy(&prand[13], address, 3);
+
+    BLEAES128::encrypt(_ciphers, _count, prand, hashes);
+
+    for (int k = 0; k < _count; k++) {
+      if (memcmp(&hashes[k][13], &address[3], 3) == 0) {
+        results[i] = k;
+        break;
+      }
+    }
+  }
+}
+
+const uint8_t* IRKResolver::identity(int index) const
+{
+  return _identities[index];
+}
+
+int IRKResolver::find(const uint8_t identity[6]) const
+{
+  for (int i = 0; i < _count; i++) {
+    if (memcmp(_identities[i], identity, 6) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
@@ -0,0 +1,63 @@
+/*
+  This file is part of the ArduinoBLE library.
+  Copyright (c) 2018 Arduino SA. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _IRK_RESOLVER_H_
+#define _IRK_RESOLVER_H_
+
+#include <Arduino.h>
+
+#include "AES128.h"
+
+#ifdef __AVR__
+#define IRK_RESOLVER_SIZE 2
+#else
+#define IRK_RESOLVER_SIZE 8
+#endif
+
+// Matches resolvable private addresses against the IRKs of the bonded devices.
+//
+// The AES key schedule of every IRK is expanded when it is added, resolving an
+// address then costs one block encryption per IRK (the ah function) and no
+// callback or allocation. Addresses are given most significant byte first, the
+// way btct.ah and HCIClass::tryResolveAddress take them.
+class IRKResolver {
+public:
+  IRKResolver();
+
+  virtual void clear();
+  // replaces the IRK of a known identity address, returns 0 when there is no room left
+  virtual int add(const uint8_t identity[6], const uint8_t irk[16]);
+  virtual int remove(const uint8_t identity[6]);
+  virtual int count() const;
+
+  // index of the IRK that generated the address, -1 when none did
+  virtual int resolve(const uint8_t address[6]) const;
+  // resolves a burst of addresses, results[i] as returned by resolve() for addresses[i]
+  virtual void resolve(const uint8_t addresses[][6], int count, int results[]) const;
+  virtual const uint8_t* identity(int index) const;
+
+private:
+  int find(const uint8_t identity[6]) const;
+
+  uint8_t _count;
+  uint8_t _identities[IRK_RESOLVER_SIZE][6];
+  BLEAES128 _ciphers[IRK_RESOLVER_SIZE];
+};
+
+#endif
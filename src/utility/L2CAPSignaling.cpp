@@ -20,6 +20,7 @@
 #include "HCI.h"
 #include "ATT.h"
 #include "btct.h"
+#include "AESCMAC.h"
 #include "L2CAPSignaling.h"
 #include "keyDistribution.h"
 #include "bitDescriptions.h"
@@ -84,7 +85,7 @@ void L2CAPSignalingClass::addConnection(uint16_t handle, uint8_t role, uint8_t /
   }
 }
 
-void L2CAPSignalingClass::handleData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void L2CAPSignalingClass::handleData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) L2CAPSignalingHdr {
     uint8_t code;
@@ -113,7 +114,7 @@ void L2CAPSignalingClass::handleData(uint16_t connectionHandle, uint8_t dlen, ui
     connectionParameterUpdateResponse(connectionHandle, identifier, length, data);
   }
 }
-void L2CAPSignalingClass::handleSecurityData(uint16_t connectionHandle, uint8_t dlen, uint8_t data[])
+void L2CAPSignalingClass::handleSecurityData(uint16_t connectionHandle, uint16_t dlen, uint8_t data[])
 {
   struct __attribute__ ((packed)) L2CAPSignalingHdr {
     uint8_t code;
@@ -299,6 +300,9 @@ void L2CAPSignalingClass::handleSecurityData(uint16_t connectionHandle, uint8_t
     if(HCI._storeLTK!=0){
       HCI._storeLTK(peerAddress, HCI.LTK);
     }
+    // the bond is stored under the identity address, keep the subscriptions with it
+    ATT.setPeerResolvedAddress(connectionHandle, peerAddress);
+    ATT.storeCccdValues(connectionHandle);
   }
   else if (code == CONNECTION_PAIRING_PUBLIC_KEY){
     /// Received a public key
@@ -330,7 +334,7 @@ void L2CAPSignalingClass::handleSecurityData(uint16_t connectionHandle, uint8_t
     }
     
     memcpy(HCI.remotePublicKeyBuffer,&generateDHKeyCommand,sizeof(generateDHKeyCommand));
-    HCI.sendCommand( (OGF_LE_CTL << 10 )| LE_COMMAND::READ_LOCAL_P256, 0);
+    HCI.pairingPublicKeyReceived(connectionHandle);
   }
   else if(code == CONNECTION_PAIRING_DHKEY_CHECK)
   {
@@ -388,8 +392,9 @@ void L2CAPSignalingClass::smCalculateLTKandConfirm(uint16_t handle, uint8_t expe
   ATT.getPeerIOCap(handle, MasterIOCap);
   for(int i=0; i<16; i++) R[i] = 0;
   
-  btct.f6(MacKey, HCI.Na,HCI.Nb,R, MasterIOCap, remoteAddress, localAddress, Ea);
-  btct.f6(MacKey, HCI.Nb,HCI.Na,R, SlaveIOCap, localAddress, remoteAddress, Eb);
+  BLEAESCMAC macKey(MacKey);
+  btct.f6(macKey, HCI.Na,HCI.Nb,R, MasterIOCap, remoteAddress, localAddress, Ea);
+  btct.f6(macKey, HCI.Nb,HCI.Na,R, SlaveIOCap, localAddress, remoteAddress, Eb);
 
 #ifdef _BLE_TRACE_
   Serial.println("Calculate and confirm LTK via f5, f6:");
@@ -2,6 +2,8 @@
 #include <Arduino.h>
 #include "HCI.h"
 #include "ArduinoBLE.h"
+#include "AES128.h"
+#include "AESCMAC.h"
 BluetoothCryptoToolbox::BluetoothCryptoToolbox(){}
 //    In step 1, AES-128 with key K is applied to an all-zero input block.
 //    In step 2, K1 is derived through the following operation:
@@ -61,53 +63,43 @@ int BluetoothCryptoToolbox::f5(uint8_t DHKey[],uint8_t N_master[], uint8_t N_sla
 #endif
 
     uint8_t T[16];
-
-    struct __attribute__ ((packed)) CmacInput
-    {
-        uint8_t counter;
-        uint8_t keyID[4];
-        uint8_t N1[16];
-        uint8_t N2[16];
-        uint8_t A1[7];
-        uint8_t A2[7];
-        uint8_t length[2];
-    } cmacInput = {0,0,0,0,0,0,0};
-    cmacInput.counter = 0;
-    memcpy(cmacInput.keyID, keyID, 4);
-    memcpy(cmacInput.N1,N_master,16);
-    memcpy(cmacInput.N2,N_slave,16);
-    memcpy(cmacInput.A1,BD_ADDR_master,7);
-    memcpy(cmacInput.A2,BD_ADDR_slave,7);
-    memcpy(cmacInput.length,length,2);
-    AES_CMAC(SALT, DHKey, 32, T);
-
-    AES_CMAC(T, (uint8_t*)&cmacInput,sizeof(cmacInput), MacKey);
-    cmacInput.counter=1;
-    AES_CMAC(T, (uint8_t*)&cmacInput, sizeof(cmacInput), LTK);
+    uint8_t counter = 0;
+
+    BLEAESCMAC cmac(SALT);
+    cmac.compute(DHKey, DHKEY_LENGTH, T);
+
+    // MacKey and LTK only differ in the counter, both are MACed with the key T
+    cmac.setKey(T);
+    for (int i = 0; i < 2; i++) {
+        counter = i;
+        cmac.update(&counter, 1);
+        cmac.update(keyID, 4);
+        cmac.update(N_master, N_LEN);
+        cmac.update(N_slave, N_LEN);
+        cmac.update(BD_ADDR_master, ADDR_LEN + 1);
+        cmac.update(BD_ADDR_slave, ADDR_LEN + 1);
+        cmac.update(length, 2);
+        cmac.finish(i == 0 ? MacKey : LTK);
+    }
 
     return 1;
 }
 int BluetoothCryptoToolbox::f6(uint8_t W[], uint8_t N1[],uint8_t N2[],uint8_t R[], uint8_t IOCap[], uint8_t A1[], uint8_t A2[], uint8_t Ex[])
 {
-    struct __attribute__ ((packed)) F6Input
-    {
-        uint8_t N1[16];
-        uint8_t N2[16];
-        uint8_t R[16];
-        uint8_t IOCap[3];
-        uint8_t A1[7];
-        uint8_t A2[7];
-    } f6Input = {0,0,0,0,0,0};
-
-    memcpy(f6Input.N1, N1, 16);
-    memcpy(f6Input.N2, N2, 16);
-    memcpy(f6Input.R, R, 16);
-    memcpy(f6Input.IOCap, IOCap, 3);
-    memcpy(f6Input.A1, A1, 7);
-    memcpy(f6Input.A2, A2, 7);
+    BLEAESCMAC cmac(W);
 
-
-    AES_CMAC(W, (uint8_t*)&f6Input, sizeof(f6Input),Ex);
+    return f6(cmac, N1, N2, R, IOCap, A1, A2, Ex);
+}
+int BluetoothCryptoToolbox::f6(BLEAESCMAC& cmac, uint8_t N1[],uint8_t N2[],uint8_t R[], uint8_t IOCap[], uint8_t A1[], uint8_t A2[], uint8_t Ex[])
+{
+    cmac.begin();
+    cmac.update(N1, 16);
+    cmac.update(N2, 16);
+    cmac.update(R, 16);
+    cmac.update(IOCap, 3);
+    cmac.update(A1, 7);
+    cmac.update(A2, 7);
+    cmac.finish(Ex);
     return 1;
 }
 // AES_CMAC from RFC
@@ -141,16 +133,12 @@ void BluetoothCryptoToolbox::testAh()
 
 int BluetoothCryptoToolbox::g2(uint8_t U[], uint8_t V[], uint8_t X[], uint8_t Y[], uint8_t out[4])
 {
-    struct __attribute__ ((packed)) CmacInput {
-        uint8_t U[32];
-        uint8_t V[32];
-        uint8_t Y[16];
-    } cmacInput= {0,0,0};
-    memcpy(cmacInput.U,U,32);
-    memcpy(cmacInput.V,V,32);
-    memcpy(cmacInput.Y,Y,16);
     uint8_t intermediate[16];
-    AES_CMAC(X,(uint8_t*)&cmacInput,sizeof(CmacInput),intermediate);
+    BLEAESCMAC cmac(X);
+    cmac.update(U, 32);
+    cmac.update(V, 32);
+    cmac.update(Y, 16);
+    cmac.finish(intermediate);
     memcpy(out,&intermediate[12],4);
     return 1;
 }
@@ -178,58 +166,8 @@ void BluetoothCryptoToolbox::testg2(){
 void BluetoothCryptoToolbox::AES_CMAC ( unsigned char *key, unsigned char *input, int length,
                   unsigned char *mac )
 {
-    unsigned char       X[16],Y[16], M_last[16], padded[16];
-    unsigned char       K1[16], K2[16];
-    int         n, i, flag;
-    generateSubkey(key,K1,K2);
-
-    n = (length+15) / 16;       /* n is number of rounds */
-
-    if ( n == 0 ) {
-        n = 1;
-        flag = 0;
-    } else {
-        if ( (length%16) == 0 ) { /* last block is a complete block */
-            flag = 1;
-        } else { /* last block is not complete block */
-            flag = 0;
-        }
-    }
-
-    if ( flag ) { /* last block is complete block */
-        xor_128(&input[16*(n-1)],K1,M_last);
-    } else {
-        padding(&input[16*(n-1)],padded,length%16);
-        xor_128(padded,K2,M_last);
-    }
-
-    for ( i=0; i<16; i++ ) X[i] = 0;
-    for ( i=0; i<n-1; i++ ) {
-        xor_128(X,&input[16*i],Y); /* Y := Mi (+) X  */
-        AES_128(key,Y,X);      /* X := AES-128(KEY, Y); */
-    }
-
-    xor_128(X,M_last,Y);
-    AES_128(key,Y,X);
-
-    for ( i=0; i<16; i++ ) {
-        mac[i] = X[i];
-    }
-}
-// Paddinng function from RFC
-void BluetoothCryptoToolbox::padding( unsigned char *lastb, unsigned char *pad, int length )
-{
-    int j;
-    /* original last block */
-    for ( j=0; j<16; j++ ) {
-        if ( j < length ) {
-            pad[j] = lastb[j];
-        } else if ( j == length ) {
-            pad[j] = 0x80;
-        } else {
-            pad[j] = 0x00;
-        }
-    }
+    BLEAESCMAC cmac(key);
+    cmac.compute(input, length, mac);
 }
 // Generate subkey from RFC
 void BluetoothCryptoToolbox::generateSubkey(uint8_t* key, uint8_t* K1, uint8_t* K2){
@@ -258,6 +196,7 @@ void BluetoothCryptoToolbox::generateSubkey(uint8_t* key, uint8_t* K1, uint8_t*
     }
     return;
 }
+#ifdef BTCT_CONTROLLER_AES
 // Use BLE AES function - restart bluetooth if crash
 int BluetoothCryptoToolbox::AES_128(uint8_t* key, uint8_t* data_in, uint8_t* data_out){
     uint8_t status = 0;
@@ -278,6 +217,13 @@ int BluetoothCryptoToolbox::AES_128(uint8_t* key, uint8_t* data_in, uint8_t* dat
     }
     return 1;
 }
+#else
+int BluetoothCryptoToolbox::AES_128(uint8_t* key, uint8_t* data_in, uint8_t* data_out){
+    BLEAES128 aes(key);
+    aes.encrypt(data_in, data_out);
+    return 1;
+}
+#endif
 // Tests AES CMAC
 #ifdef _BLE_TRACE_
 void BluetoothCryptoToolbox::test(){